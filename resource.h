@@ -27,6 +27,10 @@
 #define IDC_AUTO_START                  1011
 #define IDC_ANIMATE1                    1012
 #define IDC_DEBUG_LOG                   1012
+#define IDC_SCAN_FILES_PER_SEC          1013
+#define IDC_SCAN_THREADS                1014
+#define IDC_SPAN_COMPOSITE              1015
+#define IDC_SMART_CROP                  1016
 
 // Next default values for new objects
 // 
@@ -34,7 +38,7 @@
 #ifndef APSTUDIO_READONLY_SYMBOLS
 #define _APS_NEXT_RESOURCE_VALUE        104
 #define _APS_NEXT_COMMAND_VALUE         40001
-#define _APS_NEXT_CONTROL_VALUE         1013
+#define _APS_NEXT_CONTROL_VALUE         1017
 #define _APS_NEXT_SYMED_VALUE           101
 #endif
 #endif
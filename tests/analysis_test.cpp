@@ -0,0 +1,169 @@
+// Image analysis: focus point, features and their speed
+
+#include "check.h"
+
+#include <random>
+
+
+// Small copy of a BGRA picture
+SmallImage makeSmall(int width, int height, const vector<BYTE>& pixels)
+{
+    SmallImage small;
+    small.width = width;
+    small.height = height;
+    setSmallImagePixels(small, pixels.data(), 4 * width);
+    return small;
+}
+
+
+void fill(vector<BYTE>& pixels, BYTE blue, BYTE green, BYTE red)
+{
+    for (size_t i = 0; i < pixels.size(); i += 4) {
+        pixels[i] = blue;
+        pixels[i + 1] = green;
+        pixels[i + 2] = red;
+        pixels[i + 3] = 255;
+    }
+}
+
+
+// Black and white squares in a part of the picture
+void drawDetail(vector<BYTE>& pixels, int width, int left, int top, int size)
+{
+    for (int y = top; y < top + size; y++) {
+        for (int x = left; x < left + size; x++) {
+            BYTE value = ((x / 2 + y / 2) % 2) ? 255 : 0;
+            memset(&pixels[4 * (y * width + x)], value, 3);
+        }
+    }
+}
+
+
+void testFocus()
+{
+    const int width = 128;
+    const int height = 72;
+    vector<BYTE> pixels(4 * width * height);
+    USHORT focusX = 0;
+    USHORT focusY = 0;
+
+    // Nothing to look at - the centre
+    fill(pixels, 200, 120, 40);
+    CHECK(findFocus(makeSmall(width, height, pixels), focusX, focusY));
+    CHECK_EQUAL(FOCUS_MAX / 2, (int)focusX);
+    CHECK_EQUAL(FOCUS_MAX / 2, (int)focusY);
+
+    // Detail in a corner pulls the focus there
+    drawDetail(pixels, width, 8, 8, 16);
+    findFocus(makeSmall(width, height, pixels), focusX, focusY);
+    CHECK(focusX < FOCUS_MAX / 4 && focusY < FOCUS_MAX / 3);
+
+    fill(pixels, 200, 120, 40);
+    drawDetail(pixels, width, 100, 44, 20);
+    findFocus(makeSmall(width, height, pixels), focusX, focusY);
+    CHECK(focusX > FOCUS_MAX * 3 / 4 && focusY > FOCUS_MAX * 2 / 3);
+    // Centre of the detail - within a few pixels
+    CHECK(abs((int)focusX - FOCUS_MAX * 110 / width) < FOCUS_MAX * 3 / width);
+    CHECK(abs((int)focusY - FOCUS_MAX * 54 / height) < FOCUS_MAX * 3 / height);
+}
+
+
+void testFeatures()
+{
+    const int width = 64;
+    const int height = 64;
+    vector<BYTE> pixels(4 * width * height);
+    BYTE gray[FEATURE_COUNT];
+    BYTE red[FEATURE_COUNT];
+    BYTE darkRed[FEATURE_COUNT];
+    BYTE detail[FEATURE_COUNT];
+
+    fill(pixels, 100, 100, 100);
+    computeFeatures(makeSmall(width, height, pixels), gray);
+    CHECK(abs((int)gray[FEATURE_LUMINANCE] - 100) <= 1);
+    CHECK_EQUAL(0, (int)gray[FEATURE_SHARPNESS]);
+    // All pixels in the second bin of each colour
+    for (int c = 0; c < 3; c++) {
+        for (int bin = 0; bin < COLOR_BINS; bin++) {
+            CHECK_EQUAL(bin == 1 ? 255 : 0, (int)gray[FEATURE_COLORS + c * COLOR_BINS + bin]);
+        }
+    }
+
+    fill(pixels, 0, 0, 255);
+    computeFeatures(makeSmall(width, height, pixels), red);
+    CHECK_EQUAL(255, (int)red[FEATURE_COLORS + COLOR_BINS - 1]);
+    CHECK_EQUAL(255, (int)red[FEATURE_COLORS + COLOR_BINS]);
+    CHECK_EQUAL(255, (int)red[FEATURE_COLORS + 2 * COLOR_BINS]);
+    CHECK(abs((int)red[FEATURE_LUMINANCE] - 76) <= 1);
+
+    fill(pixels, 0, 0, 160);
+    computeFeatures(makeSmall(width, height, pixels), darkRed);
+
+    // Half of the picture detailed
+    fill(pixels, 100, 100, 100);
+    drawDetail(pixels, width, 0, 0, 32);
+    computeFeatures(makeSmall(width, height, pixels), detail);
+    CHECK(detail[FEATURE_SHARPNESS] > 128);
+
+    // Similar colours are nearer, sharpness does not count
+    CHECK_EQUAL(0, featureDistance(red, red));
+    CHECK_EQUAL(featureDistance(red, gray), featureDistance(gray, red));
+    CHECK(featureDistance(red, darkRed) < featureDistance(red, gray));
+    BYTE blurred[FEATURE_COUNT];
+    memcpy(blurred, gray, FEATURE_COUNT);
+    blurred[FEATURE_SHARPNESS] = 200;
+    CHECK_EQUAL(0, featureDistance(gray, blurred));
+}
+
+
+// Everything done for a decoded image when the catalog is analysed - the decoding (GDI+) excluded
+void benchmarkAnalysis()
+{
+    mt19937 random(31);
+    const int width = ANALYSIS_SIZE;
+    const int height = ANALYSIS_SIZE * 9 / 16;
+    const int count = 20;
+    vector<vector<BYTE>> pictures(count, vector<BYTE>(4 * width * height));
+    for (auto& pixels : pictures) {
+        // Smooth background with some noise and a detail somewhere
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                BYTE* p = &pixels[4 * (y * width + x)];
+                p[0] = (BYTE)(2 * y + random() % 8);
+                p[1] = (BYTE)(x + random() % 8);
+                p[2] = (BYTE)(x + y + random() % 8);
+                p[3] = 255;
+            }
+        }
+        drawDetail(pixels, width, random() % (width - 24), random() % (height - 24), 24);
+    }
+
+    const int rounds = 200;
+    long long focusSum = 0;
+    auto start = chrono::steady_clock::now();
+    for (int r = 0; r < rounds; r++) {
+        for (auto const& pixels : pictures) {
+            SmallImage small = makeSmall(width, height, pixels);
+            USHORT focusX, focusY;
+            BYTE features[FEATURE_COUNT];
+            findFocus(small, focusX, focusY);
+            computeFeatures(small, features);
+            focusSum += focusX + focusY + features[FEATURE_SHARPNESS];
+        }
+    }
+    long long time = microsSince(start);
+    CHECK(focusSum > 0);
+    long long perSecond = (long long)rounds * count * 1000000 / max(time, 1LL);
+    cout << "analysis of " << width << "x" << height << ": " << perSecond << " images/s" << endl;
+    // Far more than images can be decoded
+    CHECK(perSecond > 1000);
+}
+
+
+int main()
+{
+    testFocus();
+    testFeatures();
+    benchmarkAnalysis();
+    return reportChecks("analysis");
+}
@@ -0,0 +1,85 @@
+# Regression test of the batch mode: the program (built with Visual Studio) is run on the images
+# in 'images' and its output is compared with the files in 'expected'. Lines starting with '#'
+# (timings) are left out, the path of the images is replaced by <fixture>.
+#   powershell -ExecutionPolicy Bypass -File tests\batch\run.ps1 -Exe x64\Release\wall.exe
+# With -Record the expected files are written instead - after a change of the output that is intended.
+# Catalogs of the image folders are written where the application keeps them (local application data).
+
+param(
+    [Parameter(Mandatory = $true)] [string] $Exe,
+    [switch] $Record
+)
+
+$fixture = Join-Path $PSScriptRoot 'images'
+$main = Join-Path $fixture 'main'
+$extra = Join-Path $fixture 'extra'
+$expectedDir = Join-Path $PSScriptRoot 'expected'
+# Folders for the watcher are made (and removed) in it by the program
+$watchFolder = Join-Path ([System.IO.Path]::GetTempPath()) 'wall-watch-test'
+New-Item -ItemType Directory -Force -Path $watchFolder | Out-Null
+# Thumbnails are made into their own atlas - new each run, not the one of the application
+$thumbsFile = Join-Path ([System.IO.Path]::GetTempPath()) 'wall-test.thumbs'
+Remove-Item -Path $thumbsFile -ErrorAction SilentlyContinue
+
+# Settings of the user don't count - all runs start from the defaults
+$sources = @('/defaults', '/set', "ImageDirectory=$main", '/set', "ExtraImageDirectories=$extra|3")
+
+$cases = [ordered]@{
+    # Candidates: 16:9 and 9:16 by aspect ratio and size, 32:9 has none - nearest fitting images
+    'query'    = @('/query', '320x180,180x320,640x180') + $sources
+    # Choices, the single 4:3 candidate stays set - calls not needed are avoided
+    'simulate' = @('/simulate', '320x180,180x320,400x300', '5') + $sources + @('/seed', '29')
+    # Thumbnails of all images made - build and random access timings are printed as '#' lines
+    'thumbs'   = @('/thumbs', $thumbsFile) + $sources
+    # Start with a made up catalog of 100k images - startup timings are printed as '#' lines
+    'startup'  = @('/startup', '1920x1080,1080x1920', '100000') + $sources
+    # Idle trim of a made up catalog of 500k images, all of it back after - memory and ticks as '#' lines
+    'trim'     = @('/trim', '1920x1080,1080x1920') + $sources
+    # Watched folders replaced thousands of times - changes still reported, no handles left open
+    'watch'    = @('/watch', $watchFolder, '2000')
+}
+
+
+# Output lines of the program, without timings and with the fixture path replaced
+function Invoke-Wall([string[]] $arguments) {
+    $outFile = [System.IO.Path]::GetTempFileName()
+    $quoted = $arguments | ForEach-Object { '"' + $_ + '"' }
+    $process = Start-Process -FilePath $Exe -ArgumentList $quoted -NoNewWindow -Wait -PassThru -RedirectStandardOutput $outFile
+    $lines = @(Get-Content -Path $outFile -Encoding UTF8 | Where-Object { -not $_.StartsWith('#') } |
+        ForEach-Object { $_.Replace($fixture, '<fixture>') })
+    Remove-Item $outFile
+    return @{ ExitCode = $process.ExitCode; Lines = $lines }
+}
+
+
+$failed = 0
+foreach ($folder in @($main, $extra)) {
+    $scan = Invoke-Wall @('/scan', $folder)
+    if ($scan.ExitCode -ne 0) {
+        Write-Host "scan of $folder failed:"
+        $scan.Lines | Write-Host
+        exit 1
+    }
+}
+
+foreach ($name in $cases.Keys) {
+    $result = Invoke-Wall $cases[$name]
+    $expectedFile = Join-Path $expectedDir "$name.txt"
+    if ($Record) {
+        $result.Lines | Set-Content -Path $expectedFile -Encoding ASCII
+        Write-Host "$name`: recorded"
+        continue
+    }
+    $expected = @(Get-Content -Path $expectedFile)
+    if ($result.ExitCode -ne 0 -or ($expected -join "`n") -ne ($result.Lines -join "`n")) {
+        Write-Host "$name`: FAILED (exit code $($result.ExitCode)), expected:"
+        $expected | Write-Host
+        Write-Host "output:"
+        $result.Lines | Write-Host
+        $failed++
+    }
+    else {
+        Write-Host "$name`: ok"
+    }
+}
+exit $failed
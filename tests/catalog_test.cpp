@@ -0,0 +1,89 @@
+// Sources of images and shards of the catalog
+
+#include "check.h"
+
+
+void testSources()
+{
+    map<wstring, int> sources;
+    parseSources(L"D:\\Pictures\\", 2, L"E:\\Photos|3; F:\\Wallpapers\\\\ ;G:\\Art|x;;", sources);
+    CHECK_EQUAL(4u, sources.size());
+    CHECK_EQUAL(2, sources[L"D:\\Pictures"]);
+    CHECK_EQUAL(3, sources[L"E:\\Photos"]);
+    // Leading space is a part of the name, trailing ones are not
+    CHECK_EQUAL(1, sources[L" F:\\Wallpapers"]);
+    CHECK_EQUAL(1, sources[L"G:\\Art"]);
+
+    // Main folder given with or without backslash is the same source as the extra one
+    parseSources(L"D:\\Pictures\\", 0, L"D:\\Pictures|5", sources);
+    CHECK_EQUAL(1u, sources.size());
+    CHECK_EQUAL(5, sources[L"D:\\Pictures"]);
+
+    parseSources(L"", 1, L"", sources);
+    CHECK(sources.empty());
+}
+
+
+void testShards()
+{
+    map<wstring, ImageInfo> catalog;
+    ImageInfo info = {};
+    const wchar_t* paths[] = { L"D:\\Pictures\\a.jpg", L"D:\\Pictures\\b.jpg", L"D:\\Pictures\\Nature\\c.jpg",
+        L"D:\\Pictures2\\d.jpg", L"D:\\Picture\\e.jpg" };
+    for (const wchar_t* path : paths) {
+        catalog[path] = info;
+    }
+
+    // Subfolders and folders with a similar name are other shards
+    vector<wstring> shard;
+    forEachInShard(catalog, L"D:\\Pictures", [&](map<wstring, ImageInfo>::iterator it) { shard.push_back(it->first); });
+    CHECK_EQUAL(2u, shard.size());
+    forEachInShard(catalog, L"D:\\Pictures\\Nature", [&](map<wstring, ImageInfo>::iterator it) { catalog.erase(it); });
+    CHECK_EQUAL(4u, catalog.size());
+    CHECK(catalog.find(L"D:\\Pictures\\Nature\\c.jpg") == catalog.end());
+}
+
+
+void testUnderAnySource()
+{
+    FilterColumns columns;
+    const wchar_t* paths[] = { L"d:\\pictures\\nature\\a.jpg", L"e:\\photos\\nature\\b.jpg", L"e:\\photos\\city\\c.jpg" };
+    for (const wchar_t* path : paths) {
+        columns.paths.push_back(path);
+        for (auto& column : columns.numbers) {
+            column.push_back(0);
+        }
+    }
+    vector<FilterInstruction> program;
+    wstring error;
+    FilterCompiler compiler;
+    CHECK(compiler.compile(L"path under \"Nature\"", program, error));
+
+    vector<bool> result;
+    vector<wstring> folders = { L"d:\\pictures\\", L"e:\\photos\\" };
+    runFilter(program, columns, set<wstring>(), 0, folders, result);
+    CHECK(result == vector<bool>({ true, true, false }));
+
+    folders.pop_back();
+    runFilter(program, columns, set<wstring>(), 0, folders, result);
+    CHECK(result == vector<bool>({ true, false, false }));
+}
+
+
+void testHashPath()
+{
+    // Case does not matter
+    CHECK_EQUAL(hashPath(L"D:\\Pictures\\A.jpg"), hashPath(L"d:\\pictures\\a.JPG"));
+    CHECK(hashPath(L"D:\\Pictures\\a.jpg") != hashPath(L"D:\\Pictures\\b.jpg"));
+    CHECK_EQUAL(14695981039346656037ULL, hashPath(L""));
+}
+
+
+int main()
+{
+    testSources();
+    testShards();
+    testUnderAnySource();
+    testHashPath();
+    return reportChecks("catalog");
+}
@@ -0,0 +1,49 @@
+//////////////////////////////
+//   Wallpaper Changer - tests
+//////////////////////////////
+
+// Tests of the portable core (wallcore.h) - each test is a small program, it prints failed
+// checks and returns their number. Timings of benchmarks are printed too.
+
+#pragma once
+
+#include "../wallcore.h"
+
+#include <chrono>
+#include <iostream>
+
+
+// Global:
+int failedChecks = 0;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            cerr << __FILE__ << ":" << __LINE__ << ": failed: " << #condition << endl; \
+            failedChecks++; \
+        } \
+    } while (0)
+
+#define CHECK_EQUAL(expected, actual) \
+    do { \
+        auto e = (expected); \
+        auto a = (actual); \
+        if (!(e == a)) { \
+            cerr << __FILE__ << ":" << __LINE__ << ": failed: " << #actual << " is " << a << ", expected " << e << endl; \
+            failedChecks++; \
+        } \
+    } while (0)
+
+
+// Microseconds since the given time
+inline long long microsSince(chrono::steady_clock::time_point start)
+{
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+}
+
+
+inline int reportChecks(const char* test)
+{
+    cout << test << ": " << (failedChecks == 0 ? "ok" : "FAILED") << endl;
+    return failedChecks;
+}
@@ -0,0 +1,76 @@
+# Latency and throughput of the control channel - the program must be running (in this session).
+#   powershell -ExecutionPolicy Bypass -File tests\control\bench.ps1 [-Commands 10000] [-Window 100]
+# The command used is "thumbs" - it doesn't change anything, so the time is the channel's own:
+# pipe, the control thread and the message to the main thread (and some microseconds of PowerShell).
+# Timings are printed, nothing is checked.
+
+param(
+    [int] $Commands = 10000,
+    [int] $Window = 100         # commands sent before the replies are read
+)
+
+$pipeName = 'Wallpaper Changer-' + [System.Diagnostics.Process]::GetCurrentProcess().SessionId
+
+function Connect-Control {
+    $pipe = New-Object System.IO.Pipes.NamedPipeClientStream('.', $pipeName, [System.IO.Pipes.PipeDirection]::InOut)
+    $pipe.Connect(2000)
+    $reader = New-Object System.IO.StreamReader($pipe, [System.Text.Encoding]::UTF8)
+    $writer = New-Object System.IO.StreamWriter($pipe, (New-Object System.Text.UTF8Encoding($false)))
+    $writer.NewLine = "`n"
+    return @{ Pipe = $pipe; Reader = $reader; Writer = $writer }
+}
+
+function Check-Reply([string] $reply) {
+    if ($reply -eq $null -or -not $reply.StartsWith('ok')) {
+        throw "unexpected reply: $reply"
+    }
+}
+
+function Write-Percentiles([string] $name, [double[]] $times) {
+    $sorted = $times | Sort-Object
+    $count = $sorted.Count
+    '{0}: median {1:N1} us, 99th percentile {2:N1} us, max {3:N1} us' -f $name,
+        $sorted[[int]($count / 2)], $sorted[[int](($count - 1) * 0.99)], $sorted[$count - 1]
+}
+
+$ticksPerMicro = [System.Diagnostics.Stopwatch]::Frequency / 1000000.0
+
+# One command at a time on one connection - round trip
+$c = Connect-Control
+$times = New-Object double[] $Commands
+for ($i = 0; $i -lt $Commands; $i++) {
+    $start = [System.Diagnostics.Stopwatch]::GetTimestamp()
+    $c.Writer.WriteLine('thumbs')
+    $c.Writer.Flush()
+    Check-Reply $c.Reader.ReadLine()
+    $times[$i] = ([System.Diagnostics.Stopwatch]::GetTimestamp() - $start) / $ticksPerMicro
+}
+Write-Percentiles 'round trip' $times
+
+# Pipelined - 'Window' commands in one write, then their replies
+$watch = [System.Diagnostics.Stopwatch]::StartNew()
+for ($sent = 0; $sent -lt $Commands; $sent += $Window) {
+    $n = [Math]::Min($Window, $Commands - $sent)
+    $c.Writer.Write(('thumbs' + "`n") * $n)
+    $c.Writer.Flush()
+    for ($i = 0; $i -lt $n; $i++) {
+        Check-Reply $c.Reader.ReadLine()
+    }
+}
+$watch.Stop()
+'pipelined ({0} at once): {1:N0} commands/s' -f $Window, ($Commands / $watch.Elapsed.TotalSeconds)
+$c.Pipe.Dispose()
+
+# New connection for every command - as a script calling the program would do
+$connections = [Math]::Min($Commands, 1000)
+$times = New-Object double[] $connections
+for ($i = 0; $i -lt $connections; $i++) {
+    $start = [System.Diagnostics.Stopwatch]::GetTimestamp()
+    $c = Connect-Control
+    $c.Writer.WriteLine('thumbs')
+    $c.Writer.Flush()
+    Check-Reply $c.Reader.ReadLine()
+    $c.Pipe.Dispose()
+    $times[$i] = ([System.Diagnostics.Stopwatch]::GetTimestamp() - $start) / $ticksPerMicro
+}
+Write-Percentiles 'connect and command' $times
@@ -0,0 +1,119 @@
+// Feature table: lookups, distance and filter queries over the whole catalog
+
+#include "check.h"
+
+#include <random>
+
+
+void setFeatures(BYTE features[FEATURE_COUNT], int luminance, int sharpness, int colorBin)
+{
+    memset(features, 0, FEATURE_COUNT);
+    features[FEATURE_LUMINANCE] = (BYTE)luminance;
+    features[FEATURE_SHARPNESS] = (BYTE)sharpness;
+    for (int c = 0; c < 3; c++) {
+        features[FEATURE_COLORS + c * COLOR_BINS + colorBin] = 255;
+    }
+}
+
+
+void testTable()
+{
+    const wchar_t* paths[] = { L"dark.jpg", L"bright.jpg", L"sharp.jpg", L"gray.jpg" };
+    BYTE features[_countof(paths)][FEATURE_COUNT];
+    setFeatures(features[0], 20, 50, 0);
+    setFeatures(features[1], 230, 50, 3);
+    setFeatures(features[2], 120, 240, 1);
+    setFeatures(features[3], 110, 10, 1);
+
+    FeatureTable table;
+    for (size_t i = 0; i < _countof(paths); i++) {
+        table.add(paths[i], features[i]);
+    }
+    CHECK_EQUAL(_countof(paths), table.size());
+    // Paths are the keys of the catalog - the same pointers
+    CHECK_EQUAL(2, table.indexOf(paths[2]));
+    wstring copy(paths[2]);
+    CHECK_EQUAL(-1, table.indexOf(copy.c_str()));
+    CHECK(memcmp(table.get(1), features[1], FEATURE_COUNT) == 0);
+
+    vector<int> distances;
+    table.distances(features[3], distances);
+    CHECK_EQUAL(_countof(paths), distances.size());
+    CHECK_EQUAL(10, distances[2]);
+    CHECK_EQUAL(0, distances[3]);
+    CHECK_EQUAL(90 + 6 * 255, distances[0]);
+    CHECK_EQUAL(featureDistance(features[3], features[1]), distances[1]);
+
+    // Dark images, then the sharp ones
+    vector<bool> found;
+    table.filter(FEATURE_LUMINANCE, 0, 60, found);
+    CHECK(found == vector<bool>({ true, false, false, false }));
+    table.filter(FEATURE_SHARPNESS, 200, 255, found);
+    CHECK(found == vector<bool>({ false, false, true, false }));
+
+    table.clear();
+    CHECK_EQUAL(0u, table.size());
+    CHECK_EQUAL(-1, table.indexOf(paths[0]));
+    table.distances(features[0], distances);
+    CHECK(distances.empty());
+}
+
+
+// A million images: how long a selection rule waits for its query
+void benchmarkMillion()
+{
+    mt19937 random(32);
+    const size_t size = 1000000;
+    vector<wstring> paths(size);
+    FeatureTable table;
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < size; i++) {
+        BYTE features[FEATURE_COUNT];
+        for (int f = 0; f < FEATURE_COUNT; f++) {
+            features[f] = (BYTE)random();
+        }
+        paths[i] = to_wstring(i);
+        table.add(paths[i].c_str(), features);
+    }
+    long long buildTime = microsSince(start);
+
+    const int rounds = 10;
+    vector<int> distances;
+    vector<bool> found;
+    size_t matches = 0;
+    start = chrono::steady_clock::now();
+    for (int r = 0; r < rounds; r++) {
+        table.distances(table.get(r), distances);
+        matches += count(distances.begin(), distances.end(), 0);
+    }
+    long long distanceTime = microsSince(start) / rounds;
+
+    start = chrono::steady_clock::now();
+    for (int r = 0; r < rounds; r++) {
+        table.filter(FEATURE_LUMINANCE, 0, 64 + r, found);
+        matches += count(found.begin(), found.end(), true);
+    }
+    long long filterTime = microsSince(start) / rounds;
+
+    start = chrono::steady_clock::now();
+    for (int r = 0; r < rounds; r++) {
+        matches += table.indexOf(paths[r * 1000].c_str()) >= 0;
+    }
+    long long lookupTime = microsSince(start);
+
+    // Every image is at distance 0 to itself, a quarter of them is dark
+    CHECK(matches > (size_t)rounds * (1 + size / 4));
+    cout << "features of " << size << ": built in " << buildTime / 1000 << " ms, distances " << distanceTime
+        << " us, filter " << filterTime << " us, " << rounds << " lookups " << lookupTime << " us" << endl;
+    // A rule is evaluated when wallpapers are changed - tens of milliseconds are fine
+    CHECK(distanceTime < 100000);
+    CHECK(filterTime < 100000);
+}
+
+
+int main()
+{
+    testTable();
+    benchmarkMillion();
+    return reportChecks("features");
+}
@@ -0,0 +1,114 @@
+// Image feed: URLs in the index, what is removed from the cache when it is too big
+
+#include "check.h"
+
+#include <random>
+
+
+void testIndex()
+{
+    vector<wstring> urls;
+    parseFeedIndex(L"# wallpapers\r\n"
+        L"a.jpg\r\n"
+        L"\r\n"
+        L"sub/b.jpg  \n"
+        L"https://other.example/c.jpg\n"
+        L"\u00fcber/\u65e5\u672c.jpg",
+        L"http://feed.example/walls/index.txt", urls);
+    vector<wstring> expected = {
+        L"http://feed.example/walls/a.jpg",
+        L"http://feed.example/walls/sub/b.jpg",
+        L"https://other.example/c.jpg",
+        L"http://feed.example/walls/\u00fcber/\u65e5\u672c.jpg"
+    };
+    CHECK(urls == expected);
+
+    // Nothing but comments, and no text at all
+    urls.clear();
+    parseFeedIndex(L"#a.jpg\n\n  \n", L"http://feed.example/index.txt", urls);
+    parseFeedIndex(L"", L"http://feed.example/index.txt", urls);
+    CHECK(urls.empty());
+}
+
+
+FeedCacheFile cached(ULONGLONG size, ULONGLONG mtime, bool part = false, bool shown = false, bool stale = false)
+{
+    FeedCacheFile file = { size, mtime, part, shown, stale };
+    return file;
+}
+
+
+void testEvictions()
+{
+    // Fits - nothing removed
+    vector<FeedCacheFile> files = { cached(100, 3), cached(100, 1), cached(50, 2, true) };
+    CHECK(selectFeedEvictions(files, 250).empty());
+
+    // Parts count: over by 50 - the oldest file goes (the image of mtime 1)
+    CHECK(selectFeedEvictions(files, 200) == vector<size_t>({ 1 }));
+
+    // The oldest is shown - the next oldest goes instead, then another one
+    files[1].shown = true;
+    CHECK(selectFeedEvictions(files, 200) == vector<size_t>({ 2 }));
+    CHECK(selectFeedEvictions(files, 120) == vector<size_t>({ 2, 0 }));
+
+    // Stale part goes even if the cache fits, before older files
+    files = { cached(100, 1), cached(10, 5, true, false, true), cached(100, 2) };
+    CHECK(selectFeedEvictions(files, 1000) == vector<size_t>({ 1 }));
+    CHECK(selectFeedEvictions(files, 150) == vector<size_t>({ 1, 0 }));
+
+    // Everything shown - over the limit, but nothing can go
+    files = { cached(100, 1, false, true), cached(100, 2, false, true) };
+    CHECK(selectFeedEvictions(files, 10).empty());
+}
+
+
+// Big cache: files of random sizes and times, the result fits and only the newest are left
+void testBigCache()
+{
+    mt19937 random(35);
+    vector<FeedCacheFile> files;
+    ULONGLONG total = 0;
+    for (int i = 0; i < 100000; i++) {
+        bool part = random() % 20 == 0;
+        files.push_back(cached(100000 + random() % 5000000, random(), part, !part && random() % 100 == 0,
+            part && random() % 2 == 0));
+        total += files.back().size;
+    }
+    const ULONGLONG maxBytes = total / 3;
+
+    auto start = chrono::steady_clock::now();
+    vector<size_t> evicted = selectFeedEvictions(files, maxBytes);
+    long long time = microsSince(start);
+
+    vector<bool> removed(files.size(), false);
+    ULONGLONG left = total;
+    ULONGLONG newestRemoved = 0;
+    for (size_t i : evicted) {
+        CHECK(!files[i].shown);
+        removed[i] = true;
+        left -= files[i].size;
+        if (!files[i].stale) {
+            newestRemoved = max(newestRemoved, files[i].mtime);
+        }
+    }
+    CHECK(left <= maxBytes);
+    for (size_t i = 0; i < files.size(); i++) {
+        // No stale part left, nothing older than what was removed (except shown images)
+        CHECK(!removed[i] || !files[i].shown);
+        if (!removed[i]) {
+            CHECK(!files[i].stale);
+            CHECK(files[i].shown || files[i].mtime >= newestRemoved);
+        }
+    }
+    cout << "evictions from " << files.size() << " files: " << evicted.size() << " in " << time / 1000 << " ms" << endl;
+}
+
+
+int main()
+{
+    testIndex();
+    testEvictions();
+    testBigCache();
+    return reportChecks("feed");
+}
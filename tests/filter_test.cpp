@@ -0,0 +1,185 @@
+// Filter expressions: compiling to the program and running it over the columns of a catalog
+
+#include "check.h"
+
+#include <random>
+
+
+vector<FilterInstruction> compile(const wstring& expression)
+{
+    vector<FilterInstruction> program;
+    wstring error;
+    FilterCompiler compiler;
+    if (!compiler.compile(expression, program, error)) {
+        wcerr << L"not compiled: \"" << expression << L"\": " << error << endl;
+        failedChecks++;
+    }
+    return program;
+}
+
+
+// Image for the columns: path, width, height, size in KB, day modified, luminance (-1 not analysed)
+void addImage(FilterColumns& columns, const wstring& path, int width, int height, int sizeKB, int day, int luminance)
+{
+    columns.paths.push_back(path);
+    columns.numbers[FieldWidth].push_back(width);
+    columns.numbers[FieldHeight].push_back(height);
+    columns.numbers[FieldSizeKB].push_back(sizeKB);
+    columns.numbers[FieldAgeDays].push_back(day);
+    columns.numbers[FieldLuminance].push_back(luminance);
+    columns.numbers[FieldSharpness].push_back(luminance < 0 ? -1 : 100);
+}
+
+
+// Which images pass - like "1010"
+string run(const wstring& expression, const FilterColumns& columns, const set<wstring>& blocklist)
+{
+    vector<bool> result;
+    vector<wstring> folders = { L"d:\\pictures\\" };
+    runFilter(compile(expression), columns, blocklist, 1000, folders, result);
+    string passed;
+    for (bool p : result) {
+        passed += p ? '1' : '0';
+    }
+    return passed;
+}
+
+
+void testCompile()
+{
+    vector<FilterInstruction> program = compile(L"width >= 3840 and AGE <= 90 and not blocked");
+    CHECK_EQUAL(6u, program.size());
+    if (program.size() == 6) {
+        CHECK(program[0].op == OpCompare && program[0].field == FieldWidth && program[0].cmp == CmpGreaterEqual);
+        CHECK_EQUAL(3840, program[0].value);
+        CHECK(program[1].op == OpCompare && program[1].field == FieldAgeDays && program[1].cmp == CmpLessEqual);
+        CHECK(program[2].op == OpAnd);
+        CHECK(program[3].op == OpBlocked);
+        CHECK(program[4].op == OpNot);
+        CHECK(program[5].op == OpAnd);
+    }
+
+    // "and" binds tighter than "or"
+    program = compile(L"width < 1 or height != 2 and size = 3");
+    CHECK_EQUAL(5u, program.size());
+    if (program.size() == 5) {
+        CHECK(program[0].cmp == CmpLess && program[1].cmp == CmpNotEqual && program[2].cmp == CmpEqual);
+        CHECK(program[3].op == OpAnd);
+        CHECK(program[4].op == OpOr);
+    }
+
+    // Quoted text is lower case, without quotes
+    program = compile(L"(path under \"Nature\\Sea\" or path contains \"SunSet\")");
+    CHECK_EQUAL(3u, program.size());
+    if (program.size() == 3) {
+        CHECK(program[0].op == OpUnder && program[0].text == L"nature\\sea");
+        CHECK(program[1].op == OpContains && program[1].text == L"sunset");
+    }
+
+    CHECK(compile(L"").empty());
+    CHECK(compile(L"   ").empty());
+}
+
+
+void testErrors()
+{
+    const wchar_t* invalid[] = { L"width", L"width >", L"width > x", L"colour < 3", L"path under x", L"path near \"x\"",
+        L"(width > 1", L"width > 1 )", L"path contains \"abc", L"width > 1 or", L"not", L"width > 1 height > 2",
+        L"and width > 1", L"width => 1" };
+    for (const wchar_t* expression : invalid) {
+        vector<FilterInstruction> program;
+        wstring error;
+        FilterCompiler compiler;
+        if (compiler.compile(expression, program, error) || error.empty()) {
+            wcerr << L"accepted: \"" << expression << L"\"" << endl;
+            failedChecks++;
+        }
+    }
+}
+
+
+void testRun()
+{
+    FilterColumns columns;
+    addImage(columns, L"d:\\pictures\\nature\\sea.jpg", 3840, 2160, 2500, 990, 120);
+    addImage(columns, L"d:\\pictures\\nature\\sunset.jpg", 1920, 1080, 800, 500, 60);
+    addImage(columns, L"d:\\pictures\\city.jpg", 5120, 1440, 4000, 999, -1);
+    addImage(columns, L"e:\\other\\nature\\forest.jpg", 1080, 1920, 300, 1000, 200);
+    set<wstring> blocklist = { L"d:\\pictures\\city.jpg" };
+
+    CHECK_EQUAL(string("1111"), run(L"", columns, blocklist));
+    CHECK_EQUAL(string("1010"), run(L"width >= 3840", columns, blocklist));
+    CHECK_EQUAL(string("0101"), run(L"not width >= 3840", columns, blocklist));
+    // Age counts from today (day 1000)
+    CHECK_EQUAL(string("1011"), run(L"age <= 10", columns, blocklist));
+    CHECK_EQUAL(string("0001"), run(L"age = 0", columns, blocklist));
+    // Not analysed image never matches
+    CHECK_EQUAL(string("1001"), run(L"luminance > 100", columns, blocklist));
+    CHECK_EQUAL(string("1101"), run(L"luminance != 0", columns, blocklist));
+    CHECK_EQUAL(string("0010"), run(L"blocked", columns, blocklist));
+    CHECK_EQUAL(string("1101"), run(L"not blocked", columns, blocklist));
+    CHECK_EQUAL(string("0100"), run(L"path contains \"SUNSET\"", columns, blocklist));
+    // Relative to the folder, or absolute
+    CHECK_EQUAL(string("1100"), run(L"path under \"nature\"", columns, blocklist));
+    CHECK_EQUAL(string("0001"), run(L"path under \"E:\\Other\"", columns, blocklist));
+    CHECK_EQUAL(string("0000"), run(L"path under \"natur\"", columns, blocklist));
+    // "and" first - (size > 2000 or width < 2000) and height < 1500 would be 0110
+    CHECK_EQUAL(string("1110"), run(L"size > 2000 or width < 2000 and height < 1500", columns, blocklist));
+    CHECK_EQUAL(string("0100"), run(L"(width > 4000 or height < 2000) and size > 500 and not blocked and age < 600", columns, blocklist));
+}
+
+
+// Complex filters over a million images - the program runs once per catalog or settings change
+void benchmarkMillion()
+{
+    mt19937 random(36);
+    const size_t size = 1000000;
+    const wchar_t* folders[] = { L"d:\\pictures\\nature\\", L"d:\\pictures\\city\\", L"d:\\pictures\\", L"e:\\photos\\2024\\" };
+    FilterColumns columns;
+    columns.paths.reserve(size);
+    set<wstring> blocklist;
+    for (size_t i = 0; i < size; i++) {
+        wstring path = folders[random() % _countof(folders)] + to_wstring(i) + L".jpg";
+        int width = 800 + random() % 7000;
+        addImage(columns, path, width, width * 9 / 16, 100 + random() % 20000, 900 + random() % 101,
+            (int)(random() % 257) - 1);
+        if (i % 1000 == 0) {
+            blocklist.insert(path);
+        }
+    }
+
+    const wchar_t* filters[] = {
+        L"width >= 3840",
+        L"path under \"nature\" and age <= 90 and not blocked",
+        L"(width >= 3840 or size > 10000) and luminance < 80 and not path contains \"city\" and not blocked",
+        L"not (path under \"E:\\Photos\" or path under \"city\") and (age < 30 or width > 6000 and height > 3000) and sharpness >= 0",
+    };
+    vector<wstring> lowerFolders = { L"d:\\pictures\\" };
+    for (const wchar_t* filter : filters) {
+        vector<FilterInstruction> program = compile(filter);
+        vector<bool> result;
+        auto start = chrono::steady_clock::now();
+        runFilter(program, columns, blocklist, 1000, lowerFolders, result);
+        long long time = microsSince(start);
+        CHECK_EQUAL(size, result.size());
+        size_t passed = count(result.begin(), result.end(), true);
+        CHECK(passed > 0 && passed < size);
+        cout << "filter of " << size << ": " << time / 1000 << " ms, " << passed << " passed - ";
+        for (const wchar_t* c = filter; *c != L'\0'; c++) {
+            cout << (char)*c;
+        }
+        cout << endl;
+        // Far below the time of reading the catalog
+        CHECK(time < 2000000);
+    }
+}
+
+
+int main()
+{
+    testCompile();
+    testErrors();
+    testRun();
+    benchmarkMillion();
+    return reportChecks("filter");
+}
@@ -0,0 +1,182 @@
+// Wallpaper history: navigation, capacity, saving and loading
+
+#include "check.h"
+
+
+// Hashes of images still in the catalog
+set<ULONGLONG> knownImages;
+
+bool isKnown(ULONGLONG hash)
+{
+    return knownImages.find(hash) != knownImages.end();
+}
+
+
+// Entry reached by going back or forward - 0 if there is none
+ULONGLONG go(HistoryRings& history, const wstring& monitor, bool back)
+{
+    ULONGLONG hash = 0;
+    return history.move(monitor, back, isKnown, hash) ? hash : 0;
+}
+
+
+void testNavigation()
+{
+    knownImages = { 1, 2, 3, 4, 5, 6 };
+    HistoryRings history;
+    CHECK_EQUAL(0ull, go(history, L"M0", true));
+    for (ULONGLONG image = 1; image <= 4; image++) {
+        history.record(L"M0", image);
+    }
+    // Recording the current entry again changes nothing
+    history.record(L"M0", 4);
+    history.record(L"M1", 6);
+
+    CHECK_EQUAL(3ull, go(history, L"M0", true));
+    CHECK_EQUAL(2ull, go(history, L"M0", true));
+    CHECK_EQUAL(3ull, go(history, L"M0", false));
+    // Monitors have their own rings
+    CHECK_EQUAL(0ull, go(history, L"M1", true));
+
+    // Image gone from the catalog is skipped
+    knownImages.erase(2);
+    CHECK_EQUAL(1ull, go(history, L"M0", true));
+    CHECK_EQUAL(0ull, go(history, L"M0", true));
+    CHECK_EQUAL(3ull, go(history, L"M0", false));
+    knownImages.insert(2);
+
+    // New wallpaper after going back drops the newer entries
+    history.record(L"M0", 5);
+    CHECK_EQUAL(0ull, go(history, L"M0", false));
+    CHECK_EQUAL(3ull, go(history, L"M0", true));
+
+    set<ULONGLONG> current;
+    history.getCurrent(current);
+    CHECK(current == set<ULONGLONG>({ 3, 6 }));
+}
+
+
+void testCapacity()
+{
+    knownImages.clear();
+    HistoryRings history;
+    history.setCapacity(3);
+    for (ULONGLONG image = 1; image <= 10; image++) {
+        knownImages.insert(image);
+        history.record(L"M0", image);
+    }
+    // Only the newest are kept
+    CHECK_EQUAL(9ull, go(history, L"M0", true));
+    CHECK_EQUAL(8ull, go(history, L"M0", true));
+    CHECK_EQUAL(0ull, go(history, L"M0", true));
+
+    // Growing keeps all, shrinking the newest - the current entry stays if it can
+    knownImages.insert(11);
+    knownImages.insert(12);
+    history.setCapacity(5);
+    history.record(L"M0", 11);
+    history.record(L"M0", 12);
+    CHECK_EQUAL(11ull, go(history, L"M0", true));
+    history.setCapacity(2);
+    CHECK_EQUAL(12ull, go(history, L"M0", false));
+    CHECK_EQUAL(11ull, go(history, L"M0", true));
+    CHECK_EQUAL(0ull, go(history, L"M0", true));
+
+    // Capacity is at least one
+    history.setCapacity(0);
+    history.record(L"M0", 1);
+    history.record(L"M0", 2);
+    CHECK_EQUAL(0ull, go(history, L"M0", true));
+}
+
+
+void testSaveLoad()
+{
+    knownImages.clear();
+    HistoryRings history;
+    history.setCapacity(5);
+    for (ULONGLONG image = 1; image <= 8; image++) {
+        knownImages.insert(image * 1000003);
+        history.record(L"\\\\?\\DISPLAY#1", image * 1000003);
+        history.record(L"\\\\?\\DISPLAY#2", image * 1000003 + 1);
+        knownImages.insert(image * 1000003 + 1);
+    }
+    go(history, L"\\\\?\\DISPLAY#1", true);
+
+    stringstream file;
+    history.write(file);
+    // 8 bytes header, each ring 12 bytes, 13 characters of its id and 5 hashes
+    CHECK_EQUAL((size_t)(8 + 2 * (12 + 13 * 2 + 5 * 8)), file.str().length());
+
+    HistoryRings loaded;
+    loaded.setCapacity(5);
+    CHECK(loaded.read(file));
+
+    // Saved again it is the same
+    stringstream again;
+    loaded.write(again);
+    CHECK(again.str() == file.str());
+
+    set<ULONGLONG> current;
+    loaded.getCurrent(current);
+    CHECK(current == set<ULONGLONG>({ 7 * 1000003, 8 * 1000003 + 1 }));
+    CHECK_EQUAL(6ull * 1000003, go(loaded, L"\\\\?\\DISPLAY#1", true));
+    CHECK_EQUAL(7ull * 1000003, go(loaded, L"\\\\?\\DISPLAY#1", false));
+    CHECK_EQUAL(8ull * 1000003, go(loaded, L"\\\\?\\DISPLAY#1", false));
+
+    // Broken files are not used
+    string data = file.str();
+    stringstream wrongMagic(string("WHI0") + data.substr(4));
+    CHECK(!loaded.read(wrongMagic));
+    stringstream truncated(data.substr(0, data.length() - 1));
+    CHECK(!loaded.read(truncated));
+    string badCurrent = data;
+    badCurrent[8 + 8] = 5;      // current entry of the first ring out of its range
+    stringstream badCurrentStream(badCurrent);
+    CHECK(!loaded.read(badCurrentStream));
+    current.clear();
+    loaded.getCurrent(current);
+    CHECK(current.empty());
+}
+
+
+// Going through the whole history of a busy monitor, one step at a time
+void benchmarkNavigation()
+{
+    const int size = HISTORY_MAX_SIZE;
+    knownImages.clear();
+    HistoryRings history;
+    history.setCapacity(size);
+    for (ULONGLONG image = 1; image <= (ULONGLONG)size; image++) {
+        // Every tenth image is gone - it is skipped
+        if (image % 10 != 0) {
+            knownImages.insert(image);
+        }
+        history.record(L"M0", image);
+    }
+
+    auto start = chrono::steady_clock::now();
+    int moves = 0;
+    ULONGLONG hash;
+    while (history.move(L"M0", true, isKnown, hash)) {
+        moves++;
+    }
+    while (history.move(L"M0", false, isKnown, hash)) {
+        moves++;
+    }
+    long long time = microsSince(start);
+    CHECK_EQUAL(2 * (size - size / 10 - 1) + 1, moves);
+    cout << "history of " << size << ": " << moves << " moves in " << time << " us" << endl;
+    // A step must not be noticeable - far below a millisecond
+    CHECK(time / moves < 100);
+}
+
+
+int main()
+{
+    testNavigation();
+    testCapacity();
+    testSaveLoad();
+    benchmarkNavigation();
+    return reportChecks("history");
+}
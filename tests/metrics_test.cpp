@@ -0,0 +1,137 @@
+// Latency histograms: buckets, percentiles, and the cost of recording from many threads at once
+
+#include "check.h"
+
+#include <random>
+#include <thread>
+
+
+void testBuckets()
+{
+    // Small values have buckets of their own
+    for (LONGLONG v = 0; v < METRIC_SUB_BUCKETS; v++) {
+        CHECK_EQUAL((int)v, Histogram::bucketOf(v));
+        CHECK_EQUAL(v, Histogram::upperBound((int)v));
+    }
+
+    // Every value is in the bucket whose range has it, buckets go one after another
+    int broken = 0;
+    int last = 0;
+    for (LONGLONG v = 0; v < 1000000; v++) {
+        int bucket = Histogram::bucketOf(v);
+        LONGLONG lower = bucket == 0 ? 0 : Histogram::upperBound(bucket - 1) + 1;
+        if (v > Histogram::upperBound(bucket) || v < lower || (bucket != last && bucket != last + 1)) {
+            broken++;
+        }
+        last = bucket;
+    }
+    CHECK_EQUAL(0, broken);
+
+    // Large values: error up to 12.5%, the last bucket takes everything above the range
+    mt19937_64 random(41);
+    for (int i = 0; i < 100000; i++) {
+        LONGLONG v = (LONGLONG)(random() % (1ULL << METRIC_MAX_BITS));
+        LONGLONG upper = Histogram::upperBound(Histogram::bucketOf(v));
+        if (upper < v || (v >= METRIC_SUB_BUCKETS && upper - v > v / 8)) {
+            broken++;
+        }
+    }
+    CHECK_EQUAL(0, broken);
+    CHECK_EQUAL(METRIC_BUCKETS - 1, Histogram::bucketOf(1LL << METRIC_MAX_BITS));
+    CHECK_EQUAL(METRIC_BUCKETS - 1, Histogram::bucketOf(1LL << 62));
+    CHECK_EQUAL((1LL << METRIC_MAX_BITS) - 1, Histogram::upperBound(METRIC_BUCKETS - 1));
+}
+
+
+LONGLONG percentile(const Histogram& histogram, int percent)
+{
+    LONGLONG counts[METRIC_BUCKETS];
+    LONGLONG count = histogram.snapshot(counts);
+    return histogram.percentile(counts, count, percent);
+}
+
+
+void testPercentiles()
+{
+    Histogram empty;
+    CHECK_EQUAL(0ll, percentile(empty, 50));
+
+    // 1..1000: percentiles are the upper bounds of the right buckets, never above the maximum
+    Histogram histogram;
+    for (LONGLONG v = 1000; v >= 1; v--) {
+        histogram.record(v);
+    }
+    CHECK_EQUAL(Histogram::upperBound(Histogram::bucketOf(500)), percentile(histogram, 50));
+    CHECK_EQUAL(Histogram::upperBound(Histogram::bucketOf(900)), percentile(histogram, 90));
+    CHECK_EQUAL(1000ll, percentile(histogram, 99));
+    CHECK_EQUAL(1000ll, percentile(histogram, 100));
+    CHECK_EQUAL(1000ll, histogram.getMax());
+    CHECK_EQUAL(500500ll, histogram.getSum());
+    CHECK(percentile(histogram, 50) >= 500 && percentile(histogram, 50) <= 500 + 500 / 8);
+
+    // Negative values (clock going back) count as 0, small values are exact
+    Histogram small;
+    small.record(-5);
+    small.record(3);
+    small.record(3);
+    small.record(7);
+    CHECK_EQUAL(3ll, percentile(small, 50));
+    CHECK_EQUAL(7ll, percentile(small, 99));
+    CHECK_EQUAL(13ll, small.getSum());
+}
+
+
+// Threads record at the same time into one histogram - nothing is lost, the cost per value is printed.
+// Recording is done where things are measured, it must not change what is measured.
+void benchmarkRecord()
+{
+    const int rounds = 1000000;
+    Histogram single;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++) {
+        single.record(i & 0xFFFF);
+    }
+    long long singleTime = microsSince(start);
+
+    const int threads = 4;
+    Histogram contended;
+    vector<thread> workers;
+    start = chrono::steady_clock::now();
+    for (int t = 0; t < threads; t++) {
+        workers.push_back(thread([&contended, t]() {
+            for (int i = 0; i < rounds; i++) {
+                contended.record((i + t) & 0xFFFF);
+            }
+        }));
+    }
+    for (thread& worker : workers) {
+        worker.join();
+    }
+    long long contendedTime = microsSince(start);
+
+    LONGLONG counts[METRIC_BUCKETS];
+    CHECK_EQUAL((LONGLONG)threads * rounds, contended.snapshot(counts));
+    LONGLONG sum = 0;
+    for (int t = 0; t < threads; t++) {
+        for (int i = 0; i < rounds; i++) {
+            sum += (i + t) & 0xFFFF;
+        }
+    }
+    CHECK_EQUAL(sum, contended.getSum());
+    CHECK_EQUAL(0xFFFFll, contended.getMax());
+
+    cout << "record: " << singleTime * 1000 / rounds << " ns, " << threads << " threads at once: "
+        << contendedTime * 1000 / ((long long)threads * rounds) << " ns per value" << endl;
+    // Negligible next to what is measured (milliseconds of desktop calls and scans) - even with TSan
+    CHECK(singleTime < 2ll * rounds);
+    CHECK(contendedTime < 5ll * threads * rounds);
+}
+
+
+int main()
+{
+    testBuckets();
+    testPercentiles();
+    benchmarkRecord();
+    return reportChecks("metrics");
+}
@@ -0,0 +1,54 @@
+// Monitor lists of the batch mode: "1920x1080,1080x1920+1920+0"
+
+#include "check.h"
+
+
+void testSideBySide()
+{
+    vector<MonitorLayout> monitors;
+    CHECK(parseMonitors(L"1920x1080,2560x1440,1080x1920", monitors));
+    CHECK_EQUAL(3u, monitors.size());
+    CHECK_EQUAL(0, monitors[0].left);
+    CHECK_EQUAL(1920, monitors[1].left);
+    CHECK_EQUAL(1920 + 2560, monitors[2].left);
+    CHECK_EQUAL(0, monitors[2].top);
+    CHECK_EQUAL(1080, monitors[2].width);
+    CHECK_EQUAL(1920, monitors[2].height);
+}
+
+
+void testPositions()
+{
+    vector<MonitorLayout> monitors;
+    CHECK(parseMonitors(L"1920x1080+0+0,1080x1920-1080-420", monitors));
+    CHECK_EQUAL(2u, monitors.size());
+    CHECK_EQUAL(-1080, monitors[1].left);
+    CHECK_EQUAL(-420, monitors[1].top);
+
+    // Monitors without position go right of all the others
+    CHECK(parseMonitors(L"1920x1080+3840+0,1280x1024", monitors));
+    CHECK_EQUAL(3840 + 1920, monitors[1].left);
+}
+
+
+void testInvalid()
+{
+    vector<MonitorLayout> monitors;
+    const wchar_t* invalid[] = { L"", L"1920", L"1920x", L"1920x0", L"0x1080", L"1920*1080",
+        L"1920x1080+5", L"1920x1080*5+5", L"x" };
+    for (const wchar_t* text : invalid) {
+        if (parseMonitors(text, monitors)) {
+            wcerr << L"accepted: \"" << text << L"\"" << endl;
+            failedChecks++;
+        }
+    }
+}
+
+
+int main()
+{
+    testSideBySide();
+    testPositions();
+    testInvalid();
+    return reportChecks("monitors");
+}
@@ -0,0 +1,101 @@
+// Placement of images on monitors: display modes, crop around the focus point, bezels
+
+#include "check.h"
+
+
+bool near(float expected, float actual)
+{
+    return fabsf(expected - actual) < 0.01f;
+}
+
+#define CHECK_PLACEMENT(p, px, py, pw, ph) \
+    CHECK(near(px, p.x) && near(py, p.y) && near(pw, p.width) && near(ph, p.height))
+
+
+void testModes()
+{
+    // Same shape - all modes but centre just scale it
+    ImagePlacement p = placeImage(3840, 2160, 1920, 1080, DWPOS_FILL, 0);
+    CHECK_PLACEMENT(p, 0, 0, 1920, 1080);
+    p = placeImage(3840, 2160, 1920, 1080, DWPOS_FIT, 0);
+    CHECK_PLACEMENT(p, 0, 0, 1920, 1080);
+    p = placeImage(3840, 2160, 1920, 1080, DWPOS_CENTER, 0);
+    CHECK_PLACEMENT(p, -960, -540, 3840, 2160);
+
+    // 4:3 image on a 16:9 monitor
+    p = placeImage(1600, 1200, 1920, 1080, DWPOS_FILL, 0);
+    CHECK_PLACEMENT(p, 0, -180, 1920, 1440);
+    p = placeImage(1600, 1200, 1920, 1080, DWPOS_FIT, 0);
+    CHECK_PLACEMENT(p, 240, 0, 1440, 1080);
+    p = placeImage(1600, 1200, 1920, 1080, DWPOS_STRETCH, 0);
+    CHECK_PLACEMENT(p, 0, 0, 1920, 1080);
+}
+
+
+void testFocus()
+{
+    // 32:9 panorama on a 16:9 monitor - half of it is visible
+    ImagePlacement p = placeImage(7680, 2160, 1920, 1080, DWPOS_FILL, 0, 0.5f, 0.5f);
+    CHECK_PLACEMENT(p, -960, 0, 3840, 1080);
+    // The subject in the left third - it is in the centre of the monitor
+    p = placeImage(7680, 2160, 1920, 1080, DWPOS_FILL, 0, 0.4f, 0.5f);
+    CHECK_PLACEMENT(p, -576, 0, 3840, 1080);
+    // Near the edge - the image is not moved further than its edge
+    p = placeImage(7680, 2160, 1920, 1080, DWPOS_FILL, 0, 0.05f, 0.5f);
+    CHECK_PLACEMENT(p, 0, 0, 3840, 1080);
+    p = placeImage(7680, 2160, 1920, 1080, DWPOS_FILL, 0, 0.95f, 0.5f);
+    CHECK_PLACEMENT(p, -1920, 0, 3840, 1080);
+    // Vertical focus does not matter when the height fits exactly
+    p = placeImage(7680, 2160, 1920, 1080, DWPOS_FILL, 0, 0.5f, 0.1f);
+    CHECK_PLACEMENT(p, -960, 0, 3840, 1080);
+
+    // Portrait photo on a landscape monitor - cropped around a face in the upper part
+    p = placeImage(3000, 4000, 1920, 1080, DWPOS_FILL, 0, 0.5f, 0.25f);
+    CHECK_PLACEMENT(p, 0, 540 - 640, 1920, 2560);
+
+    // Other modes don't crop - focus is not used
+    p = placeImage(7680, 2160, 1920, 1080, DWPOS_FIT, 0, 0.1f, 0.1f);
+    CHECK_PLACEMENT(p, 0, 270, 1920, 540);
+}
+
+
+void testBezel()
+{
+    // Image continues under the frames - 20 pixels on each side
+    ImagePlacement p = placeImage(3840, 2160, 1920, 1080, DWPOS_FILL, 20);
+    CHECK(p.x <= -20 && p.y <= -20 && p.x + p.width >= 1940 && p.y + p.height >= 1100);
+    CHECK(near(p.width / p.height, 3840.0f / 2160));
+
+    // Focus at the edge still leaves the bezel covered
+    p = placeImage(7680, 2160, 1920, 1080, DWPOS_FILL, 20, 0.0f, 1.0f);
+    CHECK(near(-20, p.x) && near(1100, p.y + p.height));
+
+    // Every monitor of a composite is covered, whatever the image and focus
+    int monitors[][2] = { { 3840, 2160 }, { 2560, 1440 }, { 1080, 1920 }, { 5120, 1440 } };
+    float images[][2] = { { 6000, 4000 }, { 1920, 1080 }, { 1200, 3000 }, { 12000, 2000 } };
+    float focuses[] = { 0.0f, 0.3f, 0.5f, 0.8f, 1.0f };
+    for (auto const& m : monitors) {
+        for (auto const& image : images) {
+            for (float focus : focuses) {
+                for (int bezel : { 0, 15 }) {
+                    p = placeImage(image[0], image[1], m[0], m[1], DWPOS_FILL, bezel, focus, 1 - focus);
+                    if (p.x > -bezel + 0.01f || p.y > -bezel + 0.01f
+                            || p.x + p.width < m[0] + bezel - 0.01f || p.y + p.height < m[1] + bezel - 0.01f) {
+                        cerr << "monitor " << m[0] << "x" << m[1] << " not covered by " << image[0] << "x" << image[1]
+                            << ", focus " << focus << ", bezel " << bezel << endl;
+                        failedChecks++;
+                    }
+                }
+            }
+        }
+    }
+}
+
+
+int main()
+{
+    testModes();
+    testFocus();
+    testBezel();
+    return reportChecks("placement");
+}
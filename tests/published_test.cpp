@@ -0,0 +1,108 @@
+// Published values: readers on other threads always see a whole version, never a half changed one
+
+#include "check.h"
+
+#include <thread>
+
+
+// Like settings: some numbers and text, all of them made from the version
+typedef struct Values {
+    int         version;
+    int         numbers[32];
+    wstring     text;
+
+    Values() : version(0), text(L"0") {
+        fill(numbers, numbers + _countof(numbers), 0);
+    }
+} Values;
+
+
+// One thread publishes versions, the others read snapshots and check them
+void testHammer()
+{
+    const int versions = 100000;
+    const int readers = 4;
+    PublishedValues<Values> published;
+    atomic<bool> done(false);
+    atomic<long long> reads(0);
+    atomic<int> broken(0);
+
+    vector<thread> threads;
+    for (int r = 0; r < readers; r++) {
+        threads.push_back(thread([&]() {
+            int last = 0;
+            long long count = 0;
+            while (!done) {
+                shared_ptr<const Values> values = published.snapshot();
+                bool whole = values->text == to_wstring(values->version);
+                for (int n : values->numbers) {
+                    whole = whole && n == values->version;
+                }
+                // Versions only go forward
+                if (!whole || values->version < last) {
+                    broken++;
+                }
+                last = values->version;
+                count++;
+            }
+            reads += count;
+        }));
+    }
+
+    auto start = chrono::steady_clock::now();
+    Values values;
+    for (int v = 1; v <= versions; v++) {
+        values.version = v;
+        fill(values.numbers, values.numbers + _countof(values.numbers), v);
+        values.text = to_wstring(v);
+        published.publish(values);
+        // The publishing thread reads without a snapshot
+        if (published.get()->version != v) {
+            broken++;
+        }
+    }
+    long long time = microsSince(start);
+    done = true;
+    for (thread& t : threads) {
+        t.join();
+    }
+
+    CHECK_EQUAL(0, (int)broken);
+    CHECK_EQUAL(versions, published.snapshot()->version);
+    cout << "published " << versions << " versions in " << time / 1000 << " ms, " << readers << " readers took "
+        << reads << " snapshots" << endl;
+}
+
+
+// Snapshot costs a reference count (and a lock of the library), reading from it nothing more
+void benchmarkReads()
+{
+    PublishedValues<Values> published;
+    const int rounds = 1000000;
+    long long sum = 0;
+
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++) {
+        sum += published.get()->numbers[i % 32];
+    }
+    long long getTime = microsSince(start);
+
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++) {
+        sum += published.snapshot()->numbers[i % 32];
+    }
+    long long snapshotTime = microsSince(start);
+
+    CHECK_EQUAL(0ll, sum);
+    cout << "reads: " << getTime * 1000 / rounds << " ns, snapshots: " << snapshotTime * 1000 / rounds << " ns" << endl;
+    // Taken once per job or message, not per value - even a few microseconds would do (with TSan too)
+    CHECK(snapshotTime < 5ll * rounds);
+}
+
+
+int main()
+{
+    testHammer();
+    benchmarkReads();
+    return reportChecks("published values");
+}
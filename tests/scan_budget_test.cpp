@@ -0,0 +1,188 @@
+// Pace of background scans: files and bytes per second, several threads sharing the budget
+
+#include "check.h"
+
+#include <random>
+#include <thread>
+
+
+void testDueTime()
+{
+    CHECK_EQUAL(0ull, getScanDueTime(1000, 1ull << 40, 0, 0));
+    CHECK_EQUAL(20ull, getScanDueTime(1, 100, 50, 0));
+    CHECK_EQUAL(2000ull, getScanDueTime(100, 100, 50, 0));
+    CHECK_EQUAL(3000ull, getScanDueTime(1, 3 << 20, 0, 1 << 20));
+    // The stricter of the two limits counts
+    CHECK_EQUAL(3000ull, getScanDueTime(100, 3 << 20, 50, 1 << 20));
+    CHECK_EQUAL(4000ull, getScanDueTime(200, 3 << 20, 50, 1 << 20));
+}
+
+
+// Scan with virtual time: every thread takes the next file when it is free, waits as long as the budget
+// says and reads it (the disk reads 'diskBytesPerMs', file 'slowFile' takes 'slowMs' more).
+// Returns the time (ms) when the last file was read, checks that no file was read too early.
+ULONGLONG simulateScan(const vector<ULONGLONG>& sizes, int threads, int maxFilesPerSec, ULONGLONG maxBytesPerSec,
+    ULONGLONG diskBytesPerMs, size_t slowFile = (size_t)-1, ULONGLONG slowMs = 0)
+{
+    // Threads by the time they are free
+    priority_queue<ULONGLONG, vector<ULONGLONG>, greater<ULONGLONG>> free;
+    for (int t = 0; t < threads; t++) {
+        free.push(0);
+    }
+    ScanBudget budget;
+    budget.setLimits(maxFilesPerSec, maxBytesPerSec);
+    ULONGLONG files = 0;
+    ULONGLONG bytes = 0;
+    ULONGLONG end = 0;
+    for (size_t i = 0; i < sizes.size(); i++) {
+        ULONGLONG now = free.top();
+        free.pop();
+        files++;
+        bytes += sizes[i];
+        ULONGLONG start = now + budget.take(sizes[i], now);
+        // Budget is kept all the time, not just on average
+        if (maxFilesPerSec > 0 && files * 1000 > (start + 1) * maxFilesPerSec) {
+            failedChecks++;
+            cerr << "file " << i << " read too early: " << start << " ms" << endl;
+            break;
+        }
+        if (maxBytesPerSec > 0 && bytes * 1000 > (start + 1) * maxBytesPerSec) {
+            failedChecks++;
+            cerr << "file " << i << " exceeds bytes budget: " << start << " ms" << endl;
+            break;
+        }
+        ULONGLONG done = start + sizes[i] / diskBytesPerMs + (i == slowFile ? slowMs : 0);
+        end = max(end, done);
+        free.push(done);
+    }
+    return end;
+}
+
+
+void testPace()
+{
+    mt19937 random(28);
+    const ULONGLONG MB = 1 << 20;
+
+    // Small files: files per second count
+    vector<ULONGLONG> small(2000, 200 * 1024);
+    ULONGLONG time = simulateScan(small, 4, 200, 0, 100 * 1024);
+    CHECK(time >= 10000 && time <= 10000 + 10);
+
+    // Large files: bytes per second count, more threads don't make it faster
+    vector<ULONGLONG> large(300);
+    ULONGLONG total = 0;
+    for (ULONGLONG& size : large) {
+        size = MB / 2 + random() % (8 * MB);
+        total += size;
+    }
+    ULONGLONG budgetTime = total * 1000 / (10 * MB);
+    ULONGLONG time1 = simulateScan(large, 1, 200, 10 * MB, 100 * 1024);
+    ULONGLONG time8 = simulateScan(large, 8, 200, 10 * MB, 100 * 1024);
+    CHECK(time1 >= budgetTime && time1 <= budgetTime + 100);
+    CHECK(time8 >= budgetTime && time8 <= budgetTime + 100);
+
+    // Stalled for 3 s (disk busy, sleeping longer) - the scan catches up, it does not end later
+    ULONGLONG stalled = simulateScan(small, 1, 200, 0, 100 * 1024, 500, 3000);
+    CHECK_EQUAL(simulateScan(small, 1, 200, 0, 100 * 1024), stalled);
+
+    // No budget - as fast as the disk
+    CHECK_EQUAL(2000ull * 2 / 4, simulateScan(small, 4, 0, 0, 100 * 1024));
+}
+
+
+// Scan with real threads and time, as the application does it: every thread takes the next file, waits
+// as long as the shared budget says and reads it (sleeps 'readMs', file 'slowFile' takes 'slowMs' more).
+// Times (ms) when the files started to be read are put to 'started'. Returns when the last one was read.
+ULONGLONG runScan(const vector<ULONGLONG>& sizes, int threads, ScanBudget& budget, ULONGLONG readMs,
+    vector<ULONGLONG>& started, size_t slowFile = (size_t)-1, ULONGLONG slowMs = 0)
+{
+    started.assign(sizes.size(), 0);
+    atomic<size_t> next(0);
+    auto start = chrono::steady_clock::now();
+    vector<thread> pool;
+    for (int t = 0; t < threads; t++) {
+        pool.push_back(thread([&]() {
+            for (size_t i = next++; i < sizes.size(); i = next++) {
+                ULONGLONG wait = budget.take(sizes[i], microsSince(start) / 1000);
+                this_thread::sleep_for(chrono::milliseconds(wait));
+                started[i] = microsSince(start) / 1000;
+                this_thread::sleep_for(chrono::milliseconds(readMs + (i == slowFile ? slowMs : 0)));
+            }
+        }));
+    }
+    for (thread& t : pool) {
+        t.join();
+    }
+    return microsSince(start) / 1000;
+}
+
+
+// No file is read before the budget allows it: the k-th file to start could not start before k files fit
+int countEarlyFiles(vector<ULONGLONG> started, int maxFilesPerSec)
+{
+    sort(started.begin(), started.end());
+    int early = 0;
+    for (size_t k = 1; k <= started.size(); k++) {
+        early += (started[k - 1] < getScanDueTime(k, 0, maxFilesPerSec, 0)) ? 1 : 0;
+    }
+    return early;
+}
+
+
+void testThreads()
+{
+    mt19937 random(28);
+    const ULONGLONG MB = 1 << 20;
+    // Sleeping may take longer on a busy machine - and the last file is read after its due time
+    const ULONGLONG slack = 300;
+    vector<ULONGLONG> started;
+
+    // Small files, 4 threads share the files per second
+    vector<ULONGLONG> small(300, 200 * 1024);
+    ScanBudget budget;
+    budget.setLimits(200, 0);
+    ULONGLONG time = runScan(small, 4, budget, 1, started);
+    CHECK(time >= 1500 && time <= 1500 + slack);
+    CHECK_EQUAL(0, countEarlyFiles(started, 200));
+    CHECK_EQUAL(300ull, budget.getFiles());
+    CHECK_EQUAL(300ull * 200 * 1024, budget.getBytes());
+    CHECK(budget.getWaited() > 0);
+
+    // Large files: bytes per second count for all threads together
+    vector<ULONGLONG> large(20);
+    ULONGLONG total = 0;
+    for (ULONGLONG& size : large) {
+        size = MB / 4 + random() % (2 * MB);
+        total += size;
+    }
+    ULONGLONG budgetTime = total * 1000 / (10 * MB);
+    ScanBudget bytesBudget;
+    bytesBudget.setLimits(200, 10 * MB);
+    time = runScan(large, 4, bytesBudget, 5, started);
+    CHECK(time >= budgetTime && time <= budgetTime + slack);
+    CHECK_EQUAL(total, bytesBudget.getBytes());
+
+    // One file stalls for 300 ms - the scan catches up, it ends when the budget says
+    ScanBudget stalledBudget;
+    stalledBudget.setLimits(200, 0);
+    time = runScan(small, 1, stalledBudget, 1, started, 100, 300);
+    CHECK(time >= 1500 && time <= 1500 + slack);
+    CHECK_EQUAL(0, countEarlyFiles(started, 200));
+
+    // No budget - nobody waits
+    ScanBudget noBudget;
+    time = runScan(small, 4, noBudget, 1, started);
+    CHECK(time < 1500);
+    CHECK_EQUAL(0ull, noBudget.getWaited());
+    cout << "scans with threads: " << small.size() << " files in " << time << " ms without budget" << endl;
+}
+
+
+int main()
+{
+    testDueTime();
+    testPace();
+    testThreads();
+    return reportChecks("scan budget");
+}
@@ -0,0 +1,111 @@
+// AutoChangeSchedule: parsing and the next time of the schedule
+
+#include "check.h"
+
+
+// Local time in minutes since 1601 (proleptic Gregorian calendar)
+ULONGLONG minutesAt(int year, int month, int day, int hour, int minute)
+{
+    // Days since 1 March of year 0, then since 1 January 1601
+    year -= month <= 2;
+    int era = year / 400;
+    int yearOfEra = year - era * 400;
+    int dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    long long days = (long long)era * 146097 + dayOfEra - 584694;
+    return (ULONGLONG)days * MINUTES_PER_DAY + hour * 60 + minute;
+}
+
+
+void testParse()
+{
+    Schedule schedule;
+    CHECK(parseSchedule(L"every 15", schedule));
+    CHECK_EQUAL(0x7F, schedule.days);
+    CHECK_EQUAL(15, schedule.period);
+    CHECK(schedule.times.empty());
+
+    CHECK(parseSchedule(L"  Mon-Fri   EVERY 60 ", schedule));
+    CHECK_EQUAL(0x3E, schedule.days);
+    CHECK_EQUAL(60, schedule.period);
+
+    CHECK(parseSchedule(L"sat,sun at 18:30,10:00", schedule));
+    CHECK_EQUAL(0x41, schedule.days);
+    CHECK_EQUAL(0, schedule.period);
+    CHECK_EQUAL(2u, schedule.times.size());
+    CHECK_EQUAL(600, schedule.times[0]);
+    CHECK_EQUAL(1110, schedule.times[1]);
+
+    // Range over the weekend
+    CHECK(parseSchedule(L"fri-mon every 30", schedule));
+    CHECK_EQUAL(0x63, schedule.days);
+
+    CHECK(parseSchedule(L"every 1440", schedule));
+}
+
+
+void testInvalid()
+{
+    Schedule schedule;
+    const wchar_t* invalid[] = { L"", L"   ", L"every", L"every 0", L"every -5", L"every 1441", L"every 15 minutes",
+        L"every x", L"at", L"at 10", L"at 24:00", L"at 10:60", L"at 10:00 11:00", L"mon", L"mon-xyz every 5",
+        L"monday every 5", L"mon at", L"hourly" };
+    for (const wchar_t* text : invalid) {
+        if (parseSchedule(text, schedule)) {
+            wcerr << L"accepted: \"" << text << L"\"" << endl;
+            failedChecks++;
+        }
+    }
+}
+
+
+void testNextPeriod()
+{
+    Schedule schedule;
+    parseSchedule(L"every 15", schedule);
+    // Sunday 18 October 2026
+    CHECK_EQUAL(minutesAt(2026, 10, 18, 10, 15), getNextScheduledMinute(schedule, minutesAt(2026, 10, 18, 10, 7)));
+    // Always later than now - never the same minute
+    CHECK_EQUAL(minutesAt(2026, 10, 18, 10, 30), getNextScheduledMinute(schedule, minutesAt(2026, 10, 18, 10, 15)));
+    CHECK_EQUAL(minutesAt(2026, 10, 19, 0, 0), getNextScheduledMinute(schedule, minutesAt(2026, 10, 18, 23, 50)));
+
+    // Period not dividing the day starts again at midnight
+    parseSchedule(L"every 25", schedule);
+    CHECK_EQUAL(minutesAt(2026, 10, 18, 23, 45), getNextScheduledMinute(schedule, minutesAt(2026, 10, 18, 23, 21)));
+    CHECK_EQUAL(minutesAt(2026, 10, 19, 0, 0), getNextScheduledMinute(schedule, minutesAt(2026, 10, 18, 23, 45)));
+
+    // Weekdays only: from Saturday noon to Monday midnight
+    parseSchedule(L"mon-fri every 60", schedule);
+    CHECK_EQUAL(minutesAt(2026, 10, 19, 0, 0), getNextScheduledMinute(schedule, minutesAt(2026, 10, 17, 12, 0)));
+    CHECK_EQUAL(minutesAt(2026, 10, 23, 14, 0), getNextScheduledMinute(schedule, minutesAt(2026, 10, 23, 13, 0)));
+}
+
+
+void testNextTimes()
+{
+    Schedule schedule;
+    parseSchedule(L"sat,sun at 10:00,18:30", schedule);
+    CHECK_EQUAL(minutesAt(2026, 10, 18, 10, 0), getNextScheduledMinute(schedule, minutesAt(2026, 10, 18, 0, 0)));
+    CHECK_EQUAL(minutesAt(2026, 10, 18, 18, 30), getNextScheduledMinute(schedule, minutesAt(2026, 10, 18, 10, 0)));
+    // After the last one on Sunday - next Saturday
+    CHECK_EQUAL(minutesAt(2026, 10, 24, 10, 0), getNextScheduledMinute(schedule, minutesAt(2026, 10, 18, 18, 30)));
+
+    // Only once a week - exactly 7 days later
+    parseSchedule(L"mon at 00:00", schedule);
+    CHECK_EQUAL(minutesAt(1601, 1, 1, 0, 0), 0ull);
+    CHECK_EQUAL(7ull * MINUTES_PER_DAY, getNextScheduledMinute(schedule, 0));
+
+    // Leap day
+    parseSchedule(L"thu at 12:00", schedule);
+    CHECK_EQUAL(minutesAt(2024, 2, 29, 12, 0), getNextScheduledMinute(schedule, minutesAt(2024, 2, 28, 23, 59)));
+}
+
+
+int main()
+{
+    testParse();
+    testInvalid();
+    testNextPeriod();
+    testNextTimes();
+    return reportChecks("schedule");
+}
@@ -0,0 +1,258 @@
+// Settings: the text form (as in the ini file) and what must be done when they change
+
+#include "check.h"
+
+#include <random>
+#include <thread>
+
+
+WallSettings fromText(const wstring& text, const WallSettings& values = WallSettings())
+{
+    WallSettings parsed(values);
+    wistringstream in(text);
+    parseSettings(in, parsed);
+    return parsed;
+}
+
+
+void testText()
+{
+    WallSettings values;
+    values.ImageDirectory = L"D:\\Walls";
+    values.AutoChangeInterval = 25;
+    values.SmartCrop = true;
+    values.Filter = L"width >= 1920 and not path ~ \"x=y\"";
+    wstring text = settingsToText(values);
+    CHECK(settingsToText(fromText(text)) == text);
+    CHECK(fromText(text).Filter == values.Filter);
+
+    // Settings not in the text keep their values, unknown and broken lines are skipped
+    wistringstream in(L"AutoChangeInterval=7\nNoSuchSetting=1\nScanThreads=many\ngarbage\nSmartCrop=false");
+    WallSettings partial(values);
+    CHECK_EQUAL(2, parseSettings(in, partial));
+    CHECK_EQUAL(7, partial.AutoChangeInterval);
+    CHECK_EQUAL(false, partial.SmartCrop);
+    CHECK_EQUAL(1, partial.ScanThreads);
+    CHECK(partial.ImageDirectory == L"D:\\Walls");
+}
+
+
+void testChanges()
+{
+    WallSettings old;
+    old.ImageDirectory = L"C:\\Pics";
+    old.ExtraImageDirectories = L"E:\\A;E:\\B|2";
+
+    // Nothing changed, or the same folders written another way
+    WallSettings now(old);
+    CHECK_EQUAL(0, getSettingsChanges(old, now));
+    now.ImageDirectory = L"C:\\Pics\\";
+    now.ExtraImageDirectories = L"E:\\B\\|2;E:\\A";
+    CHECK_EQUAL(0, getSettingsChanges(old, now));
+
+    // Only weights - images are chosen again, nothing is read
+    now = old;
+    now.ExtraImageDirectories = L"E:\\A|5;E:\\B|2";
+    CHECK_EQUAL(SETTINGS_CHOOSE_AGAIN, getSettingsChanges(old, now));
+    now = old;
+    now.ImageDirectoryWeight = 3;
+    CHECK_EQUAL(SETTINGS_CHOOSE_AGAIN, getSettingsChanges(old, now));
+
+    // Other folders
+    now = old;
+    now.ExtraImageDirectories = L"E:\\A";
+    CHECK_EQUAL(SETTINGS_READ_SOURCES | SETTINGS_WATCH_SOURCES, getSettingsChanges(old, now));
+    now = old;
+    now.ImageDirectory = L"D:\\Walls";
+    CHECK_EQUAL(SETTINGS_READ_SOURCES | SETTINGS_NEW_WALLPAPER | SETTINGS_WATCH_SOURCES, getSettingsChanges(old, now));
+
+    // Images must be analysed now - read again; analysed already - only chosen again
+    now = old;
+    now.SmartCrop = true;
+    CHECK_EQUAL(SETTINGS_READ_SOURCES, getSettingsChanges(old, now));
+    WallSettings analysed(old);
+    analysed.DarkFromHour = 20;
+    now = analysed;
+    now.SmartCrop = true;
+    CHECK_EQUAL(SETTINGS_CHOOSE_AGAIN, getSettingsChanges(analysed, now));
+
+    // The rest
+    now = old;
+    now.Filter = L"width > 1000";
+    now.AutoChangeSchedule = L"08:00";
+    CHECK_EQUAL(SETTINGS_CHOOSE_AGAIN | SETTINGS_RESCHEDULE, getSettingsChanges(old, now));
+    now = old;
+    now.FeedCacheMB = 10;
+    now.IdleTrimMinutes = 5;
+    now.HistorySize = 7;
+    CHECK_EQUAL(SETTINGS_RESTART_FEED | SETTINGS_IDLE_TRIM | SETTINGS_HISTORY_SIZE, getSettingsChanges(old, now));
+    now = old;
+    now.EnableDebugLog = true;
+    now.ScanThreads = 4;
+    CHECK_EQUAL(0, getSettingsChanges(old, now));
+}
+
+
+// Edits of the ini file like a script (or an editor) makes them: some lines are changed, the file may
+// have only some of the settings. The text of the version is kept with the values it must give.
+typedef struct {
+    wstring     ini;
+    wstring     expected;       // all settings after the edit, as settingsToText() makes them
+    bool        rescan;         // folders are other ones than before
+} SettingsEdit;
+
+vector<SettingsEdit> makeEdits(int count)
+{
+    mt19937 random(38);
+    const wchar_t* mains[] = { L"C:\\Pics", L"C:\\Pics\\", L"D:\\Walls" };
+    const int mainFolders[] = { 0, 0, 1 };
+    const wchar_t* extras[] = { L"", L"E:\\A;E:\\B", L"E:\\B;E:\\A|1", L"E:\\A|3;E:\\B", L"E:\\C" };
+    const int extraFolders[] = { 0, 1, 1, 1, 2 };
+
+    // Lines of all settings, in the order of the text - the model of what the program must have
+    vector<pair<wstring, wstring>> model;
+    wistringstream defaults(settingsToText(WallSettings()));
+    wstring line;
+    while (getline(defaults, line)) {
+        size_t pos = line.find(L'=');
+        model.push_back(make_pair(line.substr(0, pos), line.substr(pos + 1)));
+    }
+    auto setModel = [&](const wstring& name, const wstring& value) {
+        for (auto& setting : model) {
+            if (setting.first == name) {
+                setting.second = value;
+            }
+        }
+    };
+    int main = 0, extra = 0;
+    setModel(L"ImageDirectory", mains[main]);
+
+    vector<SettingsEdit> edits;
+    for (int v = 1; v <= count; v++) {
+        // HistorySize is the version - every text has it
+        map<wstring, wstring> changed = { { L"HistorySize", to_wstring(v) } };
+        int oldFolders = mainFolders[main] * 10 + extraFolders[extra];
+        bool mainChanged = false;
+        switch (random() % 6) {
+        case 0: {
+            int next = random() % _countof(mains);
+            mainChanged = mainFolders[next] != mainFolders[main];
+            main = next;
+            changed[L"ImageDirectory"] = mains[main];
+            break;
+        }
+        case 1:
+            extra = random() % _countof(extras);
+            changed[L"ExtraImageDirectories"] = extras[extra];
+            break;
+        case 2:
+            changed[L"Filter"] = L"width > " + to_wstring(random() % 4000);
+            break;
+        case 3:
+            changed[L"DisplayMode"] = to_wstring(random() % 5);
+            break;
+        default:
+            changed[L"AutoChangeInterval"] = to_wstring(1 + random() % 60);
+            break;
+        }
+        for (auto const& setting : changed) {
+            setModel(setting.first, setting.second);
+        }
+
+        // The file: changed lines, some of the others, maybe a line being written or not for us
+        wstring ini;
+        for (auto const& setting : model) {
+            if (changed.find(setting.first) != changed.end() || random() % 3 == 0) {
+                ini += setting.first + L"=" + setting.second + L"\n";
+            }
+        }
+        if (random() % 4 == 0) {
+            ini += (random() % 2 == 0) ? L"AutoChangeInterval=not a number\n" : L"[section]\n";
+        }
+
+        SettingsEdit edit;
+        edit.ini = ini;
+        for (auto const& setting : model) {
+            edit.expected += setting.first + L"=" + setting.second + L"\n";
+        }
+        edit.rescan = mainChanged || mainFolders[main] * 10 + extraFolders[extra] != oldFolders;
+        edits.push_back(edit);
+    }
+    return edits;
+}
+
+
+// The file is read again and again (like the settings watcher does it), values are published,
+// readers on other threads check every snapshot they take is exactly one of the versions
+void testHammer()
+{
+    const int versions = 20000;
+    const int readers = 4;
+    vector<SettingsEdit> edits = makeEdits(versions);
+
+    PublishedValues<WallSettings> published;
+    WallSettings first;
+    first.ImageDirectory = L"C:\\Pics";
+    first.HistorySize = 0;
+    published.publish(first);
+
+    atomic<bool> done(false);
+    atomic<int> torn(0);
+    atomic<long long> reads(0);
+    vector<thread> threads;
+    for (int r = 0; r < readers; r++) {
+        threads.push_back(thread([&]() {
+            int last = 0;
+            long long count = 0;
+            while (!done) {
+                shared_ptr<const WallSettings> values = published.snapshot();
+                int version = values->HistorySize;
+                if (version < last || (version > 0 && settingsToText(*values) != edits[version - 1].expected)) {
+                    torn++;
+                }
+                last = version;
+                count++;
+            }
+            reads += count;
+        }));
+    }
+
+    int rescans = 0;
+    int expectedRescans = 0;
+    int wrongRescans = 0;
+    auto start = chrono::steady_clock::now();
+    for (int v = 1; v <= versions; v++) {
+        const SettingsEdit& edit = edits[v - 1];
+        WallSettings values(*published.get());
+        wistringstream in(edit.ini);
+        parseSettings(in, values);
+        WallSettings old(*published.get());
+        published.publish(values);
+
+        bool rescan = (getSettingsChanges(old, *published.get()) & SETTINGS_READ_SOURCES) != 0;
+        rescans += rescan ? 1 : 0;
+        expectedRescans += edit.rescan ? 1 : 0;
+        wrongRescans += (rescan != edit.rescan) ? 1 : 0;
+    }
+    long long time = microsSince(start);
+    done = true;
+    for (thread& t : threads) {
+        t.join();
+    }
+
+    CHECK_EQUAL(0, (int)torn);
+    CHECK_EQUAL(0, wrongRescans);
+    CHECK_EQUAL(expectedRescans, rescans);
+    CHECK(settingsToText(*published.get()) == edits.back().expected);
+    cout << versions << " edits read and published in " << time / 1000 << " ms, " << rescans << " rescans, "
+        << readers << " readers took " << reads << " snapshots" << endl;
+}
+
+
+int main()
+{
+    testText();
+    testChanges();
+    testHammer();
+    return reportChecks("settings");
+}
@@ -0,0 +1,169 @@
+// Nearest fitting images for monitors of unusual shapes
+
+#include "check.h"
+
+#include <random>
+
+
+// Cost of the image for the monitor - as the index computes it
+float fitCost(int width, int height, UINT imageWidth, UINT imageHeight)
+{
+    float aspect = log2f((float)imageWidth / imageHeight) - log2f((float)width / height);
+    float missing = log2f((float)width * height) - log2f((float)imageWidth * imageHeight);
+    return NEAREST_FIT_ASPECT_WEIGHT * fabsf(aspect) + ((missing > 0) ? missing : -missing * NEAREST_FIT_LARGER_WEIGHT);
+}
+
+
+void testNearest()
+{
+    typedef struct {
+        const wchar_t*  path;
+        UINT            width;
+        UINT            height;
+    } Image;
+    Image images[] = {
+        { L"wide-5120x1440.jpg", 5120, 1440 },
+        { L"wide-3840x1080.jpg", 3840, 1080 },
+        { L"wide-2560x720.jpg", 2560, 720 },
+        { L"uw-3440x1440.jpg", 3440, 1440 },
+        { L"hd-1920x1080.jpg", 1920, 1080 },
+        { L"uhd-3840x2160.jpg", 3840, 2160 },
+        { L"old-1600x1200.jpg", 1600, 1200 },
+        { L"tall-1080x1920.jpg", 1080, 1920 },
+        { L"tall-2160x3840.jpg", 2160, 3840 },
+        { L"tall-540x960.jpg", 540, 960 },
+        { L"phone-1170x2532.jpg", 1170, 2532 },
+        { L"unknown.jpg", 0, 0 },
+    };
+    ShapeIndex index;
+    for (size_t i = 0; i < _countof(images); i++) {
+        index.add(images[i].width, images[i].height, i, images[i].path);
+    }
+    index.prepare();
+    vector<bool> allowed(_countof(images), true);
+
+    // 32:9 - the same shape, the smaller one last
+    set<const wchar_t*> found;
+    index.nearest(5120, 1440, allowed, 2, found);
+    CHECK(found == set<const wchar_t*>({ images[0].path, images[1].path }));
+    found.clear();
+    index.nearest(5120, 1440, allowed, 3, found);
+    CHECK(found == set<const wchar_t*>({ images[0].path, images[1].path, images[2].path }));
+
+    // 9:16 - the larger image is better than the smaller one
+    found.clear();
+    index.nearest(1080, 1920, allowed, 2, found);
+    CHECK(found == set<const wchar_t*>({ images[7].path, images[8].path }));
+
+    // Images not allowed are left out, images without size are never found
+    allowed[7] = false;
+    found.clear();
+    index.nearest(1080, 1920, allowed, 3, found);
+    CHECK(found == set<const wchar_t*>({ images[8].path, images[9].path, images[10].path }));
+    found.clear();
+    index.nearest(1920, 1080, allowed, _countof(images), found);
+    CHECK_EQUAL(_countof(images) - 2, found.size());
+
+    found.clear();
+    ShapeIndex().nearest(1920, 1080, allowed, 8, found);
+    CHECK(found.empty());
+}
+
+
+// The index finds what going through all images would
+void testAgainstScan()
+{
+    mt19937 random(44);
+    const size_t size = 20000;
+    vector<pair<UINT, UINT>> sizes(size);
+    vector<wstring> paths(size);
+    vector<bool> allowed(size);
+    ShapeIndex index;
+    for (size_t i = 0; i < size; i++) {
+        sizes[i] = std::make_pair(400 + random() % 7000, 400 + random() % 7000);
+        paths[i] = to_wstring(i);
+        allowed[i] = random() % 4 != 0;
+        index.add(sizes[i].first, sizes[i].second, i, paths[i].c_str());
+    }
+    index.prepare();
+
+    int monitors[][2] = { { 5120, 1440 }, { 1080, 1920 }, { 1920, 1080 }, { 3440, 1440 }, { 1024, 768 } };
+    for (auto const& monitor : monitors) {
+        vector<float> costs;
+        for (size_t i = 0; i < size; i++) {
+            if (allowed[i]) {
+                costs.push_back(fitCost(monitor[0], monitor[1], sizes[i].first, sizes[i].second));
+            }
+        }
+        sort(costs.begin(), costs.end());
+        set<const wchar_t*> found;
+        index.nearest(monitor[0], monitor[1], allowed, NEAREST_FIT_COUNT, found);
+        CHECK_EQUAL((size_t)NEAREST_FIT_COUNT, found.size());
+        float worst = 0;
+        for (const wchar_t* path : found) {
+            size_t i = (size_t)stoi(path);
+            CHECK(allowed[i]);
+            worst = max(worst, fitCost(monitor[0], monitor[1], sizes[i].first, sizes[i].second));
+        }
+        CHECK(fabsf(worst - costs[NEAREST_FIT_COUNT - 1]) < 0.0001f);
+    }
+}
+
+
+// Catalog of a million images, queried for every monitor of a large setup
+void benchmarkMillion()
+{
+    mt19937 random(1000000);
+    const size_t size = 1000000;
+    vector<wstring> paths(size);
+    vector<bool> allowed(size);
+    for (size_t i = 0; i < size; i++) {
+        paths[i] = to_wstring(i);
+        allowed[i] = random() % 2 != 0;
+    }
+
+    auto start = chrono::steady_clock::now();
+    ShapeIndex index;
+    for (size_t i = 0; i < size; i++) {
+        // Mostly common shapes, some of them odd
+        static const UINT common[][2] = { { 1920, 1080 }, { 3840, 2160 }, { 2560, 1440 }, { 1080, 1920 }, { 4000, 3000 } };
+        UINT width, height;
+        if (random() % 10 != 0) {
+            width = common[random() % _countof(common)][0] * (90 + random() % 20) / 100;
+            height = common[random() % _countof(common)][1] * (90 + random() % 20) / 100;
+        }
+        else {
+            width = 200 + random() % 8000;
+            height = 200 + random() % 8000;
+        }
+        index.add(width, height, i, paths[i].c_str());
+    }
+    index.prepare();
+    long long buildTime = microsSince(start);
+
+    int monitors[][2] = { { 5120, 1440 }, { 1080, 1920 }, { 1920, 1080 }, { 3440, 1440 }, { 2560, 1600 }, { 800, 600 } };
+    const int rounds = 100;
+    start = chrono::steady_clock::now();
+    size_t foundTotal = 0;
+    for (int r = 0; r < rounds; r++) {
+        for (auto const& monitor : monitors) {
+            set<const wchar_t*> found;
+            index.nearest(monitor[0], monitor[1], allowed, NEAREST_FIT_COUNT, found);
+            foundTotal += found.size();
+        }
+    }
+    long long queryTime = microsSince(start) / (rounds * _countof(monitors));
+    CHECK_EQUAL((size_t)rounds * _countof(monitors) * NEAREST_FIT_COUNT, foundTotal);
+    cout << "shape index of " << size << ": built in " << buildTime / 1000 << " ms, " << queryTime << " us per monitor" << endl;
+    // Choosing for a monitor must stay far below the time of loading an image
+    CHECK(queryTime < 20000);
+}
+
+
+int main()
+{
+    testNearest();
+    testAgainstScan();
+    benchmarkMillion();
+    return reportChecks("shape index");
+}
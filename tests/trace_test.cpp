@@ -0,0 +1,111 @@
+// Event trace: records written field by field and read back from the file, long ones too
+
+#include "check.h"
+
+
+void testRecord()
+{
+    TraceRecord record(TraceMonitors);
+    record.put(2);
+    int rect[4] = { 0, 0, 1920, 1080 };
+    record.put(rect, sizeof(rect));
+    record.put(L"\\\\?\\DISPLAY#1");
+    record.put(L"");
+
+    DWORD count = 0;
+    int read[4] = { 0 };
+    wstring id, empty(L"x");
+    CHECK(record.get(count) && record.get(read, sizeof(read)) && record.get(id) && record.get(empty));
+    CHECK_EQUAL(2u, count);
+    CHECK_EQUAL(1080, read[3]);
+    CHECK(id == L"\\\\?\\DISPLAY#1");
+    CHECK(empty.empty());
+    // Nothing more in it - reading fails, the position stays
+    CHECK(!record.get(count));
+    CHECK(!record.get(id));
+    CHECK_EQUAL(record.data.size(), record.pos);
+
+    // Length of a string larger than the rest of the record
+    TraceRecord broken(TraceImageRemoved);
+    broken.put(1000);
+    broken.put(L"ab", 2 * sizeof(wchar_t));
+    CHECK(!broken.get(id));
+}
+
+
+void testFile()
+{
+    // Settings and monitor lists can be long - much more than 64 KB
+    wstring settings;
+    for (int i = 0; settings.length() < 100000; i++) {
+        settings += L"Setting" + to_wstring(i) + L"=" + wstring(i % 50, L'x') + L"\n";
+    }
+    vector<TraceRecord> records;
+    records.push_back(TraceRecord(TraceMessage));
+    records.back().put(0x8000);
+    records.back().put(7);
+    records.push_back(TraceRecord(TraceSettings));
+    records.back().put(settings);
+    records.push_back(TraceRecord(TraceSetWallpapers));
+
+    stringstream file;
+    writeTraceHeader(file, 133000000000000000ULL);
+    DWORD time = 0;
+    for (const TraceRecord& record : records) {
+        CHECK(writeTraceRecord(file, time, record));
+        time += 250;
+    }
+    string written = file.str();
+
+    ULONGLONG started = 0;
+    CHECK(readTraceHeader(file, started));
+    CHECK_EQUAL(133000000000000000ULL, started);
+    TraceRecord record;
+    for (size_t i = 0; i < records.size(); i++) {
+        CHECK(readTraceRecord(file, time, record));
+        CHECK_EQUAL((DWORD)(i * 250), time);
+        CHECK_EQUAL((int)records[i].type, (int)record.type);
+        CHECK(record.data == records[i].data);
+    }
+    CHECK(!readTraceRecord(file, time, record));
+
+    wstring text;
+    TraceRecord settingsRecord = records[1];
+    CHECK(settingsRecord.get(text) && text == settings);
+
+    // Cut in the middle of the long record - it is not returned half read
+    stringstream cut(written.substr(0, written.length() - sizeof(TraceRecordHeader) - 1000));
+    CHECK(readTraceHeader(cut, started));
+    CHECK(readTraceRecord(cut, time, record));
+    CHECK(!readTraceRecord(cut, time, record));
+
+    // Not a trace
+    stringstream other(string("WTR2") + written.substr(4));
+    CHECK(!readTraceHeader(other, started));
+}
+
+
+// A record that can't be real is not written, and a length like that is not read
+void testTooLong()
+{
+    TraceRecord huge(TraceSettings);
+    huge.data.resize(TRACE_MAX_RECORD + 1);
+    stringstream file;
+    CHECK(!writeTraceRecord(file, 0, huge));
+    CHECK(file.str().empty());
+
+    TraceRecordHeader header = { 0, TraceSettings, 0, 0xFFFFFFF0 };
+    stringstream broken(string((const char*)&header, sizeof(header)) + "payload");
+    DWORD time;
+    TraceRecord record;
+    CHECK(!readTraceRecord(broken, time, record));
+}
+
+
+int main()
+{
+    testRecord();
+    testFile();
+    testTooLong();
+    return reportChecks("trace");
+}
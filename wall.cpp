@@ -20,17 +20,46 @@
 #include <Gdiplus.h>
 using namespace Gdiplus;
 
+// Imaging component - for decoding big images without loading them whole
+#include <wincodec.h>
+
+// HTTP client - for downloading images from a feed
+#include <winhttp.h>
+
+// Process memory - batch commands print the peak of it
+#include <psapi.h>
+
+// Threads of the process - for finding leaks in batch mode
+#include <tlhelp32.h>
+
+// Security descriptors from strings - for the mutex all sessions use
+#include <sddl.h>
+
 // std stuff
 #include <fstream>
 #include <string>
 #include <map>
+#include <unordered_map>
 #include <set>
 #include <vector>
+#include <algorithm>
+#include <memory>
+#include <queue>
+#include <sstream>
 using namespace std;
 
 // Needed for logging timestamps
 #include <time.h>
 
+// Needed for image analysis
+#include <math.h>
+
+// What doesn't need Windows: catalog, analysis, filter, history, schedule, settings
+// (default folder with images is the Pictures folder of the user)
+wstring getPicturesDirectory();
+#define DEFAULT_IMAGE_DIRECTORY         getPicturesDirectory()
+#include "wallcore.h"
+
 // Resources
 #include "resource.h"
 
@@ -47,37 +76,66 @@ const wchar_t* APP_NAME = L"Wallpaper Changer";
 // Delay of the wallpaper update when display or HW configuration is discovered
 // ...to aggregate multiple events OS fires quickly one after another
 #define SET_WALLPAPER_TIMER_DELAY       3000
+// Max number of threads reading images
+#define SCAN_MAX_THREADS                16
 
 // ID of timer triggered after HW change
 #define EVENT_SET_WALLPAPER_HW_CHANGE   0x5109
 // ID of timer for periodic wallpaper updates
 #define EVENT_SET_WALLPAPER_SCHEDULED   0x510A
+// ID of timer for checking if another session published the catalog of images
+#define EVENT_SHARED_CATALOG_RETRY      0x510B
+// ID of timer checking if the list of images was not used for a while
+#define EVENT_IDLE_TRIM                 0x510C
 
 // Message from our tray icon
 #define MY_TRAY_MESSAGE                 WM_USER + 1
 #define MY_MSG_FOLDER_CHANGED           WM_USER + 2
+// Messages from background thread reading images
+#define MY_MSG_SCAN_BATCH               WM_USER + 3
+#define MY_MSG_SCAN_DONE                WM_USER + 4
+// Message from background thread downloading images from the feed
+#define MY_MSG_FEED_UPDATE              WM_USER + 5
+// Message from background thread reading settings changed outside of the program
+#define MY_MSG_SETTINGS_CHANGED         WM_USER + 6
+#define MY_MSG_CONTROL_COMMANDS         WM_USER + 7
+#define MY_MSG_THUMBS_DONE              WM_USER + 8
 
 // Try icon menu IDs
 #define MENU_ID_EXIT                    1
 #define MENU_ID_SETTINGS                2
 #define MENU_ID_SET_WALLPAPER           3
+#define MENU_ID_SAVE_STATS              4
+#define MENU_ID_HISTORY_BACK            5
+#define MENU_ID_HISTORY_FORWARD         6
 
 
 
 // Forward declarations for functions that do the actual job
-void readWallpapers();
-bool setWallpapers(bool change = 0);
-unsigned long manageFolderWatcher(HWND window, bool start = true);
+void readWallpapers(HWND window, bool change = false);
+void updateSourceWeights(const WallSettings& settings);
+bool setWallpapers(bool change = 0, int monitor = -1);
+void manageFolderWatcher(HWND window, bool start = true);
+void manageFeed(HWND window, bool start = true);
+bool updateNotificationIcon(HWND window, const WCHAR* tip);
+wstring getAppDataPath(const wchar_t* extension);
+void manageTrace();
+void updateThumbnails();
+void scheduleWallpaperChange(HWND window, ULONGLONG after = 0);
+void restoreCatalog();
+void manageIdleTrim(HWND window);
+void updateHistorySize();
 
 
 
 #pragma region "DEBUG LOGGER"
 
-// A slow, primitive, always flushing, non thread safe file logger
+// A slow, primitive, always flushing file logger - lines written by different threads don't mix
 class Logger
 {
 public:
     Logger(const WCHAR* name, bool enable = true) : enabled(enable) {
+        InitializeCriticalSection(&lock);
         PWSTR logDir;
         SHGetKnownFolderPath(FOLDERID_LocalAppData, 0, NULL, &logDir);
         file = logDir;
@@ -87,17 +145,15 @@ public:
         file += L".log";
     }
 
+    ~Logger() {
+        DeleteCriticalSection(&lock);
+    }
+
     const Logger& operator<< (const WCHAR* msg) const {
         if (!enabled)
             return *this;
 
-        WCHAR buffer[80];
-        formatTimestamp(buffer);
-
-        wofstream f(file, wofstream::app);
-        f << buffer << msg << L"\n";
-        f.close();
-
+        write(msg);
         return *this;
     }
 
@@ -105,13 +161,7 @@ public:
         if (!enabled)
             return *this;
 
-        WCHAR buffer[80];
-        formatTimestamp(buffer);
-
-        wofstream f(file, wofstream::app);
-        f << buffer << to_wstring(num).c_str() << L"\n";
-        f.close();
-
+        write(to_wstring(num).c_str());
         return *this;
     }
 
@@ -120,6 +170,17 @@ public:
     }
 
 private:
+    void write(const WCHAR* text) const {
+        WCHAR buffer[80];
+        formatTimestamp(buffer);
+
+        EnterCriticalSection(&lock);
+        wofstream f(file, wofstream::app);
+        f << buffer << text << L"\n";
+        f.close();
+        LeaveCriticalSection(&lock);
+    }
+
     void formatTimestamp(wchar_t* buff) const {
         time_t rawtime;
         struct tm timeinfo;
@@ -128,131 +189,351 @@ private:
         wcsftime(buff, 80, L"%F %T   ", &timeinfo);
     }
 
-    bool    enabled;
-    wstring file;
+    volatile bool               enabled;
+    wstring                     file;
+    mutable CRITICAL_SECTION    lock;
 } LOG(APP_NAME, true);
 
 #pragma endregion
 
 
 
-#pragma region "GENERIC SETTINGS UTILITIES"
+#pragma region "METRICS"
+
+// Counters, gauges and latency histograms telling how the program performs. Any thread can update
+// them - only interlocked (atomic) operations are used, no locks, so the cost is a few instructions.
+// On request all of them are written to files in LocalAppData: JSON and Prometheus text format.
+// Buckets of histograms are in wallcore.h.
 
-// Class representing a single configurable value: integer, boolean or text.
-// I think I liked the version that was storing values simply as strings better - was much much shorter.
-class Value
+class Metric
 {
 public:
-    typedef enum { String, Int, Bool /*, Enum*/ } Type;
+    // Metrics are globals - registered before any thread starts
+    Metric(const char* name, const char* help) : name(name), help(help), next(all) {
+        all = this;
+    }
 
-    Value(bool default) : type(Type::Bool), boolVal(default) {}
-    Value(int default) : type(Type::Int), intVal(default) {}
-    Value(const wchar_t* default) : type(Type::String), strVal(new wstring(default)) {}
-    Value() { throw std::runtime_error("never to be used");  }
+    virtual ~Metric() {}
 
-    ~Value() { if (type == Type::String && strVal != nullptr) delete strVal; }
+    // Write all the metrics in the order they were declared
+    static void writeAll(ostream& out, bool prometheus) {
+        vector<Metric*> metrics;
+        for (Metric* m = all; m != nullptr; m = m->next) {
+            metrics.insert(metrics.begin(), m);
+        }
+        if (!prometheus) {
+            out << "{\n";
+        }
+        for (size_t i = 0; i < metrics.size(); i++) {
+            if (prometheus) {
+                out << "# HELP wall_" << metrics[i]->name << " " << metrics[i]->help << "\n";
+                metrics[i]->writePrometheus(out);
+            }
+            else {
+                out << "  \"" << metrics[i]->name << "\": ";
+                metrics[i]->writeJson(out);
+                out << (i + 1 < metrics.size() ? ",\n" : "\n");
+            }
+        }
+        if (!prometheus) {
+            out << "}\n";
+        }
+    }
 
-    // Get rid of the asignment operator and copy constructor
-    Value & operator=(const Value&) = delete;
-    Value(const Value& org) = delete;
+protected:
+    virtual void writeJson(ostream& out) = 0;
+    virtual void writePrometheus(ostream& out) = 0;
 
-    // Move constructor - needed since we store settings in tuple and don't want copy
-    Value(Value&& org) {
-        type = org.type;
-        strVal = org.strVal;
-        org.strVal = nullptr;
+    static LONGLONG read(volatile LONGLONG& value) {
+        return InterlockedCompareExchange64(&value, 0, 0);
     }
 
+    const char*     name;
+    const char*     help;
+
+private:
+    Metric*         next;
+    static Metric*  all;
+};
+
+Metric* Metric::all = nullptr;
+
+
+
+// Number of things that happened
+class MetricCounter : public Metric
+{
 public:
-    operator bool() const {
-        validateType(Type::Bool);
-        //return value == L"true";
-        return boolVal;
+    MetricCounter(const char* name, const char* help) : Metric(name, help), value(0) {}
+
+    void add(LONGLONG n = 1) {
+        InterlockedExchangeAdd64(&value, n);
     }
 
-    operator int() const {
-        validateType(Type::Int);
-        //return std::stoi(value);
-        return intVal;
+protected:
+    void writeJson(ostream& out) {
+        out << read(value);
     }
 
-    operator const wchar_t*() const {
-        validateType(Type::String);
-        //return value.c_str();
-        return strVal->c_str();
+    void writePrometheus(ostream& out) {
+        out << "# TYPE wall_" << name << " counter\n";
+        out << "wall_" << name << " " << read(value) << "\n";
     }
 
-    void setVal(bool val) {
-        validateType(Type::Bool);
-        boolVal = val;
+    volatile LONGLONG   value;
+};
+
+
+
+// Current value of something
+class MetricGauge : public Metric
+{
+public:
+    MetricGauge(const char* name, const char* help) : Metric(name, help), value(0) {}
+
+    void set(LONGLONG v) {
+        InterlockedExchange64(&value, v);
     }
 
-    void setVal(int val) {
-        validateType(Type::Int);
-        intVal = val;
+protected:
+    void writeJson(ostream& out) {
+        out << read(value);
     }
 
-    void setVal(const wchar_t* val) {
-        validateType(Type::String);
-        *strVal = val;
+    void writePrometheus(ostream& out) {
+        out << "# TYPE wall_" << name << " gauge\n";
+        out << "wall_" << name << " " << read(value) << "\n";
     }
 
-    void fromString(const wchar_t* str) {
-        switch (type) {
-        case Type::Bool:
-            boolVal = wcscmp(str, L"true") == 0;
-            break;
-        case Type::Int:
-            intVal = std::stoi(str);
-            break;
-        case Type::String:
-            *strVal = str;
-            break;
+    volatile LONGLONG   value;
+};
+
+
+
+// Distribution of values (usually times in microseconds) in logarithmic buckets (see wallcore.h)
+class MetricHistogram : public Metric
+{
+public:
+    MetricHistogram(const char* name, const char* help) : Metric(name, help) {}
+
+    void record(LONGLONG v) {
+        values.record(v);
+    }
+
+protected:
+    void writeJson(ostream& out) {
+        LONGLONG counts[METRIC_BUCKETS];
+        LONGLONG count = values.snapshot(counts);
+        out << "{ \"count\": " << count << ", \"sum\": " << values.getSum()
+            << ", \"p50\": " << values.percentile(counts, count, 50) << ", \"p90\": " << values.percentile(counts, count, 90)
+            << ", \"p99\": " << values.percentile(counts, count, 99) << ", \"max\": " << values.getMax() << " }";
+    }
+
+    void writePrometheus(ostream& out) {
+        LONGLONG counts[METRIC_BUCKETS];
+        LONGLONG count = values.snapshot(counts);
+        out << "# TYPE wall_" << name << " histogram\n";
+        LONGLONG cumulative = 0;
+        for (int i = 0; i < METRIC_BUCKETS; i++) {
+            if (counts[i] > 0) {
+                cumulative += counts[i];
+                out << "wall_" << name << "_bucket{le=\"" << Histogram::upperBound(i) << "\"} " << cumulative << "\n";
+            }
         }
+        out << "wall_" << name << "_bucket{le=\"+Inf\"} " << count << "\n";
+        out << "wall_" << name << "_sum " << values.getSum() << "\n";
+        out << "wall_" << name << "_count " << count << "\n";
     }
 
-    void toString(wstring& outStr) const {
-        switch (type) {
-        case Type::Bool:
-            outStr = boolVal ? L"true" : L"false";
-            break;
-        case Type::Int:
-            outStr = std::to_wstring(intVal);
-            break;
-        case Type::String:
-            outStr = *strVal;
-            break;
+private:
+    Histogram           values;
+};
+
+
+
+// Records time from its creation to its destruction
+class MetricTimer
+{
+public:
+    MetricTimer(MetricHistogram& histogram) : histogram(histogram), start(now()) {}
+
+    ~MetricTimer() {
+        histogram.record(microsSince(start));
+    }
+
+    static LONGLONG now() {
+        LARGE_INTEGER counter;
+        QueryPerformanceCounter(&counter);
+        return counter.QuadPart;
+    }
+
+    static LONGLONG microsSince(LONGLONG start) {
+        static LONGLONG frequency = 0;
+        if (frequency == 0) {
+            LARGE_INTEGER f;
+            QueryPerformanceFrequency(&f);
+            frequency = f.QuadPart;
+        }
+        return (now() - start) * 1000000 / frequency;
+    }
+
+private:
+    MetricHistogram&    histogram;
+    LONGLONG            start;
+};
+
+
+
+// What is measured
+MetricHistogram metricScanTime("scan_duration_us", "Time of reading a folder with images");
+MetricCounter   metricFilesProbed("files_probed", "Image files opened by scans");
+MetricCounter   metricProbeFailures("probe_failures", "Files that could not be read as images");
+MetricGauge     metricCatalogSize("catalog_images", "Images known when wallpapers were chosen last time");
+MetricHistogram metricCandidates("candidates_per_monitor", "Images matching a monitor when wallpapers are chosen");
+MetricHistogram metricSelectionTime("selection_us", "Time of choosing images for all the monitors");
+MetricHistogram metricDesktopCallTime("desktop_call_us", "Latency of calls to the desktop (IDesktopWallpaper)");
+MetricHistogram metricDisplayChangeTime("display_change_to_apply_us", "Time from a display change to wallpapers set");
+MetricCounter   metricCatalogTrims("catalog_trims", "Times the list of images was dropped from memory when idle");
+MetricHistogram metricCatalogRestoreTime("catalog_restore_us", "Time of reading the list of images back after it was dropped");
+
+
+// Write the metrics to LocalAppData (*.stats.json and *.stats.prom)
+bool saveMetrics()
+{
+    bool saved = true;
+    for (int prometheus = 0; prometheus < 2; prometheus++) {
+        wstring file = getAppDataPath(prometheus ? L".stats.prom" : L".stats.json");
+        wstring temp = file + L".tmp";
+        ofstream f(temp);
+        Metric::writeAll(f, prometheus != 0);
+        bool ok = f.good();
+        f.close();
+        if (!ok || !MoveFileEx(temp.c_str(), file.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+            DeleteFile(temp.c_str());
+            saved = false;
+        }
+    }
+    return saved;
+}
+
+#pragma endregion
+
+
+
+#pragma region "EVENT TRACE"
+
+// Events that make the program change wallpapers - window messages, monitor layouts, changes
+// of the list of images, settings and requests to set wallpapers - can be recorded to a binary
+// file (TraceFile setting) and replayed later against a simulated desktop (/replay option).
+// File format and records are in wallcore.h.
+
+class TraceRecorder
+{
+public:
+    TraceRecorder() : start(0) {}
+
+    bool isOpen() const {
+        return out.is_open();
+    }
+
+    const wstring& getFile() const {
+        return file;
+    }
+
+    bool open(const wstring& name) {
+        close();
+        out.open(name, ios::binary | ios::trunc);
+        if (!out.is_open()) {
+            return false;
+        }
+        FILETIME now;
+        GetSystemTimeAsFileTime(&now);
+        writeTraceHeader(out, ((ULONGLONG)now.dwHighDateTime << 32) | now.dwLowDateTime);
+        file = name;
+        start = GetTickCount64();
+        lastState.clear();
+        return true;
+    }
+
+    void close() {
+        if (out.is_open()) {
+            out.close();
+        }
+        file.clear();
+    }
+
+    // Record of a state (like monitor layout) - only if it changed since the last one of its type.
+    // If it could not be written, the same state is tried again next time.
+    void writeState(const TraceRecord& record) {
+        vector<BYTE>& last = lastState[record.type];
+        if (record.data != last && write(record)) {
+            last = record.data;
         }
     }
 
+    bool write(const TraceRecord& record) {
+        if (!out.is_open()) {
+            return false;
+        }
+        if (!writeTraceRecord(out, (DWORD)(GetTickCount64() - start), record)) {
+            LOG << L"Trace record too long, not written - type:" << (int)record.type << L" length:" << (int)record.data.size();
+            return false;
+        }
+        // Messages are rare - what led to them is in the file even if the program crashes
+        if (record.type == TraceMessage || record.type == TraceSetWallpapers) {
+            out.flush();
+        }
+        return true;
+    }
 
 private:
-    void validateType(Type t) const {
-        if (type != t) throw std::runtime_error("incorrect type of the settings variable");
+    ofstream                            out;
+    wstring                             file;
+    ULONGLONG                           start;
+    map<TraceRecordType, vector<BYTE>>  lastState;
+};
+
+
+class TraceReader
+{
+public:
+    bool open(const wstring& file) {
+        in.open(file, ios::binary);
+        ULONGLONG started;
+        return readTraceHeader(in, started);
     }
 
-    Type            type;
+    // The next record and its time - false at the end of the file
+    bool next(DWORD& time, TraceRecord& record) {
+        return readTraceRecord(in, time, record);
+    }
 
-    union {
-        bool     boolVal;
-        int      intVal;
-        wstring* strVal;
-    };
+private:
+    ifstream    in;
 };
 
 
+// Global (used by main thread only):
+TraceRecorder traceRecorder;
+
+#pragma endregion
+
+
+
+#pragma region "GENERIC SETTINGS UTILITIES"
 
+// Settings stored in an ini file. T is a structure with a field for every setting and a method
+// forEach(f) calling f(name, field) for each of them - values are read directly from fields,
+// with their own types, no lookups and no type checks when the program runs. The text form
+// (as in the file) is made and parsed in wallcore.h.
+// Values are never changed in place: a new copy is published atomically (see PublishedValues
+// in wallcore.h), threads that took a snapshot keep using their copy as long as they need it.
 template<typename T>
 class Settings
 {
 public:
-    Settings(tuple<T, const wchar_t*, Value>* tuples, int count, const wchar_t* fileName)
+    Settings(const wchar_t* fileName)
     {
-        for (int i = 0; i < count; i++) {
-            this->key2setting.insert(make_pair(std::get<0>(tuples[i]), &std::get<2>(tuples[i])));
-            this->name2key.insert(make_pair(std::get<1>(tuples[i]), std::get<0>(tuples[i])));
-        }
-
         PWSTR settingsDir;
         SHGetKnownFolderPath(FOLDERID_LocalAppData, 0, NULL, &settingsDir);
         file = settingsDir;
@@ -261,60 +542,78 @@ public:
         file += fileName;
         file += L".ini";
 
-        load();
-        save();
+        T values;
+        int found = load(values);
+        current.publish(values);
+
+        // First start or new settings added - write them all, so they can be found in the file
+        int count = 0;
+        values.forEach([&](const wchar_t*, const auto&) { count++; });
+        if (found < count) {
+            write(values);
+        }
     }
 
-    Value& get(T key) {
-        return *key2setting[key];
+    // Current values - for the main thread, the only one that changes them
+    const T* operator->() const {
+        return current.get();
     }
 
+    const T& operator*() const {
+        return *current.get();
+    }
 
-    void save() {
-        wstring val;
-        wofstream f(file);
-        for (auto const& s : name2key) {
-            key2setting[s.second]->toString(val);
-            f << s.first << L"=" << val << std::endl;
-        }
-        f.close();
+    // Values that stay valid however long they are used - for other threads
+    shared_ptr<const T> snapshot() const {
+        return current.snapshot();
     }
 
-private:
-    void load() {
-        wstring line;
-        wstring name;
-        wstring value;
+    // Publish new values. The file is written only if something changed (and it is not where they come from).
+    void set(const T& values, bool save = true) {
+        if (toText(values) == toText(*current.get())) {
+            return;
+        }
+        current.publish(values);
+        if (save) {
+            write(values);
+        }
+    }
 
+    // Read the file, settings not found there keep values they have. Returns number of settings read.
+    int load(T& values) const {
         wifstream f(file);
-        while (std::getline(f, line))
-        {
-            // Split the ini file line
-            size_t pos = line.find(L"=");
-            if (pos == wstring::npos) {
-                // Exactly two tokens should be there
-                continue;
-            }
-            name = line.substr(0, pos);
-            value = line.substr(pos + 1);
+        return parseSettings(f, values);
+    }
 
-            try {
-                T key = name2key.at(name.c_str());
-                Value* s = key2setting[key];
-                s->fromString(value.c_str());
-            }
-            catch (...) {
-                // Ignore setting not recognized
-            }
-        }
-        f.close();
+    // The same for settings in the text form (as in the file)
+    int fromText(const wstring& text, T& values) const {
+        wistringstream s(text);
+        return parseSettings(s, values);
+    }
+
+    wstring toText(const T& values) const {
+        return settingsToText(values);
+    }
+
+    const wstring& getFile() const {
+        return file;
     }
 
 private:
-    map<T, Value*>    key2setting;
-    map<wstring, T>     name2key;
-    wstring             file;
+    // Write to a temporary file and replace the old one with it - the file is never seen half written
+    void write(const T& values) {
+        wstring temp = file + L".tmp";
+        wofstream f(temp);
+        f << toText(values);
+        bool ok = f.good();
+        f.close();
+        if (!ok || !MoveFileEx(temp.c_str(), file.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+            DeleteFile(temp.c_str());
+        }
+    }
 
+    wstring                 file;
+    PublishedValues<T>      current;
 };
 
 #pragma endregion
@@ -323,52 +622,21 @@ private:
 
 #pragma region "APPLICATION SPECIFIC SETTINGS + CONFIG DIALOG"
 
-typedef enum {
-    ImageDirectory,
-    AllowUpscaling,
-    AutoChangeImage,
-    AutoChangeInterval,
-    AllowedAspectRatioMismatch,
-    DisplayMode,
-    MultiMonPolicy,
-    EnableDebugLog
-} WallSettings;
+// Settings of this application and which of them need what when they change are in wallcore.h
 
-
-typedef enum {
-    Different = 0,
-    Same,
-    Whatever
-} MultiMonImage;
-
-
-
-// Some settings that are needed for this application
-Settings<WallSettings>& getSettings()
+// Pictures folder of the user - default place to look for images
+wstring getPicturesDirectory()
 {
     PWSTR picturesDir;
     SHGetKnownFolderPath(FOLDERID_Pictures, 0, NULL, &picturesDir);
-
-    static wstring picturesDirStr(picturesDir);
+    wstring dir(picturesDir);
     CoTaskMemFree(picturesDir);
+    return dir;
+}
 
-    static tuple<WallSettings, const wchar_t*, Value> mySettings[] = {
-        make_tuple(WallSettings::ImageDirectory,             L"ImageDirectory",              Value(picturesDirStr.c_str())),
-        make_tuple(WallSettings::AllowUpscaling,             L"AllowUpscaling",              Value(false)),
-        make_tuple(WallSettings::AutoChangeImage,            L"AutoChangeImage",             Value(false)),
-        make_tuple(WallSettings::AutoChangeInterval,         L"AutoChangeInterval",          Value(10)),
-        make_tuple(WallSettings::AllowedAspectRatioMismatch, L"AllowedAspectRatioMismatch",  Value(1)),
-        make_tuple(WallSettings::DisplayMode,                L"DisplayMode",                 Value(DWPOS_FILL)),
-        make_tuple(WallSettings::MultiMonPolicy,             L"MultiMonPolicy",              Value(0)),
-        make_tuple(WallSettings::EnableDebugLog,             L"EnableDebugLog",              Value(false)),
-    };
-
-    static Settings<WallSettings> theSettingsObj(mySettings, sizeof(mySettings) / sizeof(mySettings[0]), APP_NAME);
 
-    return theSettingsObj;
-}
 
-Settings<WallSettings>& SETTINGS = getSettings();
+Settings<WallSettings> SETTINGS(APP_NAME);
 
 
 
@@ -402,9 +670,10 @@ bool isAutoStartEnabled() {
 void initDlgAndLoadSettings(HWND window)
 {
     // Most settings are accessed via SETTINGS global, autostart goes directly to/from registry
-    SetDlgItemText(window, IDC_DIRECTORY, SETTINGS.get(WallSettings::ImageDirectory));
+    SetDlgItemText(window, IDC_DIRECTORY, SETTINGS->ImageDirectory.c_str());
 
     // No DWPOS_SPAN or DWPOS_TILE since the program installs separate wallpapers on every screen
+    // (with composite wallpaper DWPOS_SPAN is used, but the mode still says how every image is placed)
     const wchar_t* modesNames[] = {
         L"Fill", // - cover entire screen, preserve aspect ratio, image may be clipped"
         L"Fit", // - preserve aspect ratio, do not clip image - black bands possible around",
@@ -417,7 +686,7 @@ void initDlgAndLoadSettings(HWND window)
     for (int i = sizeof(modesNames) / sizeof(modesNames[0]) - 1; i >= 0; i--) {
         SendMessage(comboDisplayMode, CB_INSERTSTRING, 0, (LPARAM)modesNames[i]);
         SendMessage(comboDisplayMode, CB_SETITEMDATA, 0, modeCodes[i]);
-        if ((int)SETTINGS.get(WallSettings::DisplayMode) == modeCodes[i]) {
+        if (SETTINGS->DisplayMode == modeCodes[i]) {
             sel = i;
         }
     }
@@ -425,21 +694,21 @@ void initDlgAndLoadSettings(HWND window)
 
     CheckDlgButton(window, IDC_AUTO_START, isAutoStartEnabled() ? BST_CHECKED : BST_UNCHECKED);
 
-    CheckDlgButton(window, IDC_AUTO_CHANGE, (bool)SETTINGS.get(WallSettings::AutoChangeImage) ? BST_CHECKED : BST_UNCHECKED);
+    CheckDlgButton(window, IDC_AUTO_CHANGE, SETTINGS->AutoChangeImage ? BST_CHECKED : BST_UNCHECKED);
     SendMessage(GetDlgItem(window, IDC_AUTO_CHANGE_SPIN), UDM_SETRANGE32, 0, MAXINT32);
     // Setting buddy makes the editbox too narrow
     //SendMessage(GetDlgItem(window, IDC_AUTO_CHANGE_SPIN), UDM_SETBUDDY, (int)GetDlgItem(window, IDC_AUTO_CHANGE_INTERVAL), 0);
-    SetDlgItemInt(window, IDC_AUTO_CHANGE_INTERVAL, (int)SETTINGS.get(WallSettings::AutoChangeInterval), false);
+    SetDlgItemInt(window, IDC_AUTO_CHANGE_INTERVAL, SETTINGS->AutoChangeInterval, false);
 
-    CheckDlgButton(window, IDC_ALLOW_UPSCALLING, (bool)SETTINGS.get(WallSettings::AllowUpscaling) ? BST_CHECKED : BST_UNCHECKED);
+    CheckDlgButton(window, IDC_ALLOW_UPSCALLING, SETTINGS->AllowUpscaling ? BST_CHECKED : BST_UNCHECKED);
 
-    const wchar_t* multimonNames[] = { L"different images", L"the same image", L"(no preference)" };
-    MultiMonImage multiMonPolicy = MultiMonImage::Whatever;
+    const wchar_t* multimonNames[] = { L"different images", L"the same image", L"(no preference)", L"similar looking images" };
+    MultiMonImage multiMonPolicy = MultiMonImage::Similar;
     HWND comboMultiMon = GetDlgItem(window, IDC_MULTIPLE_MONITORS);
 	for (int i = sizeof(multimonNames) / sizeof(multimonNames[0]) - 1; i >= 0;  i--) {
         SendMessage(comboMultiMon, CB_INSERTSTRING, 0, (LPARAM)multimonNames[i]);
         SendMessage(comboMultiMon, CB_SETITEMDATA, 0, multiMonPolicy);
-        if ((int)SETTINGS.get(WallSettings::MultiMonPolicy) == multiMonPolicy) {
+        if (SETTINGS->MultiMonPolicy == multiMonPolicy) {
             sel = i;
         }
         ((int&)multiMonPolicy)--;
@@ -448,9 +717,15 @@ void initDlgAndLoadSettings(HWND window)
 
     HWND aspect = GetDlgItem(window, IDC_ASPECT_RATIO_MISMATCH);
     SendMessage(aspect, TBM_SETRANGE, true, MAKELONG(0, 1000));  // min. & max. positions
-    SendMessage(aspect, TBM_SETPOS, true, (int)SETTINGS.get(WallSettings::AllowedAspectRatioMismatch));
+    SendMessage(aspect, TBM_SETPOS, true, SETTINGS->AllowedAspectRatioMismatch);
+
+    CheckDlgButton(window, IDC_DEBUG_LOG, SETTINGS->EnableDebugLog ? BST_CHECKED : BST_UNCHECKED);
 
-    CheckDlgButton(window, IDC_DEBUG_LOG, (bool)SETTINGS.get(WallSettings::EnableDebugLog) ? BST_CHECKED : BST_UNCHECKED);
+    SetDlgItemInt(window, IDC_SCAN_FILES_PER_SEC, SETTINGS->ScanMaxFilesPerSec, false);
+    SetDlgItemInt(window, IDC_SCAN_THREADS, SETTINGS->ScanThreads, false);
+
+    CheckDlgButton(window, IDC_SPAN_COMPOSITE, SETTINGS->SpanComposite ? BST_CHECKED : BST_UNCHECKED);
+    CheckDlgButton(window, IDC_SMART_CROP, SETTINGS->SmartCrop ? BST_CHECKED : BST_UNCHECKED);
 
 }
 
@@ -492,20 +767,41 @@ bool saveSettingsFromDlg(HWND window)
 
     bool debug = IsDlgButtonChecked(window, IDC_DEBUG_LOG);
 
+    bool spanComposite = IsDlgButtonChecked(window, IDC_SPAN_COMPOSITE);
+    bool smartCrop = IsDlgButtonChecked(window, IDC_SMART_CROP);
+
+    BOOL scanFilesPerSecOk;
+    int scanFilesPerSec = GetDlgItemInt(window, IDC_SCAN_FILES_PER_SEC, &scanFilesPerSecOk, false);
+    if (!scanFilesPerSecOk) {
+        MessageBox(window, L"Number of images read per second must be a number (0 - no limit)", L"Wrong value", MB_OK | MB_ICONEXCLAMATION);
+        return false;
+    }
+    BOOL scanThreadsOk;
+    int scanThreads = GetDlgItemInt(window, IDC_SCAN_THREADS, &scanThreadsOk, false);
+    if (!scanThreadsOk || scanThreads < 1 || scanThreads > SCAN_MAX_THREADS) {
+        MessageBox(window, L"Number of threads reading images must be a number from 1 to 16", L"Wrong value", MB_OK | MB_ICONEXCLAMATION);
+        return false;
+    }
+
     // All data ok, save the settings
-    SETTINGS.get(WallSettings::ImageDirectory).setVal(directory);
-    SETTINGS.get(WallSettings::DisplayMode).setVal(displayMode);
+    WallSettings settings(*SETTINGS.snapshot());
+    settings.ImageDirectory = directory;
+    settings.DisplayMode = displayMode;
     enableAutoStart(autoStart);
-    SETTINGS.get(WallSettings::AutoChangeImage).setVal(autoChange);
-    SETTINGS.get(WallSettings::AutoChangeInterval).setVal(autoChangeIntervalOk ? autoChangeInterval : 10);
-    SETTINGS.get(WallSettings::AllowUpscaling).setVal(allowUpscalling);
-    SETTINGS.get(WallSettings::MultiMonPolicy).setVal(multiMonMode);
-    SETTINGS.get(WallSettings::AllowedAspectRatioMismatch).setVal(aspectMismatch);
-    SETTINGS.get(WallSettings::EnableDebugLog).setVal(debug);
+    settings.AutoChangeImage = autoChange;
+    settings.AutoChangeInterval = autoChangeIntervalOk ? autoChangeInterval : 10;
+    settings.AllowUpscaling = allowUpscalling;
+    settings.MultiMonPolicy = multiMonMode;
+    settings.AllowedAspectRatioMismatch = aspectMismatch;
+    settings.EnableDebugLog = debug;
+    settings.ScanMaxFilesPerSec = scanFilesPerSec;
+    settings.ScanThreads = scanThreads;
+    settings.SpanComposite = spanComposite;
+    settings.SmartCrop = smartCrop;
     // In case of debug log configure the logging object
     LOG.enable(debug);
 
-    SETTINGS.save();
+    SETTINGS.set(settings);
 
     return true;
 }
@@ -631,6 +927,39 @@ INT_PTR CALLBACK DialogProc(HWND window, unsigned int msg, WPARAM wp, LPARAM lp)
 }
 
 
+// Do what is needed after settings changed - and nothing more
+void applySettings(HWND window, const WallSettings& old)
+{
+    const WallSettings& now = *SETTINGS;
+    LOG.enable(now.EnableDebugLog);
+    manageTrace();
+
+    int changes = getSettingsChanges(old, now);
+    if (changes & SETTINGS_READ_SOURCES) {
+        readWallpapers(window, (changes & SETTINGS_NEW_WALLPAPER) != 0);
+    }
+    if (changes & SETTINGS_WATCH_SOURCES) {
+        manageFolderWatcher(window);
+    }
+    if (changes & SETTINGS_CHOOSE_AGAIN) {
+        updateSourceWeights(now);
+        setWallpapers(false);
+    }
+    if (changes & SETTINGS_RESCHEDULE) {
+        scheduleWallpaperChange(window);
+    }
+    if (changes & SETTINGS_RESTART_FEED) {
+        manageFeed(window);
+    }
+    if (changes & SETTINGS_IDLE_TRIM) {
+        manageIdleTrim(window);
+    }
+    if (changes & SETTINGS_HISTORY_SIZE) {
+        updateHistorySize();
+    }
+}
+
+
 void showConfig(HWND window)
 {
     static bool showing = false;
@@ -639,313 +968,5124 @@ void showConfig(HWND window)
     else {
         // poorman's synchronization
         showing = true;
-        wstring oldDir(SETTINGS.get(WallSettings::ImageDirectory));
+        WallSettings old(*SETTINGS);
         INT_PTR res = DialogBox(GetModuleHandle(NULL), MAKEINTRESOURCE(IDD_SETTINGS), window, DialogProc);
         if (res == IDOK) {
-            readWallpapers();
-            // Set the wallpaper - if directory changed force changing the image
-            bool imageDirChanged = oldDir != (const wchar_t*)SETTINGS.get(WallSettings::ImageDirectory);
-            setWallpapers(imageDirChanged);
-            if (imageDirChanged) {
-                manageFolderWatcher(window);
-            }
-            if ((bool)SETTINGS.get(WallSettings::AutoChangeImage)) {
-                SetTimer(window, EVENT_SET_WALLPAPER_SCHEDULED, ONE_MINUTE_MILLIS * (int)SETTINGS.get(WallSettings::AutoChangeInterval), NULL);
-            }
-            else {
-                KillTimer(window, EVENT_SET_WALLPAPER_SCHEDULED);
-            }
+            applySettings(window, old);
         }
         showing = false;
     }
 }
 
-#pragma endregion
-
 
 
-#pragma region "MONITORING FOLDER WITH IMAGES"
+// The ini file may be changed by someone else (like a deployment script) - changes are applied
+// without restart. The file is read in the background, main thread gets complete new values.
+#define SETTINGS_RELOAD_DELAY           500
 
 typedef struct {
-    HANDLE          mutex;
-    const wchar_t*  folder;
-    HWND            window;
-} WatcherData;
+    HWND        window;
+    HANDLE      stopEvent;
+    HANDLE      thread;
+} SettingsWatcher;
 
+// Global (used by main thread only):
+SettingsWatcher settingsWatcher = { 0 };
 
-unsigned long WINAPI folderWatcherThreadProc(void* data)
-{
-    unsigned long waitStatus;
-    HANDLE        changeHandle;
-    WatcherData   watcherData = *(WatcherData*)data;
 
-    changeHandle = FindFirstChangeNotification(
-        watcherData.folder,                // directory to watch
-        FALSE,                              // do not watch subtree
-        FILE_NOTIFY_CHANGE_FILE_NAME);      // watch file name changes
+ULONGLONG getFileWriteTime(const wstring& file)
+{
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesEx(file.c_str(), GetFileExInfoStandard, &data)) {
+        return 0;
+    }
+    return ((ULONGLONG)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+}
 
-    HANDLE  waitHandles[] = { changeHandle , watcherData.mutex};
 
-    while (true)
-    {
-        LOG << L"Watching folder " << watcherData.folder;
-        waitStatus = WaitForMultipleObjects(2, waitHandles, FALSE, INFINITE);
+unsigned long WINAPI settingsWatcherThreadProc(void* data)
+{
+    SettingsWatcher* watcher = (SettingsWatcher*)data;
+    const wstring& file = SETTINGS.getFile();
+    wstring dir = file.substr(0, file.find_last_of(L'\\'));
 
-        switch (waitStatus)
-        {
-            case WAIT_OBJECT_0:
-                LOG << L"Change in observed folder";
-                // Notify App window about the change
-                SendMessage(watcherData.window, MY_MSG_FOLDER_CHANGED, 0, 0);
-                if (FindNextChangeNotification(changeHandle) == FALSE) {
-                    return 0;
-                }
-                break;
+    HANDLE change = FindFirstChangeNotification(dir.c_str(), FALSE, FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME);
+    if (change == INVALID_HANDLE_VALUE) {
+        return 0;
+    }
+    ULONGLONG lastTime = getFileWriteTime(file);
+    HANDLE waitHandles[] = { watcher->stopEvent, change };
 
-            case WAIT_OBJECT_0 + 1:
-                LOG << L"Thread asked to terminate";
-                CloseHandle(watcherData.mutex);
-                FindCloseChangeNotification(changeHandle);
-                return 0;
+    while (WaitForMultipleObjects(2, waitHandles, FALSE, INFINITE) == WAIT_OBJECT_0 + 1) {
+        // Files are often written in a few steps - wait until it's done, changes in the meantime are merged
+        if (WaitForSingleObject(watcher->stopEvent, SETTINGS_RELOAD_DELAY) != WAIT_TIMEOUT
+                || !FindNextChangeNotification(change)) {
+            break;
+        }
+        // Other files in the folder change all the time
+        ULONGLONG time = getFileWriteTime(file);
+        if (time == 0 || time == lastTime) {
+            continue;
+        }
+        lastTime = time;
 
-            default:
-                LOG << L"Unexpected notification";
-                FindCloseChangeNotification(changeHandle);
-                return 0;
+        // Settings missing in the file (or not written yet) keep their values
+        WallSettings* values = new WallSettings(*SETTINGS.snapshot());
+        if (SETTINGS.load(*values) == 0 || !PostMessage(watcher->window, MY_MSG_SETTINGS_CHANGED, 0, (LPARAM)values)) {
+            delete values;
         }
     }
+
+    FindCloseChangeNotification(change);
+    return 0;
 }
 
 
-unsigned long manageFolderWatcher(HWND window, bool start)
+// Main thread: new values read from the file
+void onSettingsChanged(HWND window, WallSettings* values)
 {
-    static WatcherData data = { 0 };
+    WallSettings old(*SETTINGS);
+    SETTINGS.set(*values, false);
+    delete values;
+    applySettings(window, old);
+}
 
-    // If thread is already working ask it politely to terminate
-    if (data.mutex != NULL) {
-        ReleaseMutex(data.mutex);
-        data.mutex = 0;
-    }
 
-    if (!start) {
-        return NULL;
+void manageSettingsWatcher(HWND window, bool start = true)
+{
+    if (settingsWatcher.thread != NULL) {
+        SetEvent(settingsWatcher.stopEvent);
+        WaitForSingleObject(settingsWatcher.thread, INFINITE);
+        CloseHandle(settingsWatcher.thread);
+        CloseHandle(settingsWatcher.stopEvent);
+        settingsWatcher.thread = NULL;
     }
-
-    // The thread will not use the data anymore - use the structure again
-    data.mutex = CreateMutex(NULL, TRUE, L"");
-    if (data.mutex == NULL) {
-        LOG << L"Creating mutex for folder watcher syncyng failed";
-        return NULL;
+    if (!start) {
+        return;
     }
-
-    data.window = window;
-    data.folder = SETTINGS.get(WallSettings::ImageDirectory);
-
-
+    settingsWatcher.window = window;
+    settingsWatcher.stopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
     unsigned long threadId;
-    HANDLE thread = CreateThread(
-        NULL,                       // default security attributes
-        0,                          // use default stack size
-        folderWatcherThreadProc,    // thread function name
-        &data,                      // argument to thread function
-        0,                          // use default creation flags
-        &threadId);   // returns the thread identifier
-
-    if (threadId == NULL)
-    {
-        LOG << L"Creating thread for watching folder changes";
+    settingsWatcher.thread = CreateThread(NULL, 0, settingsWatcherThreadProc, &settingsWatcher, 0, &threadId);
+    if (settingsWatcher.thread == NULL) {
+        LOG << L"Creating thread for watching settings failed";
+        CloseHandle(settingsWatcher.stopEvent);
     }
-
-    LOG << L"Folder Watcher thread created";
-
-    return threadId;
 }
 
 #pragma endregion
 
 
 
-#pragma region "WALLPAPER IMAGES HANDLING"
+#pragma region "MONITORING FOLDER WITH IMAGES"
 
-// Global:
-// List of known images and their dimensions
-map<wstring, int> file2dimensions;
+// One thread watches all the folders with images for the whole life of the program.
+// Changes coming quickly one after another are merged: the main thread is told once per batch
+// (without waiting for it) and takes the list of changed folders when it is ready.
+// Folders that can't be watched (like an unplugged drive) are tried again from time to time.
+#define WATCH_BATCH_DELAY               1000
+#define WATCH_RETRY_INTERVAL            30000
+#define WATCH_MAX_ROOTS                 32
+#define WATCH_BUFFER_SIZE               4096
 
-// Read all images in the configured wallpapers directory and prapare
-// map of picture name to their dimentions ratio
-void readWallpapers()
+class FolderWatcher
 {
-    file2dimensions.clear();
-
-    // For reading image properties GDI library will be used - it must by initialized first
-    GdiplusStartupInput gdiplusStartupInput;
-    ULONG_PTR gdiplusToken;
-    GdiplusStartup(&gdiplusToken, &gdiplusStartupInput, NULL);
-
-    WIN32_FIND_DATA ffd;
-    HANDLE hFind = INVALID_HANDLE_VALUE;
-
-    const wchar_t* imageDir = SETTINGS.get(WallSettings::ImageDirectory);
+public:
+    FolderWatcher() : window(NULL), thread(NULL), rootsChanged(false), stopping(false) {
+        InitializeCriticalSection(&lock);
+        wakeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+    }
 
-    // Find the first file in the directory.
-    wstring searchTemplate(imageDir);
-    searchTemplate += L"\\*.jpg";
-    hFind = FindFirstFile(searchTemplate.c_str(), &ffd);
+    ~FolderWatcher() {
+        stop();
+        CloseHandle(wakeEvent);
+        DeleteCriticalSection(&lock);
+    }
 
-    if (INVALID_HANDLE_VALUE == hFind)
-    {
-        // No files in this directory or no access
+    // Start the thread (if not running yet), changes are reported to the window
+    bool start(HWND notifyWindow) {
+        if (thread != NULL) {
+            return true;
+        }
+        window = notifyWindow;
+        stopping = false;
+        unsigned long threadId;
+        thread = CreateThread(NULL, 0, threadProc, this, 0, &threadId);
+        if (thread == NULL) {
+            LOG << L"Creating thread for watching folders failed";
+            return false;
+        }
+        return true;
+    }
+
+    // Folders to watch - replaces the previous list, the thread picks it up without restarting
+    void setRoots(const vector<wstring>& roots) {
+        EnterCriticalSection(&lock);
+        wantedRoots = roots;
+        if (wantedRoots.size() > WATCH_MAX_ROOTS) {
+            wantedRoots.resize(WATCH_MAX_ROOTS);
+        }
+        rootsChanged = true;
+        LeaveCriticalSection(&lock);
+        SetEvent(wakeEvent);
+    }
+
+    // Stop watching and wait until the thread is gone
+    void stop() {
+        if (thread == NULL) {
+            return;
+        }
+        EnterCriticalSection(&lock);
+        stopping = true;
+        LeaveCriticalSection(&lock);
+        SetEvent(wakeEvent);
+        WaitForSingleObject(thread, INFINITE);
+        CloseHandle(thread);
+        thread = NULL;
+    }
+
+    // Main thread: folders changed since the last call
+    void takeChanges(set<wstring>& changed) {
+        EnterCriticalSection(&lock);
+        changed.swap(pending);
+        pending.clear();
+        LeaveCriticalSection(&lock);
+    }
+
+private:
+    typedef struct {
+        wstring         path;
+        HANDLE          dir;
+        OVERLAPPED      overlapped;
+        DWORD           buffer[WATCH_BUFFER_SIZE];     // DWORD aligned, as required
+    } WatchedRoot;
+
+    HWND                window;
+    HANDLE              thread;
+    HANDLE              wakeEvent;
+    CRITICAL_SECTION    lock;
+    // Guarded by the lock:
+    vector<wstring>     wantedRoots;
+    bool                rootsChanged;
+    bool                stopping;
+    set<wstring>        pending;
+
+    static unsigned long WINAPI threadProc(void* data) {
+        ((FolderWatcher*)data)->run();
+        return 0;
+    }
+
+    bool listen(WatchedRoot* root) {
+        return ReadDirectoryChangesW(root->dir, root->buffer, sizeof(root->buffer), FALSE,
+            FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE, NULL, &root->overlapped, NULL) != 0;
+    }
+
+    WatchedRoot* open(const wstring& path) {
+        WatchedRoot* root = new WatchedRoot();
+        root->path = path;
+        root->dir = CreateFile(path.c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+        root->overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        if (root->dir == INVALID_HANDLE_VALUE || root->overlapped.hEvent == NULL || !listen(root)) {
+            close(root, false);
+            return nullptr;
+        }
+        return root;
+    }
+
+    void close(WatchedRoot* root, bool listening) {
+        if (listening) {
+            // The request must be finished before its buffer is freed
+            DWORD bytes;
+            CancelIoEx(root->dir, &root->overlapped);
+            GetOverlappedResult(root->dir, &root->overlapped, &bytes, TRUE);
+        }
+        if (root->dir != INVALID_HANDLE_VALUE) {
+            CloseHandle(root->dir);
+        }
+        if (root->overlapped.hEvent != NULL) {
+            CloseHandle(root->overlapped.hEvent);
+        }
+        delete root;
+    }
+
+    void run() {
+        vector<WatchedRoot*> roots;
+        vector<wstring> wanted;
+        set<wstring> batch;
+        ULONGLONG batchStart = 0;
+        ULONGLONG lastOpen = 0;
+
+        while (true) {
+            EnterCriticalSection(&lock);
+            bool quit = stopping;
+            bool reopen = rootsChanged;
+            if (rootsChanged) {
+                wanted = wantedRoots;
+                rootsChanged = false;
+            }
+            LeaveCriticalSection(&lock);
+            if (quit) {
+                break;
+            }
+
+            // Open folders that should be watched, close the ones that should not
+            if (reopen || (roots.size() < wanted.size() && GetTickCount64() - lastOpen > WATCH_RETRY_INTERVAL)) {
+                for (auto it = roots.begin(); it != roots.end(); ) {
+                    if (std::find(wanted.begin(), wanted.end(), (*it)->path) == wanted.end()) {
+                        close(*it, true);
+                        it = roots.erase(it);
+                    }
+                    else {
+                        ++it;
+                    }
+                }
+                for (const wstring& path : wanted) {
+                    auto found = std::find_if(roots.begin(), roots.end(), [&](WatchedRoot* r) { return r->path == path; });
+                    if (found == roots.end()) {
+                        WatchedRoot* root = open(path);
+                        if (root != nullptr) {
+                            roots.push_back(root);
+                        }
+                    }
+                }
+                lastOpen = GetTickCount64();
+            }
+
+            HANDLE waitHandles[WATCH_MAX_ROOTS + 1];
+            waitHandles[0] = wakeEvent;
+            for (size_t i = 0; i < roots.size(); i++) {
+                waitHandles[i + 1] = roots[i]->overlapped.hEvent;
+            }
+            DWORD timeout = (roots.size() < wanted.size()) ? WATCH_RETRY_INTERVAL : INFINITE;
+            if (!batch.empty()) {
+                ULONGLONG waited = GetTickCount64() - batchStart;
+                timeout = (waited >= WATCH_BATCH_DELAY) ? 0 : (DWORD)(WATCH_BATCH_DELAY - waited);
+            }
+
+            DWORD res = WaitForMultipleObjects((DWORD)roots.size() + 1, waitHandles, FALSE, timeout);
+            if (res > WAIT_OBJECT_0 && res <= WAIT_OBJECT_0 + roots.size()) {
+                WatchedRoot* root = roots[res - WAIT_OBJECT_0 - 1];
+                // Names of changed files are not needed - the folder will be read again anyway.
+                // Even if the buffer overflowed (no bytes returned) something has changed.
+                if (batch.empty()) {
+                    batchStart = GetTickCount64();
+                }
+                batch.insert(root->path);
+                DWORD bytes;
+                GetOverlappedResult(root->dir, &root->overlapped, &bytes, FALSE);
+                ResetEvent(root->overlapped.hEvent);
+                if (!listen(root)) {
+                    // Folder removed or drive gone - try to open it again later
+                    close(root, false);
+                    roots.erase(roots.begin() + (res - WAIT_OBJECT_0 - 1));
+                }
+            }
+
+            if (!batch.empty() && GetTickCount64() - batchStart >= WATCH_BATCH_DELAY) {
+                EnterCriticalSection(&lock);
+                bool notify = pending.empty();
+                pending.insert(batch.begin(), batch.end());
+                LeaveCriticalSection(&lock);
+                batch.clear();
+                // One message is enough until the main thread takes the changes
+                if (notify) {
+                    PostMessage(window, MY_MSG_FOLDER_CHANGED, 0, 0);
+                }
+            }
+        }
+
+        for (WatchedRoot* root : roots) {
+            close(root, true);
+        }
+    }
+};
+
+// Global:
+FolderWatcher folderWatcher;
+
+
+// Start watching the folder with images (or change watched folders), or stop watching
+void manageFolderWatcher(HWND window, bool start)
+{
+    if (!start) {
+        folderWatcher.stop();
+        return;
+    }
+    map<wstring, int> sources;
+    getConfiguredSources(*SETTINGS, sources);
+    vector<wstring> roots;
+    for (auto const& source : sources) {
+        roots.push_back(source.first);
+    }
+    folderWatcher.start(window);
+    folderWatcher.setRoots(roots);
+}
+
+#pragma endregion
+
+
+
+#pragma region "FAST DIRECTORY LISTING"
+
+// Single file found in a directory. Name is not stored here but in the names
+// arena of the listing - no memory allocation per file.
+typedef struct {
+    size_t      nameOffset;     // index of the first character of the name in the arena
+    ULONGLONG   size;           // file size in bytes
+    ULONGLONG   mtime;          // last write time (FILETIME as a 64 bit number)
+} DirEntry;
+
+
+// Listing of files in a single directory. For huge directories FindFirstFile/FindNextFile
+// with default settings is slow - short names are generated and entries are fetched in small
+// chunks. Here basic info level and large fetch are used, so the file system returns big
+// batches of entries and size + modification time come for free with them.
+class DirListing
+{
+public:
+    // List files matching pattern (like L"*.jpg") in the directory, subdirectories are skipped.
+    // Returns false if the directory cannot be read.
+    bool read(const wchar_t* dir, const wchar_t* pattern) {
+        entries.clear();
+        names.clear();
+
+        wstring searchTemplate(dir);
+        searchTemplate += L"\\";
+        searchTemplate += pattern;
+
+        WIN32_FIND_DATA ffd;
+        HANDLE hFind = FindFirstFileEx(searchTemplate.c_str(), FindExInfoBasic, &ffd,
+            FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+        if (hFind == INVALID_HANDLE_VALUE) {
+            // No files in this directory or no access
+            return GetLastError() == ERROR_FILE_NOT_FOUND;
+        }
+
+        do {
+            if (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+                continue;
+            }
+            DirEntry entry;
+            entry.nameOffset = names.size();
+            entry.size = ((ULONGLONG)ffd.nFileSizeHigh << 32) | ffd.nFileSizeLow;
+            entry.mtime = ((ULONGLONG)ffd.ftLastWriteTime.dwHighDateTime << 32) | ffd.ftLastWriteTime.dwLowDateTime;
+            names.insert(names.end(), ffd.cFileName, ffd.cFileName + wcslen(ffd.cFileName) + 1);
+            entries.push_back(entry);
+        } while (FindNextFile(hFind, &ffd) != 0);
+
+        FindClose(hFind);
+        return true;
+    }
+
+    size_t count() const {
+        return entries.size();
+    }
+
+    const DirEntry& operator[](size_t i) const {
+        return entries[i];
+    }
+
+    const wchar_t* name(const DirEntry& entry) const {
+        return names.data() + entry.nameOffset;
+    }
+
+private:
+    vector<DirEntry>    entries;
+    // All the names, zero terminated, one after another
+    vector<wchar_t>     names;
+};
+
+#pragma endregion
+
+
+
+#pragma region "STREAMING IMAGE DECODING"
+
+// Some images are huge (panoramas, scans - hundreds of megapixels). GDI+ decodes the whole
+// image into memory before it can be drawn, which takes gigabytes. Windows Imaging Component
+// can read just the header, and can decode and scale the image a strip at a time -
+// memory needed depends on the size of the result, not on the size of the source.
+#define DECODE_STRIP_ROWS               64
+
+class ImageDecoder
+{
+public:
+    ImageDecoder() : wic(nullptr) {
+        // Initialization fails if the thread uses other mode already - COM is usable then anyway
+        comInitialized = SUCCEEDED(CoInitializeEx(nullptr, COINIT_MULTITHREADED));
+        HRESULT hr = CoCreateInstance(CLSID_WICImagingFactory, nullptr, CLSCTX_INPROC_SERVER, IID_IWICImagingFactory, reinterpret_cast<LPVOID *>(&wic));
+        if (FAILED(hr)) {
+            wic = nullptr;
+        }
+    }
+
+    ~ImageDecoder() {
+        if (wic != nullptr) {
+            wic->Release();
+        }
+        if (comInitialized) {
+            CoUninitialize();
+        }
+    }
+
+    bool isValid() {
+        return wic != nullptr;
+    }
+
+    // Dimensions of the image - only the header of the file is read
+    bool getSize(const wchar_t* file, UINT& width, UINT& height) {
+        IWICBitmapFrameDecode* frame = openFrame(file);
+        if (frame == nullptr) {
+            return false;
+        }
+        bool ok = SUCCEEDED(frame->GetSize(&width, &height)) && width > 0 && height > 0;
+        frame->Release();
+        return ok;
+    }
+
+    // The image reduced to what is needed to draw it in the area in given mode:
+    // scaled down (never up) keeping the aspect ratio, in centre mode just the middle part.
+    // Drawing the result with drawImageInArea() gives the same picture as drawing the original.
+    Bitmap* loadForArea(const wchar_t* file, int areaWidth, int areaHeight, DESKTOP_WALLPAPER_POSITION mode) {
+        IWICBitmapFrameDecode* frame = openFrame(file);
+        if (frame == nullptr) {
+            return nullptr;
+        }
+        Bitmap* bmp = nullptr;
+        UINT width, height;
+        if (SUCCEEDED(frame->GetSize(&width, &height)) && width > 0 && height > 0) {
+            double scaleX = (double)areaWidth / width;
+            double scaleY = (double)areaHeight / height;
+            double scale = 1;
+            switch (mode) {
+            case DWPOS_FIT:
+                scale = min(scaleX, scaleY);
+                break;
+            case DWPOS_FILL:
+            case DWPOS_STRETCH:
+                scale = max(scaleX, scaleY);
+                break;
+            default:
+                break;
+            }
+
+            if (scale >= 1 && (mode == DWPOS_FIT || mode == DWPOS_FILL || mode == DWPOS_STRETCH)) {
+                bmp = decode(frame, width, height);
+            }
+            else if (scale < 1) {
+                bmp = decode(frame, max(1, (int)(width * scale + 0.5)), max(1, (int)(height * scale + 0.5)));
+            }
+            else {
+                // Not scaled - only the middle of the image is visible
+                WICRect middle = { 0, 0, (INT)width, (INT)height };
+                if (middle.Width > areaWidth) {
+                    middle.X = (middle.Width - areaWidth) / 2;
+                    middle.Width = areaWidth;
+                }
+                if (middle.Height > areaHeight) {
+                    middle.Y = (middle.Height - areaHeight) / 2;
+                    middle.Height = areaHeight;
+                }
+                IWICBitmapClipper* clipper = nullptr;
+                if (SUCCEEDED(wic->CreateBitmapClipper(&clipper))) {
+                    if (SUCCEEDED(clipper->Initialize(frame, &middle))) {
+                        bmp = decode(clipper, middle.Width, middle.Height);
+                    }
+                    clipper->Release();
+                }
+            }
+        }
+        frame->Release();
+        return bmp;
+    }
+
+private:
+    IWICImagingFactory*     wic;
+    bool                    comInitialized;
+
+    IWICBitmapFrameDecode* openFrame(const wchar_t* file) {
+        if (wic == nullptr) {
+            return nullptr;
+        }
+        // Decoding on demand - nothing is decoded until pixels are requested
+        IWICBitmapDecoder* decoder = nullptr;
+        if (FAILED(wic->CreateDecoderFromFilename(file, nullptr, GENERIC_READ, WICDecodeMetadataCacheOnDemand, &decoder))) {
+            return nullptr;
+        }
+        IWICBitmapFrameDecode* frame = nullptr;
+        if (FAILED(decoder->GetFrame(0, &frame))) {
+            frame = nullptr;
+        }
+        decoder->Release();
+        return frame;
+    }
+
+    // Scale the source to given size and convert it to a GDI+ bitmap. Pixels are pulled
+    // through the scaler strip by strip, the scaler pulls only rows it needs from the decoder.
+    Bitmap* decode(IWICBitmapSource* source, UINT width, UINT height) {
+        IWICBitmapScaler* scaler = nullptr;
+        IWICFormatConverter* converter = nullptr;
+        Bitmap* bmp = nullptr;
+        if (SUCCEEDED(wic->CreateBitmapScaler(&scaler))
+                && SUCCEEDED(scaler->Initialize(source, width, height, WICBitmapInterpolationModeFant))
+                && SUCCEEDED(wic->CreateFormatConverter(&converter))
+                && SUCCEEDED(converter->Initialize(scaler, GUID_WICPixelFormat32bppBGR, WICBitmapDitherTypeNone, nullptr, 0, WICBitmapPaletteTypeCustom))) {
+            bmp = new Bitmap(width, height, PixelFormat32bppRGB);
+            BitmapData bits;
+            Rect all(0, 0, width, height);
+            bool ok = false;
+            if (bmp->GetLastStatus() == Ok && bmp->LockBits(&all, ImageLockModeWrite, PixelFormat32bppRGB, &bits) == Ok) {
+                ok = true;
+                for (UINT y = 0; ok && y < height; y += DECODE_STRIP_ROWS) {
+                    WICRect strip = { 0, (INT)y, (INT)width, (INT)min(height - y, (UINT)DECODE_STRIP_ROWS) };
+                    ok = SUCCEEDED(converter->CopyPixels(&strip, bits.Stride, bits.Stride * strip.Height, (BYTE*)bits.Scan0 + y * bits.Stride));
+                }
+                bmp->UnlockBits(&bits);
+            }
+            if (!ok) {
+                delete bmp;
+                bmp = nullptr;
+            }
+        }
+        if (converter != nullptr) {
+            converter->Release();
+        }
+        if (scaler != nullptr) {
+            scaler->Release();
+        }
+        return bmp;
+    }
+};
+
+#pragma endregion
+
+
+
+#pragma region "IMAGE ANALYSIS"
+
+// Some decisions need to know what is in the picture - small copies of the images are analysed
+// (see wallcore.h), here they are made with GDI+.
+bool makeSmallImage(Image* img, SmallImage& small)
+{
+    UINT w = img->GetWidth();
+    UINT h = img->GetHeight();
+    if (w == 0 || h == 0) {
+        return false;
+    }
+    small.width = (w >= h) ? ANALYSIS_SIZE : (int)(ANALYSIS_SIZE * w / h);
+    small.height = (h >= w) ? ANALYSIS_SIZE : (int)(ANALYSIS_SIZE * h / w);
+    if (small.width < 3) small.width = 3;
+    if (small.height < 3) small.height = 3;
+
+    Bitmap bmp(small.width, small.height, PixelFormat32bppRGB);
+    {
+        Graphics g(&bmp);
+        g.SetInterpolationMode(InterpolationModeHighQualityBilinear);
+        if (g.DrawImage(img, 0, 0, small.width, small.height) != Ok) {
+            return false;
+        }
+    }
+
+    BitmapData bits;
+    Rect all(0, 0, small.width, small.height);
+    if (bmp.LockBits(&all, ImageLockModeRead, PixelFormat32bppRGB, &bits) != Ok) {
+        return false;
+    }
+    setSmallImagePixels(small, (const BYTE*)bits.Scan0, bits.Stride);
+    bmp.UnlockBits(&bits);
+    return true;
+}
+
+
+// Find out everything needed about the image: focus point and features
+bool analyseImage(Image* img, USHORT& focusX, USHORT& focusY, BYTE features[FEATURE_COUNT])
+{
+    SmallImage small;
+    if (!makeSmallImage(img, small) || !findFocus(small, focusX, focusY)) {
+        return false;
+    }
+    computeFeatures(small, features);
+    return true;
+}
+
+#pragma endregion
+
+
+
+#pragma region "WALLPAPER IMAGES HANDLING"
+
+// Global:
+// List of known images and their dimensions
+map<wstring, ImageInfo> file2dimensions;
+// Changed every time the list above changes - anything computed from it can tell if it is outdated
+ULONGLONG catalogGeneration = 0;
+// Images downloaded from the feed - they are in the list above too, but not in the folder
+map<wstring, ImageInfo> feedImages;
+// The list of images was dropped from memory (idle) - it is in the caches, read it back before use
+bool catalogTrimmed = false;
+
+
+
+// Full path of application's file in user's local AppData folder, like "...\Wallpaper Changer.cache"
+wstring getAppDataPath(const wchar_t* extension)
+{
+    PWSTR appDataDir;
+    SHGetKnownFolderPath(FOLDERID_LocalAppData, 0, NULL, &appDataDir);
+    wstring path(appDataDir);
+    CoTaskMemFree(appDataDir);
+    path += L"\\";
+    path += APP_NAME;
+    path += extension;
+    return path;
+}
+
+
+
+// Images found during the previous run are stored in a cache file, so wallpapers can be set
+// right after start, without waiting for the whole directory to be read again.
+// File layout: header, scanned folder name, records, zero terminated paths one after another.
+// The same format is used for the catalog published for all users of the machine. Other sessions read
+// it instead of the folder, but each of them still makes its own copy of the list in memory.
+#define IMAGE_CACHE_MAGIC               0x35434357      // "WCC5"
+
+typedef struct {
+    DWORD       magic;
+    DWORD       count;          // number of records
+    DWORD       namesLength;    // length of all paths (in characters, including zeros)
+    DWORD       folderLength;   // length of the folder name (in characters, no zero)
+    ULONGLONG   generation;     // incremented every time the shared catalog is published
+    ULONGLONG   folderTime;     // last write time of the folder when it was read
+} ImageCacheHeader;
+
+typedef struct {
+    ImageInfo   info;
+    UINT        nameOffset;     // index of the path in the names block
+    UINT        reserved;
+} ImageCacheRecord;
+
+
+// Last write time of the folder - changes when files are added, removed or renamed
+ULONGLONG getFolderTime(const wstring& folder)
+{
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesEx(folder.c_str(), GetFileExInfoStandard, &data)) {
+        return 0;
+    }
+    return ((ULONGLONG)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+}
+
+
+bool writeImageCache(const wstring& file, const wstring& folder, ULONGLONG generation, ULONGLONG folderTime,
+    const map<wstring, ImageInfo>& images)
+{
+    vector<ImageCacheRecord> records;
+    records.reserve(images.size());
+    wstring names;
+    for (auto const& f2d : images) {
+        ImageCacheRecord record = { f2d.second, (UINT)names.length(), 0 };
+        records.push_back(record);
+        names += f2d.first;
+        names.push_back(L'\0');
+    }
+
+    ImageCacheHeader header = { IMAGE_CACHE_MAGIC, (DWORD)records.size(), (DWORD)names.length(), (DWORD)folder.length(),
+        generation, folderTime };
+
+    // Write to a temporary file first - cache is never seen half written, readers
+    // that have the old one mapped keep using it
+    wstring temp = file + L".tmp";
+    ofstream f(temp, ofstream::binary | ofstream::trunc);
+    f.write((const char*)&header, sizeof(header));
+    f.write((const char*)folder.data(), folder.length() * sizeof(wchar_t));
+    f.write((const char*)records.data(), records.size() * sizeof(ImageCacheRecord));
+    f.write((const char*)names.data(), names.length() * sizeof(wchar_t));
+    bool ok = f.good();
+    f.close();
+
+    if (!ok || !MoveFileEx(temp.c_str(), file.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+        DeleteFile(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+// Read the list of images from the cache file - only if it was created for the given folder.
+// With 'append' the images are added to those in the map (straight from the mapped file, no copy).
+bool readImageCache(const wstring& file, const wstring& folder, ImageCacheHeader& header, map<wstring, ImageInfo>& images,
+    bool append = false)
+{
+    HANDLE hFile = CreateFile(file.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER size;
+    HANDLE mapping = NULL;
+    if (GetFileSizeEx(hFile, &size) && size.QuadPart >= (LONGLONG)sizeof(ImageCacheHeader)) {
+        mapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    }
+    CloseHandle(hFile);
+    if (mapping == NULL) {
+        return false;
+    }
+    const BYTE* view = (const BYTE*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (view == nullptr) {
+        return false;
+    }
+
+    bool ok = false;
+    header = *(const ImageCacheHeader*)view;
+    ULONGLONG expectedSize = sizeof(ImageCacheHeader) + (ULONGLONG)header.folderLength * sizeof(wchar_t)
+        + (ULONGLONG)header.count * sizeof(ImageCacheRecord) + (ULONGLONG)header.namesLength * sizeof(wchar_t);
+    if (header.magic == IMAGE_CACHE_MAGIC && expectedSize == (ULONGLONG)size.QuadPart) {
+        const wchar_t* cachedFolder = (const wchar_t*)(view + sizeof(ImageCacheHeader));
+        const ImageCacheRecord* records = (const ImageCacheRecord*)(cachedFolder + header.folderLength);
+        const wchar_t* names = (const wchar_t*)(records + header.count);
+
+        if (folder.compare(0, wstring::npos, cachedFolder, header.folderLength) == 0) {
+            if (!append) {
+                images.clear();
+            }
+            // Records are sorted - all of them go just before what follows the folder, so each insert is quick
+            auto next = append ? images.lower_bound(folder + L"\\") : images.end();
+            for (DWORD i = 0; i < header.count; i++) {
+                if (records[i].nameOffset < header.namesLength) {
+                    images.insert(next, std::make_pair(wstring(names + records[i].nameOffset), records[i].info));
+                }
+            }
+            ok = true;
+        }
+    }
+
+    UnmapViewOfFile(view);
+    return ok;
+}
+
+
+// Name made of folder's name - so files of different folders don't mix
+wstring getFolderKey(const wstring& folder)
+{
+    wchar_t name[32];
+    swprintf_s(name, L"%016llx", hashPath(folder));
+    return name;
+}
+
+
+
+// Images come from several folders (sources), each of them is a shard of the catalog
+// (see wallcore.h) - read, cached and replaced on its own.
+
+// Call the function for every image of the shard
+template<typename F> void forEachInShard(const wstring& folder, F f)
+{
+    forEachInShard(file2dimensions, folder, f);
+}
+
+
+void getShard(const wstring& folder, map<wstring, ImageInfo>& images)
+{
+    images.clear();
+    forEachInShard(folder, [&](map<wstring, ImageInfo>::iterator it) { images.insert(images.end(), *it); });
+}
+
+
+// Record a new, changed (info given) or removed image
+void traceImage(const wstring& path, const ImageInfo* info)
+{
+    TraceRecord record(info != nullptr ? TraceImageAdded : TraceImageRemoved);
+    record.put(path);
+    if (info != nullptr) {
+        record.put(info, sizeof(ImageInfo));
+    }
+    traceRecorder.write(record);
+}
+
+
+// Record differences between the old and the new images of a shard
+void traceShard(const wstring& folder, const map<wstring, ImageInfo>& images)
+{
+    map<wstring, ImageInfo> old;
+    getShard(folder, old);
+    for (auto const& f2d : old) {
+        if (images.find(f2d.first) == images.end()) {
+            traceImage(f2d.first, nullptr);
+        }
+    }
+    for (auto const& f2d : images) {
+        auto known = old.find(f2d.first);
+        if (known == old.end() || memcmp(&known->second, &f2d.second, sizeof(ImageInfo)) != 0) {
+            traceImage(f2d.first, &f2d.second);
+        }
+    }
+}
+
+
+void detachShard(const wstring& folder)
+{
+    if (traceRecorder.isOpen()) {
+        traceShard(folder, map<wstring, ImageInfo>());
+    }
+    forEachInShard(folder, [&](map<wstring, ImageInfo>::iterator it) { file2dimensions.erase(it); });
+    catalogGeneration++;
+}
+
+
+void replaceShard(const wstring& folder, const map<wstring, ImageInfo>& images)
+{
+    if (traceRecorder.isOpen()) {
+        traceShard(folder, images);
+    }
+    forEachInShard(folder, [&](map<wstring, ImageInfo>::iterator it) { file2dimensions.erase(it); });
+    file2dimensions.insert(images.begin(), images.end());
+    catalogGeneration++;
+    updateThumbnails();
+}
+
+
+// Every source has its own cache file
+wstring getImageCachePath(const wstring& folder)
+{
+    wstring extension = L"." + getFolderKey(folder) + L".cache";
+    return getAppDataPath(extension.c_str());
+}
+
+
+void saveImageCache(const wstring& folder)
+{
+    if (catalogTrimmed) {
+        // The cache is what's known - there is nothing else in memory
+        return;
+    }
+    map<wstring, ImageInfo> images;
+    getShard(folder, images);
+    if (!writeImageCache(getImageCachePath(folder), folder, 0, 0, images)) {
+        LOG << L"Saving image cache failed";
+    }
+}
+
+
+bool loadImageCache(const wstring& folder)
+{
+    ImageCacheHeader header;
+    map<wstring, ImageInfo> images;
+    if (!readImageCache(getImageCachePath(folder), folder, header, images)) {
+        return false;
+    }
+    replaceShard(folder, images);
+    return true;
+}
+
+
+
+// Catalog published for all users of the machine (terminal server): one session reads
+// the folder and writes the catalog file, the others just read it. What is shared is the work
+// of reading the folder - memory is not, every session copies the list to its own catalog.
+// Only one session at a time reads the folder - it is guarded by a global mutex.
+#define SHARED_CATALOG_RETRY_DELAY      10000
+
+// Global (used by main thread only):
+// Sources waiting for another session to publish their catalogs, and 'change' for their scans
+map<wstring, bool> sharedCatalogRetries;
+
+
+// Shared catalog file for the folder, empty if sharing is not configured
+wstring getSharedCatalogPath(const wstring& folder)
+{
+    const wstring& sharedDir = SETTINGS->SharedCatalogDirectory;
+    if (sharedDir.empty()) {
+        return wstring();
+    }
+    return sharedDir + L"\\" + getFolderKey(folder) + L".catalog";
+}
+
+
+// Use the catalog published by another session, if it is up to date and has everything the options
+// need. If it can't be used its images are left in 'images' - a scan doesn't have to read them again.
+bool loadSharedCatalog(const wstring& folder, map<wstring, ImageInfo>& images)
+{
+    wstring file = getSharedCatalogPath(folder);
+    ImageCacheHeader header;
+    if (file.empty() || !readImageCache(file, folder, header, images)) {
+        return false;
+    }
+    if (header.folderTime != getFolderTime(folder)) {
+        // Files were added or removed since it was published
+        return false;
+    }
+    // Files changed in place don't change the folder's time - every one is checked like a scan does it
+    // (files that are not images are not in the catalog, new ones would have changed the folder's time)
+    DirListing listing;
+    if (!listing.read(folder.c_str(), L"*.jpg")) {
+        return false;
+    }
+    size_t listed = 0;
+    wstring filePath(folder);
+    filePath += L"\\";
+    size_t dirLength = filePath.length();
+    for (size_t i = 0; i < listing.count(); i++) {
+        const DirEntry& entry = listing[i];
+        filePath.resize(dirLength);
+        filePath += listing.name(entry);
+        auto known = images.find(filePath);
+        if (known == images.end()) {
+            continue;
+        }
+        if (known->second.size != entry.size || known->second.mtime != entry.mtime) {
+            LOG << L"Shared catalog out of date - not used";
+            return false;
+        }
+        listed++;
+    }
+    if (listed != images.size()) {
+        // Some images were removed
+        return false;
+    }
+    // The publisher may not have analysed the images (its options did not need it)
+    bool analyse = imageAnalysisNeeded(*SETTINGS);
+    for (auto const& f2d : images) {
+        if (!isImageInfoComplete(f2d.second, analyse)) {
+            LOG << L"Shared catalog without image analysis - not used";
+            return false;
+        }
+    }
+    replaceShard(folder, images);
+    LOG << L"Using shared catalog, generation:" << (int)header.generation;
+    return true;
+}
+
+
+// Become the session that reads the folder. False if another one is doing it right now.
+// The mutex may be created by another user - everyone can wait for it and release it
+// (default security would let only its creator open it).
+bool lockSharedCatalog(const wstring& folder, HANDLE& lock)
+{
+    wstring name(L"Global\\");
+    name += APP_NAME;
+    name += L" ";
+    name += getFolderKey(folder);
+
+    SECURITY_ATTRIBUTES security = { sizeof(SECURITY_ATTRIBUTES), NULL, FALSE };
+    // Authenticated users: SYNCHRONIZE | MUTEX_MODIFY_STATE
+    if (!ConvertStringSecurityDescriptorToSecurityDescriptor(L"D:(A;;0x00100001;;;AU)", SDDL_REVISION_1,
+            &security.lpSecurityDescriptor, NULL)) {
+        security.lpSecurityDescriptor = NULL;
+    }
+    lock = CreateMutexEx(&security, name.c_str(), 0, SYNCHRONIZE | MUTEX_MODIFY_STATE);
+    if (security.lpSecurityDescriptor != NULL) {
+        LocalFree(security.lpSecurityDescriptor);
+    }
+    if (lock == NULL) {
+        LOG << L"Creating shared catalog mutex failed, error:" << (int)GetLastError();
+        // Can't coordinate with others - just read the folder
+        return true;
+    }
+    DWORD res = WaitForSingleObject(lock, 0);
+    if (res == WAIT_OBJECT_0 || res == WAIT_ABANDONED) {
+        return true;
+    }
+    CloseHandle(lock);
+    lock = NULL;
+    return false;
+}
+
+
+void unlockSharedCatalog(HANDLE& lock)
+{
+    if (lock != NULL) {
+        ReleaseMutex(lock);
+        CloseHandle(lock);
+        lock = NULL;
+    }
+}
+
+
+// Make the list of images available to other sessions
+void publishSharedCatalog(const wstring& folder, ULONGLONG folderTime, const map<wstring, ImageInfo>& images)
+{
+    wstring file = getSharedCatalogPath(folder);
+    if (file.empty()) {
+        return;
+    }
+    ImageCacheHeader previous;
+    ULONGLONG generation = 1;
+    map<wstring, ImageInfo> previousImages;
+    if (readImageCache(file, folder, previous, previousImages)) {
+        generation = previous.generation + 1;
+    }
+    if (!writeImageCache(file, folder, generation, folderTime, images)) {
+        LOG << L"Publishing shared catalog failed";
+    }
+}
+
+
+
+// Features of all analysed images in columns (see wallcore.h). Rebuilt when the list of images changes.
+class CatalogFeatureTable : public FeatureTable
+{
+public:
+    CatalogFeatureTable() : generation((ULONGLONG)-1) {}
+
+    void update() {
+        if (generation == catalogGeneration) {
+            return;
+        }
+        generation = catalogGeneration;
+        clear();
+        for (auto const& f2d : file2dimensions) {
+            if (f2d.second.flags & IMAGE_HAS_FEATURES) {
+                add(f2d.first.c_str(), f2d.second.features);
+            }
+        }
+    }
+
+private:
+    ULONGLONG       generation;
+};
+
+// Global:
+CatalogFeatureTable featureTable;
+
+
+
+// Images by their shape, for the nearest fit (see wallcore.h). Rebuilt when the list of images changes.
+class CatalogShapeIndex : public ShapeIndex
+{
+public:
+    CatalogShapeIndex() : generation((ULONGLONG)-1) {}
+
+    void update() {
+        if (generation == catalogGeneration) {
+            return;
+        }
+        generation = catalogGeneration;
+        clear();
+        size_t index = 0;
+        for (auto const& f2d : file2dimensions) {
+            add(f2d.second.width, f2d.second.height, index++, f2d.first.c_str());
+        }
+        prepare();
+    }
+
+private:
+    ULONGLONG       generation;
+};
+
+// Global:
+CatalogShapeIndex shapeIndex;
+
+
+
+// Images are read in a background thread - folder with thousands of images
+// takes long time to scan, and the program must stay responsive meanwhile.
+// Newly found images are sent to the main window in batches, so they can be
+// used before the whole folder is read.
+// Reading can be limited (files and bytes per second, number of threads) not to make
+// the machine sluggish - it is not a problem if the scan takes a bit longer.
+#define SCAN_BATCH_SIZE                 256
+#define SCAN_BATCH_INTERVAL             1000
+// How often the list of images is saved while the scan is in progress - if the program
+// is terminated, the next scan does not have to read again files already read
+#define SCAN_CHECKPOINT_INTERVAL        30000
+
+typedef struct {
+    HWND                    window;         // who gets the results - NULL if the scan is run directly (batch mode)
+    wstring                 folder;
+    bool                    change;         // passed to setWallpapers() when the scan is done
+    volatile LONG           cancel;
+    map<wstring, ImageInfo> known;          // images from the previous scan
+    map<wstring, ImageInfo> found;          // result of the scan
+    HANDLE                  thread;
+    ULONGLONG               folderTime;     // when the folder was changed, as seen before the scan
+    bool                    listed;         // false if the folder could not be read (like unplugged drive)
+    HANDLE                  catalogLock;    // held while the folder is read for the shared catalog
+
+    // Budget - files actually opened (not known from previous scan) are counted, see wallcore.h
+    ScanBudget              budget;
+    int                     threads;
+
+    // What to find out about the images - focus points and features (for smart crop and selection rules)
+    bool                    analyse;
+
+    // Work shared by the threads: every file has its slot in 'probed', taken by exactly one thread
+    DirListing              listing;
+    vector<ImageInfo>       probed;         // width == 0 - file was not read (or it is not an image)
+    volatile LONG           next;           // next file to take
+
+    // Progress - may be read by the main thread any time
+    volatile LONG           total;
+    volatile LONG           processed;
+    ULONGLONG               startTime;
+} ScanJob;
+
+// Globals (used by main thread only):
+// Sources of images - folders and their weights
+map<wstring, int>           imageSources;
+// Scans in progress (one per source), and requests for another ones - with their 'change' parameter
+map<wstring, ScanJob*>      runningScans;
+map<wstring, bool>          scanRequests;
+DWORD                       lastScanCheckpoint = 0;
+
+
+// Wait if the scan goes faster than the budget allows (see wallcore.h) - called before a file is read
+void throttleScan(ScanJob* job, ULONGLONG fileSize)
+{
+    ULONGLONG wait = job->budget.take(fileSize, GetTickCount64() - job->startTime);
+    if (wait > 0) {
+        Sleep((DWORD)wait);
+    }
+}
+
+
+// Read files from the job's listing until all are taken - run by every scanning thread
+void probeImages(ScanJob* job)
+{
+    // One buffer for all the paths - directory part stays, only name is replaced
+    wstring filePath(job->folder);
+    filePath += L"\\";
+    size_t dirLength = filePath.length();
+
+    map<wstring, ImageInfo>* batch = new map<wstring, ImageInfo>();
+    DWORD lastBatchTime = GetTickCount();
+    ImageDecoder decoder;
+
+    while (!job->cancel)
+    {
+        LONG i = InterlockedIncrement(&job->next) - 1;
+        if (i >= job->total) {
+            break;
+        }
+
+        const DirEntry& entry = job->listing[i];
+        filePath.resize(dirLength);
+        filePath += job->listing.name(entry);
+
+        // If size and modification time did not change there is no need to open the file again
+        auto old = job->known.find(filePath);
+        if (old != job->known.end() && old->second.size == entry.size && old->second.mtime == entry.mtime
+                && isImageInfoComplete(old->second, job->analyse)) {
+            job->probed[i] = old->second;
+            InterlockedIncrement(&job->processed);
+            continue;
+        }
+
+        throttleScan(job, entry.size);
+
+        // Size is in the header - the image is decoded only when it is to be analysed,
+        // and then only to a small copy
+        UINT width, height;
+        bool ok = decoder.getSize(filePath.c_str(), width, height);
+        InterlockedIncrement(&job->processed);
+        metricFilesProbed.add();
+        if (!ok) {
+            metricProbeFailures.add();
+            continue;
+        }
+        ImageInfo info = { 0 };
+        info.width = width;
+        info.height = height;
+        info.size = entry.size;
+        info.mtime = entry.mtime;
+        info.focusX = info.focusY = FOCUS_MAX / 2;
+        if (job->analyse) {
+            Bitmap* small = decoder.loadForArea(filePath.c_str(), 2 * ANALYSIS_SIZE, 2 * ANALYSIS_SIZE, DWPOS_FIT);
+            if (small != nullptr && analyseImage(small, info.focusX, info.focusY, info.features)) {
+                info.flags |= IMAGE_ANALYSED;
+            }
+            else {
+                info.flags |= IMAGE_NOT_ANALYSABLE;
+            }
+            delete small;
+        }
+        job->probed[i] = info;
+        batch->insert(std::make_pair(filePath, info));
+
+        if (batch->size() >= SCAN_BATCH_SIZE || GetTickCount() - lastBatchTime > SCAN_BATCH_INTERVAL) {
+            if (job->window == NULL || !PostMessage(job->window, MY_MSG_SCAN_BATCH, 0, (LPARAM)batch)) {
+                delete batch;
+            }
+            batch = new map<wstring, ImageInfo>();
+            lastBatchTime = GetTickCount();
+        }
+    }
+
+    if (batch->empty() || job->window == NULL || !PostMessage(job->window, MY_MSG_SCAN_BATCH, 0, (LPARAM)batch)) {
+        delete batch;
+    }
+}
+
+
+// Additional scanning threads (if more than one is configured)
+unsigned long WINAPI scanWorkerThreadProc(void* data)
+{
+    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+    probeImages((ScanJob*)data);
+    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_END);
+    return 0;
+}
+
+
+unsigned long WINAPI scanThreadProc(void* data)
+{
+    ScanJob* job = (ScanJob*)data;
+
+    // Don't compete with the user and programs starting at logon for disk and CPU
+    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+
+    job->listed = job->listing.read(job->folder.c_str(), L"*.jpg");
+    if (job->listed) {
+        ImageInfo notRead = { 0 };
+        job->probed.assign(job->listing.count(), notRead);
+        job->total = (LONG)job->listing.count();
+        job->startTime = GetTickCount64();
+
+        // For reading image properties GDI library will be used - it must by initialized first
+        GdiplusStartupInput gdiplusStartupInput;
+        ULONG_PTR gdiplusToken;
+        GdiplusStartup(&gdiplusToken, &gdiplusStartupInput, NULL);
+
+        vector<HANDLE> workers;
+        for (int t = 1; t < job->threads; t++) {
+            unsigned long threadId;
+            HANDLE worker = CreateThread(NULL, 0, scanWorkerThreadProc, job, 0, &threadId);
+            if (worker != NULL) {
+                workers.push_back(worker);
+            }
+        }
+
+        probeImages(job);
+
+        for (HANDLE worker : workers) {
+            WaitForSingleObject(worker, INFINITE);
+            CloseHandle(worker);
+        }
+
+        // De-initialize GDI
+        GdiplusShutdown(gdiplusToken);
+
+        // Collect results - in the order of the listing
+        wstring filePath(job->folder);
+        filePath += L"\\";
+        size_t dirLength = filePath.length();
+        for (size_t i = 0; i < job->probed.size(); i++) {
+            if (job->probed[i].width != 0) {
+                filePath.resize(dirLength);
+                filePath += job->listing.name(job->listing[i]);
+                job->found.insert(std::make_pair(filePath, job->probed[i]));
+            }
+        }
+    }
+
+    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_END);
+
+    if (job->window != NULL) {
+        PostMessage(job->window, MY_MSG_SCAN_DONE, 0, (LPARAM)job);
+    }
+    return 0;
+}
+
+
+// Do any of the enabled options need to know what is in the images
+// Only weights changed - the folders stay the same, no need to read them again
+void updateSourceWeights(const WallSettings& settings)
+{
+    getConfiguredSources(settings, imageSources);
+}
+
+
+// Scan of the folder - with the budget and options as configured
+ScanJob* newScanJob(HWND window, const wstring& folder, bool change)
+{
+    ScanJob* job = new ScanJob();
+    job->window = window;
+    job->folder = folder;
+    job->folderTime = getFolderTime(folder);
+    job->listed = false;
+    job->catalogLock = NULL;
+    job->change = change;
+    job->cancel = 0;
+    job->budget.setLimits(SETTINGS->ScanMaxFilesPerSec, (ULONGLONG)SETTINGS->ScanMaxMBPerSec * 1024 * 1024);
+    job->threads = SETTINGS->ScanThreads;
+    job->analyse = imageAnalysisNeeded(*SETTINGS);
+    if (job->threads < 1 || job->threads > SCAN_MAX_THREADS) {
+        job->threads = 1;
+    }
+    job->next = 0;
+    job->total = 0;
+    job->processed = 0;
+    job->startTime = GetTickCount64();
+    return job;
+}
+
+
+// Start reading images in the folder. When done, the folder's images in the list of known
+// ones are replaced and wallpapers are set. 'change' is passed to setWallpapers().
+void readSource(HWND window, const wstring& folder, bool change)
+{
+    restoreCatalog();
+    auto running = runningScans.find(folder);
+    if (running != runningScans.end()) {
+        // Scan of possibly outdated folder in progress - stop it, new one will start when it finishes
+        InterlockedExchange(&running->second->cancel, 1);
+        scanRequests[folder] = scanRequests[folder] || change;
+        return;
+    }
+
+    HANDLE catalogLock = NULL;
+    map<wstring, ImageInfo> published;
+    if (!getSharedCatalogPath(folder).empty()) {
+        // Maybe another session has already done the job
+        if (loadSharedCatalog(folder, published)) {
+            // Own cache too - it is where the list is read back from when it was dropped (idle)
+            saveImageCache(folder);
+            setWallpapers(change);
+            return;
+        }
+        if (!lockSharedCatalog(folder, catalogLock)) {
+            // Another session is reading the folder right now - wait for what it publishes
+            sharedCatalogRetries[folder] = sharedCatalogRetries[folder] || change;
+            SetTimer(window, EVENT_SHARED_CATALOG_RETRY, SHARED_CATALOG_RETRY_DELAY, NULL);
+            return;
+        }
+    }
+
+    ScanJob* job = newScanJob(window, folder, change);
+    job->catalogLock = catalogLock;
+    getShard(folder, job->known);
+    // Files not changed since the shared catalog was published are not read again
+    job->known.insert(published.begin(), published.end());
+
+    unsigned long threadId;
+    job->thread = CreateThread(NULL, 0, scanThreadProc, job, 0, &threadId);
+    if (job->thread == NULL) {
+        LOG << L"Creating thread for reading images failed";
+        unlockSharedCatalog(job->catalogLock);
+        delete job;
+        return;
+    }
+    runningScans[folder] = job;
+    lastScanCheckpoint = GetTickCount();
+}
+
+
+// Read all the configured sources again - each one in its own thread. Sources no longer
+// configured are dropped. Only the main folder's scan gets 'change' - the wallpaper
+// should not change again when the others finish.
+void readWallpapers(HWND window, bool change)
+{
+    map<wstring, int> sources;
+    getConfiguredSources(*SETTINGS, sources);
+    for (auto const& source : imageSources) {
+        if (sources.find(source.first) == sources.end()) {
+            auto running = runningScans.find(source.first);
+            if (running != runningScans.end()) {
+                InterlockedExchange(&running->second->cancel, 1);
+            }
+            scanRequests.erase(source.first);
+            detachShard(source.first);
+        }
+    }
+    imageSources.swap(sources);
+
+    for (auto const& source : imageSources) {
+        readSource(window, source.first, change && source.first == normalizeSource(SETTINGS->ImageDirectory));
+    }
+}
+
+
+// Add images found by a scan to the list of known ones (and delete the batch)
+void mergeScanBatch(map<wstring, ImageInfo>* batch)
+{
+    for (auto const& f2d : *batch) {
+        // Source may have been removed in the meantime
+        if (imageSources.find(f2d.first.substr(0, f2d.first.find_last_of(L'\\'))) != imageSources.end()) {
+            file2dimensions[f2d.first] = f2d.second;
+            if (traceRecorder.isOpen()) {
+                traceImage(f2d.first, &f2d.second);
+            }
+        }
+    }
+    delete batch;
+    catalogGeneration++;
+}
+
+
+// Some new images were found by the scan in progress - maybe there is something
+// for monitors without a matching wallpaper
+void onScanBatch(HWND window, map<wstring, ImageInfo>* batch)
+{
+    mergeScanBatch(batch);
+    setWallpapers(false);
+
+    if (runningScans.empty()) {
+        return;
+    }
+
+    // Show the progress in the icon's tooltip
+    LONG processed = 0;
+    LONG total = 0;
+    bool throttled = false;
+    for (auto const& running : runningScans) {
+        processed += running.second->processed;
+        total += running.second->total;
+        throttled = throttled || running.second->budget.getWaited() > 0;
+    }
+    wchar_t tip[128];
+    swprintf_s(tip, L"Reading images: %d of %d%s", (int)processed, (int)total, throttled ? L" (slowed down)" : L"");
+    updateNotificationIcon(window, tip);
+
+    // Save what is known so far - if the scan is interrupted the next one can continue from here
+    if (GetTickCount() - lastScanCheckpoint > SCAN_CHECKPOINT_INTERVAL) {
+        for (auto const& running : runningScans) {
+            saveImageCache(running.first);
+        }
+        lastScanCheckpoint = GetTickCount();
+    }
+}
+
+
+void onScanDone(HWND window, ScanJob* job)
+{
+    WaitForSingleObject(job->thread, INFINITE);
+    CloseHandle(job->thread);
+    runningScans.erase(job->folder);
+
+    if (runningScans.empty()) {
+        updateNotificationIcon(window, L"Double-click to set desktop wallpaper");
+    }
+
+    bool wanted = imageSources.find(job->folder) != imageSources.end();
+    if (!job->cancel && wanted && !job->listed) {
+        // Unplugged drive or unreachable share - images known from before are kept
+        LOG << L"Folder with images not available:";
+        LOG << job->folder.c_str();
+    }
+    else if (!job->cancel && wanted) {
+        LOG << job->folder.c_str();
+        LOG << L"Images found:" << (int)job->found.size();
+        LOG << L"Files read:" << (int)job->budget.getFiles();
+        LOG << L"Scan time [ms]:" << (int)(GetTickCount64() - job->startTime);
+        LOG << L"Time waiting because of the budget [ms]:" << (int)job->budget.getWaited();
+        ULONGLONG scanTime = GetTickCount64() - job->startTime;
+        if (scanTime > 0) {
+            LOG << L"Files read per second:" << (int)(job->budget.getFiles() * 1000 / scanTime);
+        }
+        metricScanTime.record((LONGLONG)scanTime * 1000);
+        replaceShard(job->folder, job->found);
+        saveImageCache(job->folder);
+        publishSharedCatalog(job->folder, job->folderTime, job->found);
+        setWallpapers(job->change);
+    }
+    unlockSharedCatalog(job->catalogLock);
+    wstring folder = job->folder;
+    delete job;
+
+    auto request = scanRequests.find(folder);
+    if (request != scanRequests.end()) {
+        bool change = request->second;
+        scanRequests.erase(request);
+        readSource(window, folder, change);
+    }
+}
+
+
+// Stop scans in progress (if any) - when the program terminates
+void stopReadingWallpapers()
+{
+    for (auto const& running : runningScans) {
+        InterlockedExchange(&running.second->cancel, 1);
+    }
+    for (auto const& running : runningScans) {
+        // Cancelled scan ends after the file it is reading
+        WaitForSingleObject(running.second->thread, INFINITE);
+    }
+
+    // Batches posted before the threads ended were not handled - images read so far are not lost
+    MSG msg;
+    while (PeekMessage(&msg, NULL, MY_MSG_SCAN_BATCH, MY_MSG_SCAN_BATCH, PM_REMOVE)) {
+        mergeScanBatch((map<wstring, ImageInfo>*)msg.lParam);
+    }
+    // The jobs are deleted here
+    while (PeekMessage(&msg, NULL, MY_MSG_SCAN_DONE, MY_MSG_SCAN_DONE, PM_REMOVE)) {
+    }
+
+    for (auto const& running : runningScans) {
+        saveImageCache(running.first);
+        unlockSharedCatalog(running.second->catalogLock);
+        CloseHandle(running.second->thread);
+        delete running.second;
+    }
+    runningScans.clear();
+    scanRequests.clear();
+}
+
+
+// Files in watched folders were added, removed or changed
+void onFolderChanged(HWND window)
+{
+    set<wstring> changed;
+    folderWatcher.takeChanges(changed);
+    for (const wstring& folder : changed) {
+        if (imageSources.find(folder) != imageSources.end()) {
+            LOG << L"Change in observed folder";
+            readSource(window, folder, false);
+        }
+    }
+}
+
+
+#pragma endregion
+
+
+
+#pragma region "IMAGE FEED"
+
+// Images can also come from a feed: a text file on a web server listing URLs of images,
+// one per line (relative to the feed's location or absolute). A background thread polls it,
+// downloads new images to a local cache and reports them to the main thread - wallpapers
+// are always set from local files, nothing is downloaded when they change.
+#define FEED_MAX_CONNECTIONS            8
+#define FEED_TIMEOUT                    30000
+#define FEED_BUFFER_SIZE                65536
+
+typedef struct {
+    HWND                    window;
+    wstring                 url;
+    wstring                 cacheDir;
+    int                     connections;
+    ULONGLONG               maxCacheBytes;
+    DWORD                   pollInterval;
+    HANDLE                  stopEvent;
+    HANDLE                  thread;
+
+    // Current round of downloads, shared by download threads
+    HINTERNET               session;
+    vector<wstring>         queue;          // URLs of images not in the cache yet
+    volatile LONG           next;           // index in the queue of the next image to download
+    volatile LONG           downloaded;
+    volatile LONGLONG       bytes;
+
+    // Images shown now (hashes of paths) - not removed from the cache; set by the main thread
+    CRITICAL_SECTION        shownLock;
+    set<ULONGLONG>          shown;
+} FeedJob;
+
+// Images added to (or removed from) the feed cache, sent to the main thread
+typedef struct {
+    map<wstring, ImageInfo> added;
+    vector<wstring>         removed;
+} FeedUpdate;
+
+// Global (used by main thread only):
+FeedJob*        runningFeed = nullptr;
+set<ULONGLONG>  shownImages;            // given to the feed when it starts
+
+
+// Send GET request, optionally for the part of the resource starting at offset.
+// Returns the request handle ready for reading, status is the HTTP status code.
+HINTERNET openUrl(HINTERNET session, const wstring& url, ULONGLONG offset, DWORD& status)
+{
+    URL_COMPONENTS parts = { sizeof(URL_COMPONENTS) };
+    wchar_t host[256];
+    parts.lpszHostName = host;
+    parts.dwHostNameLength = _countof(host);
+    parts.dwUrlPathLength = (DWORD)-1;
+    parts.dwExtraInfoLength = (DWORD)-1;
+    if (!WinHttpCrackUrl(url.c_str(), 0, 0, &parts)) {
+        return NULL;
+    }
+
+    // Connection handle can be closed right away - the request keeps it alive
+    HINTERNET connection = WinHttpConnect(session, host, parts.nPort, 0);
+    if (connection == NULL) {
+        return NULL;
+    }
+    wstring path(parts.lpszUrlPath, parts.dwUrlPathLength + parts.dwExtraInfoLength);
+    HINTERNET request = WinHttpOpenRequest(connection, L"GET", path.c_str(), NULL, WINHTTP_NO_REFERER,
+        WINHTTP_DEFAULT_ACCEPT_TYPES, parts.nScheme == INTERNET_SCHEME_HTTPS ? WINHTTP_FLAG_SECURE : 0);
+    WinHttpCloseHandle(connection);
+    if (request == NULL) {
+        return NULL;
+    }
+
+    wchar_t range[64] = L"";
+    if (offset > 0) {
+        swprintf_s(range, L"Range: bytes=%llu-", offset);
+    }
+    DWORD statusSize = sizeof(status);
+    if (!WinHttpSendRequest(request, offset > 0 ? range : WINHTTP_NO_ADDITIONAL_HEADERS, offset > 0 ? (DWORD)-1L : 0,
+                WINHTTP_NO_REQUEST_DATA, 0, 0, 0)
+            || !WinHttpReceiveResponse(request, NULL)
+            || !WinHttpQueryHeaders(request, WINHTTP_QUERY_STATUS_CODE | WINHTTP_QUERY_FLAG_NUMBER, WINHTTP_HEADER_NAME_BY_INDEX,
+                &status, &statusSize, WINHTTP_NO_HEADER_INDEX)) {
+        WinHttpCloseHandle(request);
+        return NULL;
+    }
+    return request;
+}
+
+
+// Read the feed - list of image URLs
+bool readFeedIndex(FeedJob* feed, vector<wstring>& urls)
+{
+    DWORD status = 0;
+    HINTERNET request = openUrl(feed->session, feed->url, 0, status);
+    if (request == NULL) {
+        return false;
+    }
+    string text;
+    char buffer[4096];
+    DWORD read = 0;
+    while (status == 200 && WinHttpReadData(request, buffer, sizeof(buffer), &read) && read > 0) {
+        text.append(buffer, read);
+    }
+    WinHttpCloseHandle(request);
+    if (status != 200) {
+        return false;
+    }
+
+    // The index is UTF-8 (see wallcore.h)
+    wstring wideText;
+    if (!text.empty()) {
+        int length = MultiByteToWideChar(CP_UTF8, 0, text.data(), (int)text.length(), NULL, 0);
+        wideText.resize(length);
+        MultiByteToWideChar(CP_UTF8, 0, text.data(), (int)text.length(), &wideText[0], length);
+    }
+    parseFeedIndex(wideText, feed->url, urls);
+    return true;
+}
+
+
+// Name of the cached image - made of its URL (FNV-1a)
+wstring feedCachePath(FeedJob* feed, const wstring& url)
+{
+    ULONGLONG hash = 14695981039346656037ULL;
+    for (wchar_t c : url) {
+        hash = (hash ^ c) * 1099511628211ULL;
+    }
+    wchar_t name[32];
+    swprintf_s(name, L"\\%016llx.jpg", hash);
+    return feed->cacheDir + name;
+}
+
+
+// Size of the whole image the server sends (0 if it does not tell). A continued download must
+// start where the part file ends - false if it does not.
+bool getDownloadSize(HINTERNET request, ULONGLONG offset, bool resumed, ULONGLONG& total)
+{
+    total = 0;
+    wchar_t header[128];
+    DWORD size = sizeof(header);
+    if (!WinHttpQueryHeaders(request, resumed ? WINHTTP_QUERY_CONTENT_RANGE : WINHTTP_QUERY_CONTENT_LENGTH,
+            WINHTTP_HEADER_NAME_BY_INDEX, header, &size, WINHTTP_NO_HEADER_INDEX)) {
+        return !resumed;
+    }
+    if (!resumed) {
+        total = (ULONGLONG)_wtoi64(header);
+        return true;
+    }
+    // "bytes <first>-<last>/<total>", total can be "*"
+    const wchar_t* first = wcschr(header, L' ');
+    const wchar_t* slash = wcschr(header, L'/');
+    if (first == nullptr || (ULONGLONG)_wtoi64(first + 1) != offset) {
+        return false;
+    }
+    if (slash != nullptr) {
+        total = (ULONGLONG)_wtoi64(slash + 1);
+    }
+    return true;
+}
+
+
+#define DOWNLOAD_DONE                   0
+#define DOWNLOAD_FAILED                 1
+#define DOWNLOAD_MISMATCH               2       // part file doesn't fit the image on the server
+
+// Download the image (or its rest, from offset) to the part file
+int downloadFeedPart(FeedJob* feed, const wstring& url, const wstring& partFile, ULONGLONG offset)
+{
+    DWORD status = 0;
+    HINTERNET request = openUrl(feed->session, url, offset, status);
+    if (request == NULL) {
+        return DOWNLOAD_FAILED;
+    }
+    bool resumed = (status == 206);
+    ULONGLONG total = 0;
+    if ((offset > 0 && status == 416) || ((status == 200 || resumed) && !getDownloadSize(request, offset, resumed, total))) {
+        WinHttpCloseHandle(request);
+        return DOWNLOAD_MISMATCH;
+    }
+    if (status != 200 && !resumed) {
+        WinHttpCloseHandle(request);
+        return DOWNLOAD_FAILED;
+    }
+
+    HANDLE hFile = CreateFile(partFile.c_str(), GENERIC_WRITE, 0, NULL, resumed ? OPEN_ALWAYS : CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        WinHttpCloseHandle(request);
+        return DOWNLOAD_FAILED;
+    }
+    ULONGLONG size = 0;
+    if (resumed) {
+        SetFilePointer(hFile, 0, NULL, FILE_END);
+        size = offset;
+    }
+
+    vector<BYTE> buffer(FEED_BUFFER_SIZE);
+    bool ok = true;
+    DWORD read = 0;
+    while (WaitForSingleObject(feed->stopEvent, 0) != WAIT_OBJECT_0) {
+        if (!WinHttpReadData(request, buffer.data(), FEED_BUFFER_SIZE, &read)) {
+            ok = false;
+            break;
+        }
+        if (read == 0) {
+            break;
+        }
+        DWORD written = 0;
+        if (!WriteFile(hFile, buffer.data(), read, &written, NULL) || written != read) {
+            ok = false;
+            break;
+        }
+        size += read;
+        InterlockedAdd64(&feed->bytes, read);
+    }
+    ok = ok && read == 0;
+    CloseHandle(hFile);
+    WinHttpCloseHandle(request);
+
+    if (ok && total > 0 && size != total) {
+        return DOWNLOAD_MISMATCH;
+    }
+    return ok ? DOWNLOAD_DONE : DOWNLOAD_FAILED;
+}
+
+
+// Download the image to the cache. Partially downloaded file is kept aside and continued
+// next time (if the server supports ranges). When the part doesn't fit the image on the server
+// any more (it changed, or the part is broken) it is thrown away and the download starts again.
+// Complete file appears in the cache at once.
+bool downloadFeedImage(FeedJob* feed, const wstring& url, const wstring& file)
+{
+    wstring partFile = file + L".part";
+    WIN32_FILE_ATTRIBUTE_DATA partData;
+    ULONGLONG offset = 0;
+    if (GetFileAttributesEx(partFile.c_str(), GetFileExInfoStandard, &partData)) {
+        offset = ((ULONGLONG)partData.nFileSizeHigh << 32) | partData.nFileSizeLow;
+    }
+
+    int res = downloadFeedPart(feed, url, partFile, offset);
+    if (res == DOWNLOAD_MISMATCH) {
+        LOG << L"Feed image changed, downloading again:" << url.c_str();
+        DeleteFile(partFile.c_str());
+        res = (offset > 0) ? downloadFeedPart(feed, url, partFile, 0) : DOWNLOAD_FAILED;
+        if (res == DOWNLOAD_MISMATCH) {
+            DeleteFile(partFile.c_str());
+        }
+    }
+    return res == DOWNLOAD_DONE && MoveFileEx(partFile.c_str(), file.c_str(), MOVEFILE_REPLACE_EXISTING);
+}
+
+
+// Describe the downloaded image the same way the folder scan does
+bool probeFeedImage(ImageDecoder& decoder, const wstring& file, ImageInfo& info)
+{
+    UINT width, height;
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!decoder.getSize(file.c_str(), width, height) || !GetFileAttributesEx(file.c_str(), GetFileExInfoStandard, &data)) {
+        return false;
+    }
+    memset(&info, 0, sizeof(info));
+    info.width = width;
+    info.height = height;
+    info.size = ((ULONGLONG)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+    info.mtime = ((ULONGLONG)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+    info.focusX = info.focusY = FOCUS_MAX / 2;
+    return true;
+}
+
+
+// Download threads take images from the queue until it is empty - their number limits
+// the number of connections to the server
+unsigned long WINAPI feedDownloadThreadProc(void* data)
+{
+    FeedJob* feed = (FeedJob*)data;
+    ImageDecoder decoder;
+
+    while (WaitForSingleObject(feed->stopEvent, 0) != WAIT_OBJECT_0) {
+        LONG i = InterlockedIncrement(&feed->next) - 1;
+        if (i >= (LONG)feed->queue.size()) {
+            break;
+        }
+        const wstring& url = feed->queue[i];
+        wstring file = feedCachePath(feed, url);
+        FeedUpdate* update = new FeedUpdate();
+        ImageInfo info;
+        if (downloadFeedImage(feed, url, file) && probeFeedImage(decoder, file, info)) {
+            InterlockedIncrement(&feed->downloaded);
+            update->added.insert(std::make_pair(file, info));
+            // Each image is available as soon as it's here
+            if (PostMessage(feed->window, MY_MSG_FEED_UPDATE, 0, (LPARAM)update)) {
+                continue;
+            }
+        }
+        delete update;
+    }
+    return 0;
+}
+
+
+// Remove parts of images no longer in the feed and the oldest files when the cache is too big
+// (see wallcore.h), report what is left. 'urls' - the feed's images, null if not known yet.
+void trimFeedCache(FeedJob* feed, FeedUpdate* update, bool listAll, const vector<wstring>* urls)
+{
+    DirListing images, parts;
+    if (!images.read(feed->cacheDir.c_str(), L"*.jpg") || !parts.read(feed->cacheDir.c_str(), L"*.part")) {
+        return;
+    }
+    set<wstring> wanted;
+    if (urls != nullptr) {
+        for (const wstring& url : *urls) {
+            wanted.insert(feedCachePath(feed, url) + L".part");
+        }
+    }
+
+    EnterCriticalSection(&feed->shownLock);
+    set<ULONGLONG> shown = feed->shown;
+    LeaveCriticalSection(&feed->shownLock);
+
+    vector<wstring> paths;
+    vector<FeedCacheFile> files;
+    for (DirListing* listing : { &images, &parts }) {
+        for (size_t i = 0; i < listing->count(); i++) {
+            const DirEntry& entry = (*listing)[i];
+            wstring file = feed->cacheDir + L"\\" + listing->name(entry);
+            bool part = (listing == &parts);
+            FeedCacheFile cached = { entry.size, entry.mtime, part,
+                !part && shown.find(hashPath(file)) != shown.end(),
+                part && urls != nullptr && wanted.find(file) == wanted.end() };
+            paths.push_back(file);
+            files.push_back(cached);
+        }
+    }
+
+    vector<bool> removed(files.size(), false);
+    for (size_t i : selectFeedEvictions(files, feed->maxCacheBytes)) {
+        if (DeleteFile(paths[i].c_str()) && !files[i].part) {
+            update->removed.push_back(paths[i]);
+        }
+        removed[i] = true;
+    }
+
+    ImageDecoder decoder;
+    for (size_t i = 0; listAll && i < files.size(); i++) {
+        ImageInfo info;
+        if (!files[i].part && !removed[i] && probeFeedImage(decoder, paths[i], info)) {
+            update->added.insert(std::make_pair(paths[i], info));
+        }
+    }
+}
+
+
+unsigned long WINAPI feedThreadProc(void* data)
+{
+    FeedJob* feed = (FeedJob*)data;
+    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+    CreateDirectory(feed->cacheDir.c_str(), NULL);
+
+    // Images downloaded before are available right away
+    FeedUpdate* update = new FeedUpdate();
+    trimFeedCache(feed, update, true, nullptr);
+    if (!PostMessage(feed->window, MY_MSG_FEED_UPDATE, 0, (LPARAM)update)) {
+        delete update;
+    }
+
+    feed->session = WinHttpOpen(APP_NAME, WINHTTP_ACCESS_TYPE_AUTOMATIC_PROXY, WINHTTP_NO_PROXY_NAME, WINHTTP_NO_PROXY_BYPASS, 0);
+    if (feed->session == NULL) {
+        LOG << L"Opening HTTP session failed";
+        return 0;
+    }
+    WinHttpSetTimeouts(feed->session, FEED_TIMEOUT, FEED_TIMEOUT, FEED_TIMEOUT, FEED_TIMEOUT);
+    DWORD maxConnections = feed->connections;
+    WinHttpSetOption(feed->session, WINHTTP_OPTION_MAX_CONNS_PER_SERVER, &maxConnections, sizeof(maxConnections));
+
+    do {
+        vector<wstring> urls;
+        if (!readFeedIndex(feed, urls)) {
+            LOG << L"Reading feed failed:" << feed->url.c_str();
+            continue;
+        }
+
+        feed->queue.clear();
+        for (const wstring& url : urls) {
+            if (GetFileAttributes(feedCachePath(feed, url).c_str()) == INVALID_FILE_ATTRIBUTES) {
+                feed->queue.push_back(url);
+            }
+        }
+        // Parts of images that left the feed are removed even if there is nothing to download
+        if (!feed->queue.empty()) {
+            ULONGLONG startTime = GetTickCount64();
+            feed->next = 0;
+            feed->downloaded = 0;
+            feed->bytes = 0;
+            vector<HANDLE> workers;
+            for (int t = 0; t < feed->connections && t < (int)feed->queue.size(); t++) {
+                unsigned long threadId;
+                HANDLE worker = CreateThread(NULL, 0, feedDownloadThreadProc, feed, 0, &threadId);
+                if (worker != NULL) {
+                    workers.push_back(worker);
+                }
+            }
+            for (HANDLE worker : workers) {
+                WaitForSingleObject(worker, INFINITE);
+                CloseHandle(worker);
+            }
+
+            ULONGLONG time = GetTickCount64() - startTime;
+            LOG << L"Feed images to download:" << (int)feed->queue.size();
+            LOG << L"Feed images downloaded:" << (int)feed->downloaded;
+            if (time > 0) {
+                LOG << L"Feed download speed [KB/s]:" << (int)(feed->bytes * 1000 / 1024 / time);
+            }
+        }
+
+        update = new FeedUpdate();
+        trimFeedCache(feed, update, false, &urls);
+        if (update->removed.empty() || !PostMessage(feed->window, MY_MSG_FEED_UPDATE, 0, (LPARAM)update)) {
+            delete update;
+        }
+    } while (WaitForSingleObject(feed->stopEvent, feed->pollInterval) == WAIT_TIMEOUT);
+
+    WinHttpCloseHandle(feed->session);
+    return 0;
+}
+
+
+// Main thread: put downloaded images to the list of known ones
+void onFeedUpdate(FeedUpdate* update)
+{
+    restoreCatalog();
+    for (auto const& f2d : update->added) {
+        feedImages[f2d.first] = f2d.second;
+        file2dimensions[f2d.first] = f2d.second;
+        if (traceRecorder.isOpen()) {
+            traceImage(f2d.first, &f2d.second);
+        }
+    }
+    for (const wstring& file : update->removed) {
+        feedImages.erase(file);
+        file2dimensions.erase(file);
+        if (traceRecorder.isOpen()) {
+            traceImage(file, nullptr);
+        }
+    }
+    delete update;
+    catalogGeneration++;
+    updateThumbnails();
+    setWallpapers(false);
+}
+
+
+// Main thread: tell the feed which images are on the screen (or current in the history) - they
+// must not disappear from its cache
+void protectFeedImages(const set<ULONGLONG>& shown)
+{
+    shownImages = shown;
+    if (runningFeed != nullptr) {
+        EnterCriticalSection(&runningFeed->shownLock);
+        runningFeed->shown = shown;
+        LeaveCriticalSection(&runningFeed->shownLock);
+    }
+}
+
+
+// Start or stop polling the feed (if configured)
+void manageFeed(HWND window, bool start)
+{
+    if (runningFeed != nullptr) {
+        SetEvent(runningFeed->stopEvent);
+        WaitForSingleObject(runningFeed->thread, INFINITE);
+        CloseHandle(runningFeed->thread);
+        CloseHandle(runningFeed->stopEvent);
+        DeleteCriticalSection(&runningFeed->shownLock);
+        delete runningFeed;
+        runningFeed = nullptr;
+
+        // Images of the feed are not used any more
+        for (auto const& f2d : feedImages) {
+            file2dimensions.erase(f2d.first);
+        }
+        feedImages.clear();
+        catalogGeneration++;
+    }
+
+    const wstring& url = SETTINGS->FeedUrl;
+    if (!start || url.empty()) {
+        return;
+    }
+
+    FeedJob* feed = new FeedJob();
+    feed->window = window;
+    feed->url = url;
+    feed->cacheDir = getAppDataPath(L".feed");
+    feed->connections = max(1, min(SETTINGS->FeedConnections, FEED_MAX_CONNECTIONS));
+    feed->maxCacheBytes = (ULONGLONG)SETTINGS->FeedCacheMB * 1024 * 1024;
+    feed->pollInterval = ONE_MINUTE_MILLIS * max(1, SETTINGS->FeedPollMinutes);
+    feed->session = NULL;
+    feed->stopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    InitializeCriticalSection(&feed->shownLock);
+    feed->shown = shownImages;
+    unsigned long threadId;
+    feed->thread = CreateThread(NULL, 0, feedThreadProc, feed, 0, &threadId);
+    if (feed->thread == NULL) {
+        LOG << L"Creating thread for the feed failed";
+        CloseHandle(feed->stopEvent);
+        DeleteCriticalSection(&feed->shownLock);
+        delete feed;
+        return;
+    }
+    runningFeed = feed;
+}
+
+
+#pragma endregion
+
+
+
+#pragma region "THUMBNAIL ATLAS"
+
+// Small copies of all the known images, for previews - shown without decoding anything.
+// They are kept in fixed size slots of a file in LocalAppData mapped to memory; other programs
+// can map it too (the control channel tells which slot belongs to an image). When the list
+// of images changes, thumbnails of new and changed images are made in the background, in parallel.
+// File: header, then slots (added by pages). Slot: header, then pixels.
+#define THUMB_MAGIC                     0x31485457      // "WTH1"
+#define THUMB_SIZE                      64              // thumbnails fit in a square this big
+#define THUMB_SLOTS_PER_PAGE            64
+
+typedef struct {
+    DWORD       magic;
+    DWORD       slotCount;
+    DWORD       slotSize;       // sizeof(ThumbSlot) - for other programs
+    DWORD       thumbSize;      // THUMB_SIZE
+} ThumbAtlasHeader;
+
+typedef struct {
+    ULONGLONG   pathHash;       // 0 - free slot, or the thumbnail is being made
+    ULONGLONG   size;           // of the image file the thumbnail was made from
+    ULONGLONG   mtime;
+    WORD        width;          // of the thumbnail - 0 if the image can't be decoded (not tried
+                                // ...again until the file changes)
+    WORD        height;
+    DWORD       reserved;
+    DWORD       pixels[THUMB_SIZE * THUMB_SIZE];    // 32bpp BGR, rows of THUMB_SIZE pixels from the top
+} ThumbSlot;
+
+// Thumbnails to be made - each one to its own slot
+typedef struct {
+    vector<wstring>         paths;
+    vector<ULONGLONG>       hashes;
+    vector<ThumbSlot*>      slots;
+    LONG                    next;
+    volatile LONG           cancel;
+    int                     threads;
+    HWND                    window;
+    HANDLE                  thread;
+} ThumbJob;
+
+
+void makeThumbnails(ThumbJob* job)
+{
+    ImageDecoder decoder;
+    while (!job->cancel) {
+        LONG i = InterlockedIncrement(&job->next) - 1;
+        if (i >= (LONG)job->paths.size()) {
+            break;
+        }
+        ThumbSlot* slot = job->slots[i];
+        slot->width = 0;
+        slot->height = 0;
+        Bitmap* bmp = decoder.loadForArea(job->paths[i].c_str(), THUMB_SIZE, THUMB_SIZE, DWPOS_FIT);
+        if (bmp != nullptr) {
+            int width = min((int)bmp->GetWidth(), THUMB_SIZE);
+            int height = min((int)bmp->GetHeight(), THUMB_SIZE);
+            BitmapData bits;
+            Rect all(0, 0, width, height);
+            if (bmp->LockBits(&all, ImageLockModeRead, PixelFormat32bppRGB, &bits) == Ok) {
+                for (int y = 0; y < height; y++) {
+                    memcpy(slot->pixels + y * THUMB_SIZE, (const BYTE*)bits.Scan0 + y * bits.Stride, width * sizeof(DWORD));
+                }
+                bmp->UnlockBits(&bits);
+                slot->width = (WORD)width;
+                slot->height = (WORD)height;
+            }
+            delete bmp;
+        }
+        // Failed ones too - the slot tells the image was tried. Readers check the hash - it must
+        // be the last thing written.
+        MemoryBarrier();
+        slot->pathHash = job->hashes[i];
+    }
+}
+
+
+// Additional threads making thumbnails (if more than one is configured)
+unsigned long WINAPI thumbWorkerThreadProc(void* data)
+{
+    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+    makeThumbnails((ThumbJob*)data);
+    return 0;
+}
+
+
+unsigned long WINAPI thumbThreadProc(void* data)
+{
+    ThumbJob* job = (ThumbJob*)data;
+    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+
+    GdiplusStartupInput gdiplusStartupInput;
+    ULONG_PTR gdiplusToken;
+    GdiplusStartup(&gdiplusToken, &gdiplusStartupInput, NULL);
+
+    vector<HANDLE> workers;
+    for (int t = 1; t < job->threads; t++) {
+        unsigned long threadId;
+        HANDLE worker = CreateThread(NULL, 0, thumbWorkerThreadProc, job, 0, &threadId);
+        if (worker != NULL) {
+            workers.push_back(worker);
+        }
+    }
+    makeThumbnails(job);
+    for (HANDLE worker : workers) {
+        WaitForSingleObject(worker, INFINITE);
+        CloseHandle(worker);
+    }
+
+    GdiplusShutdown(gdiplusToken);
+    PostMessage(job->window, MY_MSG_THUMBS_DONE, 0, (LPARAM)job);
+    return 0;
+}
+
+
+// The atlas is used by the main thread - threads making thumbnails only write to slots given to them
+class ThumbnailAtlas
+{
+public:
+    ThumbnailAtlas() : window(NULL), file(INVALID_HANDLE_VALUE), mapping(NULL), view(nullptr), job(nullptr), updateRequested(false) {}
+
+    ~ThumbnailAtlas() {
+        close();
+    }
+
+    // Open the atlas file (the application's if not given) - thumbnails made before are used
+    // if they are of the same format
+    bool open(HWND wnd, const wstring& atlasFile = wstring()) {
+        window = wnd;
+        path = atlasFile.empty() ? getAppDataPath(L".thumbs") : atlasFile;
+        file = CreateFile(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+            OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+
+        ThumbAtlasHeader h = { 0 };
+        DWORD bytes = 0;
+        LARGE_INTEGER size;
+        DWORD slotCount = 0;
+        if (ReadFile(file, &h, sizeof(h), &bytes, NULL) && bytes == sizeof(h) && GetFileSizeEx(file, &size)
+                && h.magic == THUMB_MAGIC && h.slotSize == sizeof(ThumbSlot) && h.thumbSize == THUMB_SIZE
+                && (ULONGLONG)size.QuadPart >= sizeof(h) + (ULONGLONG)h.slotCount * sizeof(ThumbSlot)) {
+            slotCount = h.slotCount;
+        }
+        if (!remap(slotCount > 0 ? slotCount : THUMB_SLOTS_PER_PAGE)) {
+            close();
+            return false;
+        }
+        if (slotCount == 0) {
+            header()->magic = THUMB_MAGIC;
+            header()->slotSize = sizeof(ThumbSlot);
+            header()->thumbSize = THUMB_SIZE;
+            addSlots(0, THUMB_SLOTS_PER_PAGE);
+        }
+
+        for (DWORD i = 0; i < header()->slotCount; i++) {
+            if (slot(i)->pathHash != 0) {
+                slotOf[slot(i)->pathHash] = i;
+            }
+        }
+        return true;
+    }
+
+    void close() {
+        stop();
+        if (view != nullptr) {
+            UnmapViewOfFile(view);
+            view = nullptr;
+        }
+        if (mapping != NULL) {
+            CloseHandle(mapping);
+            mapping = NULL;
+        }
+        if (file != INVALID_HANDLE_VALUE) {
+            CloseHandle(file);
+            file = INVALID_HANDLE_VALUE;
+        }
+        slotOf.clear();
+    }
+
+    // Stop making thumbnails - when the program terminates
+    void stop() {
+        if (job != nullptr) {
+            InterlockedExchange(&job->cancel, 1);
+            WaitForSingleObject(job->thread, INFINITE);
+            CloseHandle(job->thread);
+            delete job;
+            job = nullptr;
+        }
+    }
+
+    // Free slots of images no longer known, and start making thumbnails of new and changed ones
+    void update() {
+        if (view == nullptr) {
+            return;
+        }
+        if (job != nullptr) {
+            // Slots can't be moved while thumbnails are being made - again when it's done
+            updateRequested = true;
+            return;
+        }
+        updateRequested = false;
+
+        map<ULONGLONG, DWORD> kept;
+        vector<pair<const wstring*, const ImageInfo*>> missing;
+        vector<ULONGLONG> missingHashes;
+        for (auto const& f2d : file2dimensions) {
+            ULONGLONG hash = hashPath(f2d.first);
+            auto known = slotOf.find(hash);
+            if (known != slotOf.end()) {
+                ThumbSlot* s = slot(known->second);
+                if (s->pathHash == hash && s->size == f2d.second.size && s->mtime == f2d.second.mtime) {
+                    kept[hash] = known->second;
+                    continue;
+                }
+            }
+            missing.push_back(std::make_pair(&f2d.first, &f2d.second));
+            missingHashes.push_back(hash);
+        }
+
+        vector<bool> used(header()->slotCount, false);
+        for (auto const& k : kept) {
+            used[k.second] = true;
+        }
+        vector<DWORD> freeSlots;
+        for (DWORD i = 0; i < header()->slotCount; i++) {
+            if (!used[i]) {
+                slot(i)->pathHash = 0;
+                freeSlots.push_back(i);
+            }
+        }
+        slotOf.swap(kept);
+        if (missing.empty()) {
+            return;
+        }
+
+        if (missing.size() > freeSlots.size()) {
+            DWORD oldCount = header()->slotCount;
+            DWORD needed = oldCount + (DWORD)(missing.size() - freeSlots.size());
+            DWORD newCount = (needed + THUMB_SLOTS_PER_PAGE - 1) / THUMB_SLOTS_PER_PAGE * THUMB_SLOTS_PER_PAGE;
+            if (!remap(newCount)) {
+                LOG << L"Growing thumbnail atlas failed";
+                if (!remap(oldCount)) {
+                    close();
+                }
+                return;
+            }
+            addSlots(oldCount, newCount);
+            for (DWORD i = oldCount; i < newCount; i++) {
+                freeSlots.push_back(i);
+            }
+        }
+
+        job = new ThumbJob();
+        for (size_t i = 0; i < missing.size(); i++) {
+            ThumbSlot* s = slot(freeSlots[i]);
+            s->size = missing[i].second->size;
+            s->mtime = missing[i].second->mtime;
+            slotOf[missingHashes[i]] = freeSlots[i];
+            job->paths.push_back(*missing[i].first);
+            job->hashes.push_back(missingHashes[i]);
+            job->slots.push_back(s);
+        }
+        job->next = 0;
+        job->cancel = 0;
+        job->window = window;
+        job->threads = SETTINGS->ScanThreads;
+        if (job->threads < 1 || job->threads > SCAN_MAX_THREADS) {
+            job->threads = 1;
+        }
+        unsigned long threadId;
+        job->thread = CreateThread(NULL, 0, thumbThreadProc, job, 0, &threadId);
+        if (job->thread == NULL) {
+            LOG << L"Creating thread for making thumbnails failed";
+            delete job;
+            job = nullptr;
+        }
+    }
+
+    void onDone(ThumbJob* done) {
+        if (done != job) {
+            return;
+        }
+        WaitForSingleObject(job->thread, INFINITE);
+        CloseHandle(job->thread);
+        delete job;
+        job = nullptr;
+        if (updateRequested) {
+            update();
+        }
+    }
+
+    // Wait until all thumbnails are made - for batch mode, there is no window to be told
+    void wait() {
+        while (job != nullptr) {
+            onDone(job);
+        }
+    }
+
+    // Slot with the image's thumbnail - or -1 if it has none (yet, or it can't be made)
+    int find(const wstring& image) const {
+        ULONGLONG hash = hashPath(image);
+        auto known = slotOf.find(hash);
+        if (known == slotOf.end() || view == nullptr || slot(known->second)->pathHash != hash
+                || slot(known->second)->width == 0) {
+            return -1;
+        }
+        return (int)known->second;
+    }
+
+    const ThumbSlot* get(int index) const {
+        return slot(index);
+    }
+
+    const wstring& getFile() const {
+        return path;
+    }
+
+private:
+    ThumbAtlasHeader* header() const {
+        return (ThumbAtlasHeader*)view;
+    }
+
+    ThumbSlot* slot(DWORD index) const {
+        return (ThumbSlot*)(view + sizeof(ThumbAtlasHeader)) + index;
+    }
+
+    // Map the file with room for the given number of slots - the file grows if needed
+    bool remap(DWORD slotCount) {
+        if (view != nullptr) {
+            UnmapViewOfFile(view);
+            view = nullptr;
+        }
+        if (mapping != NULL) {
+            CloseHandle(mapping);
+        }
+        ULONGLONG size = sizeof(ThumbAtlasHeader) + (ULONGLONG)slotCount * sizeof(ThumbSlot);
+        mapping = CreateFileMapping(file, NULL, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)size, NULL);
+        if (mapping == NULL) {
+            return false;
+        }
+        view = (BYTE*)MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, 0);
+        return view != nullptr;
+    }
+
+    // New part of the file is not guaranteed to be zeroed
+    void addSlots(DWORD from, DWORD to) {
+        for (DWORD i = from; i < to; i++) {
+            slot(i)->pathHash = 0;
+        }
+        header()->slotCount = to;
+    }
+
+    HWND                    window;
+    wstring                 path;
+    HANDLE                  file;
+    HANDLE                  mapping;
+    BYTE*                   view;
+    map<ULONGLONG, DWORD>   slotOf;     // path hash -> slot
+    ThumbJob*               job;
+    bool                    updateRequested;
+};
+
+// Global (used by main thread only):
+ThumbnailAtlas thumbnailAtlas;
+
+
+void updateThumbnails()
+{
+    thumbnailAtlas.update();
+}
+
+#pragma endregion
+
+
+
+#pragma region "CATALOG FILTER"
+
+// Images can be limited with a filter expression (Filter setting) - compiled and run over columns
+// of the whole catalog (see wallcore.h). Result is kept until the catalog, filter or blocklist changes.
+class CatalogFilter
+{
+public:
+    CatalogFilter() : generation((ULONGLONG)-1), blocklistTime(0), day(0), resultValid(false) {}
+
+    // Images of file2dimensions passing the filter - in the order of the map
+    const vector<bool>& apply() {
+        wstring expression = SETTINGS->Filter;
+        if (expression != source) {
+            source = expression;
+            wstring error;
+            FilterCompiler compiler;
+            if (!compiler.compile(source, program, error)) {
+                LOG << L"Invalid filter, all images are used:";
+                LOG << error.c_str();
+                program.clear();
+            }
+            resultValid = false;
+        }
+        if (generation != catalogGeneration) {
+            updateColumns();
+            resultValid = false;
+        }
+        if (loadBlocklist()) {
+            resultValid = false;
+        }
+        FILETIME now;
+        GetSystemTimeAsFileTime(&now);
+        ULONGLONG today = (((ULONGLONG)now.dwHighDateTime << 32) | now.dwLowDateTime) / FILETIME_DAY;
+        if (today != day) {
+            day = today;
+            resultValid = false;
+        }
+
+        if (!resultValid) {
+            run();
+            resultValid = true;
+        }
+        return result;
+    }
+
+private:
+    ULONGLONG                   generation;
+    wstring                     source;
+    vector<FilterInstruction>   program;
+    ULONGLONG                   blocklistTime;
+    set<wstring>                blocklist;      // lower case paths
+    ULONGLONG                   day;            // today, for ages
+    bool                        resultValid;
+    vector<bool>                result;
+
+    FilterColumns               columns;
+
+    void updateColumns() {
+        generation = catalogGeneration;
+        size_t count = file2dimensions.size();
+        vector<wstring>& paths = columns.paths;
+        vector<int>* numbers = columns.numbers;
+        paths.clear();
+        paths.reserve(count);
+        for (auto& column : columns.numbers) {
+            column.clear();
+            column.reserve(count);
+        }
+        for (auto const& f2d : file2dimensions) {
+            wstring path(f2d.first);
+            transform(path.begin(), path.end(), path.begin(), towlower);
+            paths.push_back(path);
+            const ImageInfo& info = f2d.second;
+            bool analysed = (info.flags & IMAGE_HAS_FEATURES) != 0;
+            numbers[FieldWidth].push_back(info.width);
+            numbers[FieldHeight].push_back(info.height);
+            numbers[FieldSizeKB].push_back((int)(info.size / 1024));
+            // Stored as the day of modification, age is computed when the filter is run
+            numbers[FieldAgeDays].push_back((int)(info.mtime / FILETIME_DAY));
+            numbers[FieldLuminance].push_back(analysed ? info.features[FEATURE_LUMINANCE] : -1);
+            numbers[FieldSharpness].push_back(analysed ? info.features[FEATURE_SHARPNESS] : -1);
+        }
+    }
+
+    // Returns true if the blocklist changed
+    bool loadBlocklist() {
+        wstring file = getAppDataPath(L".blocklist");
+        WIN32_FILE_ATTRIBUTE_DATA data;
+        ULONGLONG time = 0;
+        if (GetFileAttributesEx(file.c_str(), GetFileExInfoStandard, &data)) {
+            time = ((ULONGLONG)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+        }
+        if (time == blocklistTime) {
+            return false;
+        }
+        blocklistTime = time;
+        blocklist.clear();
+        wifstream f(file);
+        wstring line;
+        while (std::getline(f, line)) {
+            while (!line.empty() && iswspace(line.back())) line.pop_back();
+            if (!line.empty()) {
+                transform(line.begin(), line.end(), line.begin(), towlower);
+                blocklist.insert(line);
+            }
+        }
+        return true;
+    }
+
+    void run() {
+        // Relative paths are under any of the folders with images
+        map<wstring, int> sources;
+        getConfiguredSources(*SETTINGS, sources);
+        vector<wstring> folders;
+        for (auto const& source : sources) {
+            wstring folder = source.first;
+            transform(folder.begin(), folder.end(), folder.begin(), towlower);
+            folders.push_back(folder + L"\\");
+        }
+        runFilter(program, columns, blocklist, day, folders, result);
+    }
+};
+
+// Global (used by main thread only):
+CatalogFilter catalogFilter;
+
+
+#pragma endregion
+
+
+
+#pragma region "WALLPAPER HISTORY"
+
+// Wallpapers shown on every monitor (see wallcore.h). Hashes are turned back to images through
+// an index rebuilt when the list of images changes - images that are gone are just skipped.
+// Kept in LocalAppData (*.history).
+class WallpaperHistory : public HistoryRings
+{
+public:
+    WallpaperHistory() : generation((ULONGLONG)-1) {}
+
+    void record(const wstring& monitorId, const wchar_t* image) {
+        HistoryRings::record(monitorId, hashPath(image));
+    }
+
+    // Go one entry back or forward (skipping images not known any more), null if there is none
+    const wchar_t* move(const wstring& monitorId, bool back) {
+        updateIndex();
+        ULONGLONG hash;
+        if (!HistoryRings::move(monitorId, back, [&](ULONGLONG h) { return index.find(h) != index.end(); }, hash)) {
+            return nullptr;
+        }
+        return index[hash];
+    }
+
+    // Drop the index - it is built again when needed
+    void trim() {
+        index = unordered_map<ULONGLONG, const wchar_t*>();
+        generation = (ULONGLONG)-1;
+    }
+
+    bool save(const wstring& file) {
+        if (!changed) {
+            return true;
+        }
+        wstring temp = file + L".tmp";
+        ofstream f(temp, ofstream::binary | ofstream::trunc);
+        write(f);
+        bool ok = f.good();
+        f.close();
+        if (!ok || !MoveFileEx(temp.c_str(), file.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+            DeleteFile(temp.c_str());
+            return false;
+        }
+        changed = false;
+        return true;
+    }
+
+    bool load(const wstring& file) {
+        ifstream f(file, ifstream::binary);
+        return read(f);
+    }
+
+private:
+    void updateIndex() {
+        if (generation == catalogGeneration) {
+            return;
+        }
+        generation = catalogGeneration;
+        index.clear();
+        index.reserve(file2dimensions.size());
+        for (auto const& f2d : file2dimensions) {
+            index[hashPath(f2d.first)] = f2d.first.c_str();
+        }
+    }
+
+    ULONGLONG                                   generation;
+    unordered_map<ULONGLONG, const wchar_t*>    index;      // hash -> key of file2dimensions
+};
+
+// Global (used by main thread only):
+WallpaperHistory wallpaperHistory;
+
+
+void loadHistory()
+{
+    wallpaperHistory.load(getAppDataPath(L".history"));
+    wallpaperHistory.setCapacity(SETTINGS->HistorySize);
+}
+
+
+void saveHistory()
+{
+    if (!wallpaperHistory.save(getAppDataPath(L".history"))) {
+        LOG << L"Saving wallpaper history failed";
+    }
+}
+
+
+void updateHistorySize()
+{
+    wallpaperHistory.setCapacity(SETTINGS->HistorySize);
+}
+
+#pragma endregion
+
+
+
+#pragma region "IDLE TRIMMING"
+
+// Most of the time the program just waits in the tray - but the list of images (and tables
+// computed from it) stays in memory, for every session on a terminal server. When it was not used
+// for IdleTrimMinutes it is dropped: all of it is in the caches already (saved after every scan).
+// The next use reads all of it back from the caches - mapped files, sequentially, straight into the list,
+// no image is opened. It is the whole list, not just the pages needed: the tick chooses from all images
+// (filter, shapes, features), so it would touch all of them anyway. The wake-up is timed (see /trim
+// in batch mode); if it takes longer than IDLE_TRIM_MAX_RESTORE, catalogs that big are not trimmed any more.
+#define IDLE_TRIM_CHECK_INTERVAL        ONE_MINUTE_MILLIS
+#define IDLE_TRIM_TOLERANCE             (ONE_MINUTE_MILLIS / 2)
+#define IDLE_TRIM_MAX_RESTORE           250000          // microseconds
+
+// Global (used by main thread only):
+ULONGLONG lastCatalogUse = 0;
+size_t slowRestoreSize = SIZE_MAX;      // images in the smallest catalog restored too slowly
+
+
+// Called before anything works with the list of images
+void restoreCatalog()
+{
+    lastCatalogUse = GetTickCount64();
+    if (!catalogTrimmed) {
+        return;
+    }
+    catalogTrimmed = false;
+    LONGLONG start = MetricTimer::now();
+    // Straight to the list - the images are the same as before, so thumbnails and trace need no update
+    for (auto const& source : imageSources) {
+        ImageCacheHeader header;
+        readImageCache(getImageCachePath(source.first), source.first, header, file2dimensions, true);
+    }
+    file2dimensions.insert(feedImages.begin(), feedImages.end());
+    catalogGeneration++;
+
+    LONGLONG time = MetricTimer::microsSince(start);
+    metricCatalogRestoreTime.record(time);
+    LOG << L"Catalog restored, images / time [us]:" << (int)file2dimensions.size() << (int)time;
+    if (time > IDLE_TRIM_MAX_RESTORE && file2dimensions.size() < slowRestoreSize) {
+        slowRestoreSize = file2dimensions.size();
+        LOG << L"Restoring catalog is too slow - not trimming catalogs of this size";
+    }
+}
+
+
+// Drop the list of images and everything computed from it
+void trimCatalog()
+{
+    LOG << L"Trimming catalog, images:" << (int)file2dimensions.size();
+    file2dimensions.clear();
+    catalogGeneration++;
+    featureTable = CatalogFeatureTable();
+    shapeIndex = CatalogShapeIndex();
+    catalogFilter = CatalogFilter();
+    wallpaperHistory.trim();
+    catalogTrimmed = true;
+    metricCatalogTrims.add();
+
+    // Give the freed memory back to the system
+    HeapCompact(GetProcessHeap(), 0);
+    SetProcessWorkingSetSize(GetCurrentProcess(), (SIZE_T)-1, (SIZE_T)-1);
+}
+
+
+// Drop the list of images if it was not used for long enough (and nothing is adding to it)
+void onIdleTimer()
+{
+    int minutes = SETTINGS->IdleTrimMinutes;
+    if (catalogTrimmed || minutes <= 0 || !runningScans.empty() || !sharedCatalogRetries.empty()
+            || file2dimensions.size() >= slowRestoreSize
+            || GetTickCount64() - lastCatalogUse < (ULONGLONG)minutes * ONE_MINUTE_MILLIS) {
+        return;
+    }
+    trimCatalog();
+}
+
+
+void manageIdleTrim(HWND window)
+{
+    lastCatalogUse = GetTickCount64();
+    if (SETTINGS->IdleTrimMinutes > 0) {
+        SetCoalescableTimer(window, EVENT_IDLE_TRIM, IDLE_TRIM_CHECK_INTERVAL, NULL, IDLE_TRIM_TOLERANCE);
+    }
+    else {
+        KillTimer(window, EVENT_IDLE_TRIM);
+    }
+}
+
+#pragma endregion
+
+
+
+#pragma region "WALLPAPER TARGETS"
+
+// Where the wallpapers are set: Windows desktop (via COM) or simulated one.
+// Every call to the real desktop makes Explorer repaint - callers should ask
+// for the state first and change only what is different.
+class WallpaperTarget
+{
+public:
+    virtual ~WallpaperTarget() {}
+
+    virtual UINT getMonitorCount() = 0;
+    virtual bool getMonitor(UINT index, wstring& id, RECT& rect) = 0;
+    virtual bool getWallpaper(const wstring& monitorId, wstring& image) = 0;
+    virtual bool setWallpaper(const wstring& monitorId, const wchar_t* image) = 0;
+    virtual bool getPosition(DESKTOP_WALLPAPER_POSITION& position) = 0;
+    virtual bool setPosition(DESKTOP_WALLPAPER_POSITION position) = 0;
+};
+
+
+
+// The real thing - IDesktopWallpaper COM object
+class DesktopWallpaperTarget : public WallpaperTarget
+{
+public:
+    DesktopWallpaperTarget() : pWall(nullptr) {
+        // Fails if the thread is in another apartment already (like in a dialog) - that one is
+        // not ours to uninitialize, COM is usable anyway
+        comInitialized = SUCCEEDED(CoInitializeEx(nullptr, COINIT_MULTITHREADED));
+        HRESULT hr = CoCreateInstance(__uuidof(DesktopWallpaper), nullptr, CLSCTX_ALL, __uuidof(IDesktopWallpaper), reinterpret_cast<LPVOID *>(&pWall));
+        if (FAILED(hr)) {
+            pWall = nullptr;
+        }
+    }
+
+    ~DesktopWallpaperTarget() {
+        if (pWall != nullptr) {
+            pWall->Release();
+        }
+        if (comInitialized) {
+            CoUninitialize();
+        }
+    }
+
+    bool isValid() const {
+        return pWall != nullptr;
+    }
+
+    UINT getMonitorCount() {
+        MetricTimer timer(metricDesktopCallTime);
+        UINT nMonitors = 0;
+        pWall->GetMonitorDevicePathCount(&nMonitors);
+        return nMonitors;
+    }
+
+    bool getMonitor(UINT index, wstring& id, RECT& rect) {
+        MetricTimer timer(metricDesktopCallTime);
+        LPWSTR pId;
+        if (FAILED(pWall->GetMonitorDevicePathAt(index, &pId))) {
+            return false;
+        }
+        id = pId;
+        CoTaskMemFree(pId);
+        return !FAILED(pWall->GetMonitorRECT(id.c_str(), &rect));
+    }
+
+    bool getWallpaper(const wstring& monitorId, wstring& image) {
+        MetricTimer timer(metricDesktopCallTime);
+        LPWSTR current;
+        if (FAILED(pWall->GetWallpaper(monitorId.c_str(), &current))) {
+            return false;
+        }
+        image = current;
+        CoTaskMemFree(current);
+        return true;
+    }
+
+    bool setWallpaper(const wstring& monitorId, const wchar_t* image) {
+        MetricTimer timer(metricDesktopCallTime);
+        // No monitor - the image is set on all of them
+        return !FAILED(pWall->SetWallpaper(monitorId.empty() ? nullptr : monitorId.c_str(), image));
+    }
+
+    bool getPosition(DESKTOP_WALLPAPER_POSITION& position) {
+        MetricTimer timer(metricDesktopCallTime);
+        return !FAILED(pWall->GetPosition(&position));
+    }
+
+    bool setPosition(DESKTOP_WALLPAPER_POSITION position) {
+        MetricTimer timer(metricDesktopCallTime);
+        return !FAILED(pWall->SetPosition(position));
+    }
+
+private:
+    IDesktopWallpaper* pWall;
+    bool               comInitialized;
+};
+
+
+
+// Desktop that exists only in memory - for trying things out without touching the real one
+class SimulatedWallpaperTarget : public WallpaperTarget
+{
+public:
+    SimulatedWallpaperTarget() : position(DWPOS_FILL), setWallpaperCalls(0), setPositionCalls(0) {}
+
+    void addMonitor(const wchar_t* id, int left, int top, int width, int height) {
+        Monitor m;
+        m.id = id;
+        m.rect.left = left;
+        m.rect.top = top;
+        m.rect.right = left + width;
+        m.rect.bottom = top + height;
+        monitors.push_back(m);
+    }
+
+    void removeMonitors() {
+        monitors.clear();
+    }
+
+    UINT getMonitorCount() {
+        return (UINT)monitors.size();
+    }
+
+    bool getMonitor(UINT index, wstring& id, RECT& rect) {
+        if (index >= monitors.size()) {
+            return false;
+        }
+        id = monitors[index].id;
+        rect = monitors[index].rect;
+        return true;
+    }
+
+    bool getWallpaper(const wstring& monitorId, wstring& image) {
+        Monitor* m = find(monitorId);
+        if (m == nullptr) {
+            return false;
+        }
+        image = m->wallpaper;
+        return true;
+    }
+
+    bool setWallpaper(const wstring& monitorId, const wchar_t* image) {
+        setWallpaperCalls++;
+        if (monitorId.empty()) {
+            for (auto& m : monitors) {
+                m.wallpaper = image;
+            }
+            return true;
+        }
+        Monitor* m = find(monitorId);
+        if (m == nullptr) {
+            return false;
+        }
+        m->wallpaper = image;
+        return true;
+    }
+
+    bool getPosition(DESKTOP_WALLPAPER_POSITION& pos) {
+        pos = position;
+        return true;
+    }
+
+    bool setPosition(DESKTOP_WALLPAPER_POSITION pos) {
+        setPositionCalls++;
+        position = pos;
+        return true;
+    }
+
+public:
+    // How many times the desktop would have been repainted
+    int setWallpaperCalls;
+    int setPositionCalls;
+
+private:
+    typedef struct {
+        wstring id;
+        RECT    rect;
+        wstring wallpaper;
+    } Monitor;
+
+    Monitor* find(const wstring& id) {
+        for (auto& m : monitors) {
+            if (m.id == id) {
+                return &m;
+            }
+        }
+        return nullptr;
+    }
+
+    vector<Monitor>             monitors;
+    DESKTOP_WALLPAPER_POSITION  position;
+};
+
+#pragma endregion
+
+
+
+#pragma region "RENDERING WALLPAPERS"
+
+// Instead of separate wallpaper for every monitor (decoded and transcoded by Explorer
+// for each of them) one image covering the whole virtual desktop can be rendered here
+// and set with DWPOS_SPAN. Each monitor's part is rendered in a separate thread.
+// Also images not matching the monitor's aspect ratio can be cropped here around
+// their focus point, instead of being cut in the middle by Windows.
+
+// Area of the composite image covered by a single monitor and the image to put there
+typedef struct {
+    RECT            rect;           // in composite image coordinates
+    const wchar_t*  image;
+    REAL            focusX;
+    REAL            focusY;
+    DESKTOP_WALLPAPER_POSITION mode;
+    int             bezel;          // pixels hidden by monitor frame - on each side
+    BitmapData*     composite;      // where to render (locked bits of the composite image)
+    bool            ok;
+} CompositePart;
+
+
+// Find GDI+ encoder for given format, like L"image/jpeg" (as in MSDN examples)
+bool getEncoderClsid(const WCHAR* format, CLSID* clsid)
+{
+    UINT num = 0;
+    UINT size = 0;
+    GetImageEncodersSize(&num, &size);
+    if (size == 0) {
+        return false;
+    }
+
+    vector<BYTE> buffer(size);
+    ImageCodecInfo* codecs = (ImageCodecInfo*)buffer.data();
+    GetImageEncoders(num, size, codecs);
+    for (UINT i = 0; i < num; i++) {
+        if (wcscmp(codecs[i].MimeType, format) == 0) {
+            *clsid = codecs[i].Clsid;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// Scale and place the image in the area the way Windows does it for given display mode (see placeImage)
+void drawImageInArea(Graphics& g, Image* img, int width, int height, DESKTOP_WALLPAPER_POSITION mode, int bezel,
+    REAL focusX = 0.5f, REAL focusY = 0.5f)
+{
+    ImagePlacement p = placeImage((REAL)img->GetWidth(), (REAL)img->GetHeight(), width, height, mode, bezel, focusX, focusY);
+    g.DrawImage(img, RectF(p.x, p.y, p.width, p.height));
+}
+
+
+// Render one monitor's part and copy it into the composite image
+unsigned long WINAPI renderCompositePartThreadProc(void* data)
+{
+    CompositePart* part = (CompositePart*)data;
+    part->ok = false;
+
+    int width = part->rect.right - part->rect.left;
+    int height = part->rect.bottom - part->rect.top;
+
+    ImageDecoder decoder;
+    Bitmap* img = decoder.loadForArea(part->image, width + 2 * part->bezel, height + 2 * part->bezel, part->mode);
+    if (img == nullptr) {
+        return 0;
+    }
+    {
+        Bitmap bmp(width, height, PixelFormat32bppRGB);
+        {
+            Graphics g(&bmp);
+            g.Clear(Color(0, 0, 0));
+            g.SetInterpolationMode(InterpolationModeHighQualityBicubic);
+            g.SetPixelOffsetMode(PixelOffsetModeHalf);
+            drawImageInArea(g, img, width, height, part->mode, part->bezel, part->focusX, part->focusY);
+        }
+
+        BitmapData bits;
+        Rect all(0, 0, width, height);
+        if (bmp.LockBits(&all, ImageLockModeRead, PixelFormat32bppRGB, &bits) == Ok) {
+            // Parts never overlap - threads can write to the composite at the same time
+            for (int y = 0; y < height; y++) {
+                BYTE* src = (BYTE*)bits.Scan0 + y * bits.Stride;
+                BYTE* dst = (BYTE*)part->composite->Scan0 + (part->rect.top + y) * part->composite->Stride + part->rect.left * 4;
+                memcpy(dst, src, width * 4);
+            }
+            bmp.UnlockBits(&bits);
+            part->ok = true;
+        }
+    }
+    delete img;
+    return 0;
+}
+
+
+// Save the bitmap as high quality JPEG
+bool saveJpeg(Bitmap& bmp, const wchar_t* file)
+{
+    CLSID jpegClsid;
+    if (!getEncoderClsid(L"image/jpeg", &jpegClsid)) {
+        return false;
+    }
+    ULONG quality = 95;
+    EncoderParameters params;
+    params.Count = 1;
+    params.Parameter[0].Guid = EncoderQuality;
+    params.Parameter[0].Type = EncoderParameterValueTypeLong;
+    params.Parameter[0].NumberOfValues = 1;
+    params.Parameter[0].Value = &quality;
+    return bmp.Save(file, &jpegClsid, &params) == Ok;
+}
+
+
+// Focus point of a known image (centre if not known)
+void getImageFocus(const wchar_t* image, REAL& focusX, REAL& focusY)
+{
+    focusX = focusY = 0.5f;
+    auto info = file2dimensions.find(image);
+    if (info != file2dimensions.end() && (info->second.flags & IMAGE_HAS_FOCUS)) {
+        focusX = (REAL)info->second.focusX / FOCUS_MAX;
+        focusY = (REAL)info->second.focusY / FOCUS_MAX;
+    }
+}
+
+
+// Smart crop: cropped copies of images are kept in a folder in LocalAppData,
+// rendered once for each image and monitor size
+#define RENDER_CACHE_MAX_FILES          64
+// Aspect ratio mismatch (in 1/1000) below which the image is not worth cropping
+#define SMART_CROP_MIN_MISMATCH         5
+
+
+// Global (used by main thread only):
+// Replay renders elsewhere - so it doesn't overwrite or remove files the running instance uses
+bool replayRendering = false;
+
+
+wstring getRenderDir()
+{
+    return getAppDataPath(replayRendering ? L".replay.render" : L".render");
+}
+
+
+// Name of the cropped copy - depends on the image (including its version) and monitor size
+wstring croppedImagePath(const wchar_t* image, const RECT& rect)
+{
+    // FNV-1a
+    ULONGLONG hash = 14695981039346656037ULL;
+    for (const wchar_t* c = image; *c; c++) {
+        hash = (hash ^ *c) * 1099511628211ULL;
+    }
+    auto info = file2dimensions.find(image);
+    if (info != file2dimensions.end()) {
+        hash = (hash ^ info->second.mtime) * 1099511628211ULL;
+    }
+
+    wchar_t name[64];
+    swprintf_s(name, L"\\%016llx_%dx%d.jpg", hash, (int)(rect.right - rect.left), (int)(rect.bottom - rect.top));
+    return getRenderDir() + name;
+}
+
+
+// Is the aspect ratio of the image different enough from the monitor's to crop it ourselves
+bool needsCrop(const wchar_t* image, const RECT& rect)
+{
+    auto info = file2dimensions.find(image);
+    if (info == file2dimensions.end() || !(info->second.flags & IMAGE_HAS_FOCUS)) {
+        return false;
+    }
+    int w = info->second.width;
+    int h = info->second.height;
+    int ratio = 1000 * (rect.right - rect.left) / (rect.bottom - rect.top);
+    int mismatch = 1000 * (1000 * w / h - ratio) / ratio;
+    return mismatch > SMART_CROP_MIN_MISMATCH || mismatch < -SMART_CROP_MIN_MISMATCH;
+}
+
+
+// Render the image cropped around its focus point to exactly fill the monitor
+bool renderCroppedImage(const wchar_t* image, const RECT& rect, const wstring& outFile)
+{
+    int width = rect.right - rect.left;
+    int height = rect.bottom - rect.top;
+    REAL focusX, focusY;
+    getImageFocus(image, focusX, focusY);
+
+    CreateDirectory(getRenderDir().c_str(), NULL);
+    wstring temp = outFile + L".tmp";
+
+    GdiplusStartupInput gdiplusStartupInput;
+    ULONG_PTR gdiplusToken;
+    GdiplusStartup(&gdiplusToken, &gdiplusStartupInput, NULL);
+
+    bool ok = false;
+    ImageDecoder decoder;
+    Bitmap* img = decoder.loadForArea(image, width, height, DWPOS_FILL);
+    if (img != nullptr) {
+        Bitmap bmp(width, height, PixelFormat32bppRGB);
+        {
+            Graphics g(&bmp);
+            g.SetInterpolationMode(InterpolationModeHighQualityBicubic);
+            g.SetPixelOffsetMode(PixelOffsetModeHalf);
+            drawImageInArea(g, img, width, height, DWPOS_FILL, 0, focusX, focusY);
+        }
+        ok = saveJpeg(bmp, temp.c_str());
+        delete img;
+    }
+
+    GdiplusShutdown(gdiplusToken);
+
+    if (!ok || !MoveFileEx(temp.c_str(), outFile.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+        DeleteFile(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+// Remove cropped copies not used any more, if there are too many
+void trimRenderCache(const set<wstring>& inUse)
+{
+    DirListing listing;
+    wstring dir = getRenderDir();
+    if (!listing.read(dir.c_str(), L"*.jpg") || listing.count() <= RENDER_CACHE_MAX_FILES) {
+        return;
+    }
+    for (size_t i = 0; i < listing.count(); i++) {
+        wstring file = dir + L"\\" + listing.name(listing[i]);
+        if (inUse.find(file) == inUse.end()) {
+            DeleteFile(file.c_str());
+        }
+    }
+}
+
+
+// Render the composite image for all monitors and save it as JPEG file
+bool renderCompositeWallpaper(vector<CompositePart>& parts, int width, int height, const wchar_t* outFile)
+{
+    GdiplusStartupInput gdiplusStartupInput;
+    ULONG_PTR gdiplusToken;
+    GdiplusStartup(&gdiplusToken, &gdiplusStartupInput, NULL);
+
+    bool ok = false;
+    {
+        Bitmap composite(width, height, PixelFormat32bppRGB);
+        BitmapData bits;
+        Rect all(0, 0, width, height);
+        if (composite.LockBits(&all, ImageLockModeWrite, PixelFormat32bppRGB, &bits) == Ok) {
+            // Areas not covered by any monitor stay black
+            for (int y = 0; y < height; y++) {
+                memset((BYTE*)bits.Scan0 + y * bits.Stride, 0, width * 4);
+            }
+
+            vector<HANDLE> threads;
+            for (auto& part : parts) {
+                part.composite = &bits;
+                unsigned long threadId;
+                HANDLE thread = CreateThread(NULL, 0, renderCompositePartThreadProc, &part, 0, &threadId);
+                if (thread != NULL) {
+                    threads.push_back(thread);
+                }
+                else {
+                    renderCompositePartThreadProc(&part);
+                }
+            }
+            for (HANDLE thread : threads) {
+                WaitForSingleObject(thread, INFINITE);
+                CloseHandle(thread);
+            }
+            composite.UnlockBits(&bits);
+
+            ok = true;
+            for (auto const& part : parts) {
+                ok = ok && part.ok;
+            }
+        }
+
+        ok = ok && saveJpeg(composite, outFile);
+    }
+
+    GdiplusShutdown(gdiplusToken);
+    return ok;
+}
+
+#pragma endregion
+
+
+
+#pragma region "SETTING WALLPAPERS"
+
+// Global:
+// Calls to the desktop done and skipped since the program started (skipped - nothing would change)
+typedef struct {
+    int     wallpaperCalls;
+    int     wallpaperCallsAvoided;
+    int     positionCalls;
+    int     positionCallsAvoided;
+} WallpaperCallStats;
+
+WallpaperCallStats wallpaperCallStats = { 0 };
+
+// Monitors (IDs) whose wallpapers must not be changed
+set<wstring> pinnedMonitors;
+
+
+void tracePins()
+{
+    TraceRecord record(TracePins);
+    record.put((DWORD)pinnedMonitors.size());
+    for (const wstring& id : pinnedMonitors) {
+        record.put(id);
+    }
+    traceRecorder.write(record);
+}
+
+// When one composite image is used, the desktop reports the same file for all the monitors.
+// What is really displayed on each of them is remembered here (monitor ID -> image).
+map<wstring, wstring> compositeContent;
+// File with the composite image, changed every time (Explorer ignores the same path set again)
+int compositeFileIndex = 0;
+
+
+// What should be displayed on a monitor
+typedef struct {
+    wstring         id;
+    RECT            rect;
+    wstring         current;        // wallpaper set now
+    const wchar_t*  target;         // wallpaper to set, nullptr - leave as it is
+} MonitorPlan;
+
+
+// Render images planned for all monitors into one, and set it spanned across the desktop.
+// Nothing is done if all monitors already show what was planned.
+bool setCompositeWallpaper(WallpaperTarget& target, const vector<MonitorPlan>& plan, DESKTOP_WALLPAPER_POSITION mode)
+{
+    if (plan.empty()) {
+        return false;
+    }
+
+    bool changed = plan.size() != compositeContent.size();
+    for (auto const& mp : plan) {
+        const wchar_t* image = (mp.target != nullptr) ? mp.target : mp.current.c_str();
+        auto content = compositeContent.find(mp.id);
+        changed = changed || content == compositeContent.end() || content->second != image;
+    }
+    DESKTOP_WALLPAPER_POSITION currentPosition;
+    if (!changed && target.getPosition(currentPosition) && currentPosition == DWPOS_SPAN) {
+        wallpaperCallStats.wallpaperCallsAvoided++;
+        return true;
+    }
+
+    // Virtual desktop - rectangle containing all monitors
+    RECT desktop = { 0 };
+    bool first = true;
+    for (auto const& mp : plan) {
+        if (first || mp.rect.left < desktop.left) desktop.left = mp.rect.left;
+        if (first || mp.rect.top < desktop.top) desktop.top = mp.rect.top;
+        if (first || mp.rect.right > desktop.right) desktop.right = mp.rect.right;
+        if (first || mp.rect.bottom > desktop.bottom) desktop.bottom = mp.rect.bottom;
+        first = false;
+    }
+
+    vector<CompositePart> parts;
+    for (auto const& mp : plan) {
+        CompositePart part;
+        part.image = (mp.target != nullptr) ? mp.target : mp.current.c_str();
+        if (*part.image == L'\0') {
+            // Nothing to display on this monitor
+            continue;
+        }
+        part.rect.left = mp.rect.left - desktop.left;
+        part.rect.top = mp.rect.top - desktop.top;
+        part.rect.right = mp.rect.right - desktop.left;
+        part.rect.bottom = mp.rect.bottom - desktop.top;
+        part.mode = mode;
+        part.bezel = SETTINGS->BezelCompensation;
+        getImageFocus(part.image, part.focusX, part.focusY);
+        parts.push_back(part);
+    }
+
+    compositeFileIndex = 1 - compositeFileIndex;
+    wstring file = getAppDataPath(compositeFileIndex ? L".span1.jpg" : L".span0.jpg");
+    if (replayRendering) {
+        CreateDirectory(getRenderDir().c_str(), NULL);
+        file = getRenderDir() + (compositeFileIndex ? L"\\span1.jpg" : L"\\span0.jpg");
+    }
+    if (!renderCompositeWallpaper(parts, desktop.right - desktop.left, desktop.bottom - desktop.top, file.c_str())) {
+        LOG << L"Rendering composite wallpaper failed";
+        return false;
+    }
+
+    if (!target.getPosition(currentPosition) || currentPosition != DWPOS_SPAN) {
+        target.setPosition(DWPOS_SPAN);
+        wallpaperCallStats.positionCalls++;
+    }
+    target.setWallpaper(L"", file.c_str());
+    wallpaperCallStats.wallpaperCalls++;
+
+    compositeContent.clear();
+    for (auto const& mp : plan) {
+        compositeContent[mp.id] = (mp.target != nullptr) ? mp.target : mp.current.c_str();
+    }
+    return true;
+}
+
+
+// Images considered similar to the first monitor's one with "similar looking images" policy
+#define SIMILAR_POOL_SIZE               5
+
+
+// After dark prefer dark images. Marks images matching the rule, returns false if the rule is off.
+bool findDarkImages(vector<bool>& dark)
+{
+    int from = SETTINGS->DarkFromHour;
+    int to = SETTINGS->DarkToHour;
+    SYSTEMTIME now;
+    GetLocalTime(&now);
+    bool night = (from <= to) ? (now.wHour >= from && now.wHour < to) : (now.wHour >= from || now.wHour < to);
+    if (from < 0 || !night) {
+        return false;
+    }
+    featureTable.filter(FEATURE_LUMINANCE, 0, SETTINGS->DarkMaxLuminance, dark);
+    return true;
+}
+
+
+// Leave only images marked by a rule - unless none of them is marked
+void keepMarked(set<const wchar_t*>& images, const vector<bool>& marked)
+{
+    set<const wchar_t*> result;
+    for (auto img : images) {
+        int i = featureTable.indexOf(img);
+        if (i >= 0 && marked[i]) {
+            result.insert(img);
+        }
+    }
+    if (!result.empty()) {
+        images.swap(result);
+    }
+}
+
+
+// Leave only a few images looking most like the given one
+void keepMostSimilar(set<const wchar_t*>& images, const wchar_t* like)
+{
+    int likeIndex = featureTable.indexOf(like);
+    if (likeIndex < 0) {
+        return;
+    }
+    vector<int> distances;
+    featureTable.distances(featureTable.get(likeIndex), distances);
+
+    vector<pair<int, const wchar_t*>> ranked;
+    for (auto img : images) {
+        int i = featureTable.indexOf(img);
+        if (i >= 0) {
+            ranked.push_back(make_pair(distances[i], img));
+        }
+    }
+    if (ranked.size() <= SIMILAR_POOL_SIZE) {
+        return;
+    }
+    partial_sort(ranked.begin(), ranked.begin() + SIMILAR_POOL_SIZE, ranked.end());
+    images.clear();
+    for (int i = 0; i < SIMILAR_POOL_SIZE; i++) {
+        images.insert(ranked[i].second);
+    }
+}
+
+
+// If there are near duplicates of the chosen image among candidates, take the sharpest of them
+const wchar_t* sharpestDuplicate(const set<const wchar_t*>& images, const wchar_t* chosen)
+{
+    int maxDistance = SETTINGS->NearDuplicateDistance;
+    int chosenIndex = featureTable.indexOf(chosen);
+    if (maxDistance <= 0 || chosenIndex < 0) {
+        return chosen;
+    }
+    vector<int> distances;
+    featureTable.distances(featureTable.get(chosenIndex), distances);
+
+    const wchar_t* best = chosen;
+    int bestSharpness = featureTable.get(chosenIndex)[FEATURE_SHARPNESS];
+    for (auto img : images) {
+        int i = featureTable.indexOf(img);
+        if (i >= 0 && distances[i] <= maxDistance && featureTable.get(i)[FEATURE_SHARPNESS] > bestSharpness) {
+            best = img;
+            bestSharpness = featureTable.get(i)[FEATURE_SHARPNESS];
+        }
+    }
+    return best;
+}
+
+
+// Allowed difference of aspect ratios of images and monitors (in 1/1000).
+// With smart crop images are not cut in the middle, so aspect ratios may differ more.
+int getAllowedMismatch()
+{
+    int allowedMismatch = SETTINGS->AllowedAspectRatioMismatch;
+    if (SETTINGS->SmartCrop && SETTINGS->DisplayMode == DWPOS_FILL && allowedMismatch < SETTINGS->SmartCropMismatch) {
+        allowedMismatch = SETTINGS->SmartCropMismatch;
+    }
+    return allowedMismatch;
+}
+
+
+// Images that can be displayed on the monitor: allowed by the filter (and dark if they are preferred),
+// big enough and of the right shape - or, if there are none, those that fit best
+void findProperImages(const RECT& rect, bool allowUpscaling, int allowedMismatch, const vector<bool>& allowed,
+    const vector<bool>* darkImages, set<const WCHAR*>& properImages)
+{
+    int ratio = 1000 * (rect.right - rect.left) / (rect.bottom - rect.top);
+    size_t index = 0;
+    for (auto const& f2d : file2dimensions)
+    {
+        if (!allowed[index++]) {
+            continue;
+        }
+        int w = f2d.second.width;
+        int h = f2d.second.height;
+
+        if (!allowUpscaling) {
+            if ((w < rect.right - rect.left) || (h < rect.bottom - rect.top)) {
+                continue;
+            }
+        }
+
+        int fileRatio = 1000 * w / h;
+        int mismatch = 1000 * (fileRatio - ratio) / ratio;
+        if (mismatch < 0) {
+            mismatch = -mismatch;
+        }
+        if (mismatch < allowedMismatch) {
+            properImages.insert(f2d.first.c_str());
+        }
+    }
+    if (darkImages != nullptr) {
+        keepMarked(properImages, *darkImages);
+    }
+    if (properImages.empty()) {
+        // Nothing within the tolerance - better the closest images than a stale wallpaper
+        shapeIndex.update();
+        shapeIndex.nearest(rect.right - rect.left, rect.bottom - rect.top, allowed, NEAREST_FIT_COUNT, properImages);
+    }
+}
+
+
+// Images that can be displayed on the monitor - as they would be chosen from now
+void findCandidates(const RECT& rect, set<const WCHAR*>& images)
+{
+    restoreCatalog();
+    const vector<bool>& allowed = catalogFilter.apply();
+    featureTable.update();
+    vector<bool> darkImages;
+    bool preferDark = findDarkImages(darkImages);
+    findProperImages(rect, SETTINGS->AllowUpscaling, getAllowedMismatch(), allowed, preferDark ? &darkImages : nullptr, images);
+}
+
+
+// Random image: first the source is chosen according to weights of sources that have some
+// of the images, then an image from it. Images not from a folder (feed) are a source of weight 1.
+// Images of the source are taken in the order of their names (not of their addresses), so the same
+// random numbers choose the same images in every run.
+const wchar_t* pickWeighted(const set<const wchar_t*>& images)
+{
+    map<wstring, vector<const wchar_t*>> bySource;
+    for (const wchar_t* img : images) {
+        const wchar_t* name = wcsrchr(img, L'\\');
+        bySource[wstring(img, name != nullptr ? name - img : 0)].push_back(img);
+    }
+
+    vector<int> weights;
+    int total = 0;
+    for (auto const& source : bySource) {
+        auto configured = imageSources.find(source.first);
+        int weight = (configured != imageSources.end()) ? configured->second : 1;
+        weights.push_back(weight);
+        total += weight;
+    }
+
+    int r = rand() % total;
+    auto source = bySource.begin();
+    for (int weight : weights) {
+        if (r < weight) {
+            break;
+        }
+        r -= weight;
+        ++source;
+    }
+    vector<const wchar_t*>& sourceImages = source->second;
+    sort(sourceImages.begin(), sourceImages.end(), [](const wchar_t* a, const wchar_t* b) { return wcscmp(a, b) < 0; });
+    return sourceImages[rand() % sourceImages.size()];
+}
+
+
+// Set best wallpapers for currently attached monitors
+// If change parameter is true the function will try not to use currently set wallpapers
+// (only on the given monitor if it's not -1). Pinned monitors are left as they are.
+// If images are given (by monitor id - like from the history) only they are set, nothing is chosen.
+// First the desired state of all monitors is computed, then only differences are applied.
+bool setWallpapers(WallpaperTarget& target, bool change, int onlyMonitor = -1,
+    const map<wstring, const wchar_t*>* chosen = nullptr)
+{
+    restoreCatalog();
+    bool allowUpscaling = SETTINGS->AllowUpscaling;
+    int allowedMismatch = getAllowedMismatch();
+    MultiMonImage multiMonMode = (MultiMonImage)SETTINGS->MultiMonPolicy;
+    bool composite = SETTINGS->SpanComposite;
+    DESKTOP_WALLPAPER_POSITION position = (DESKTOP_WALLPAPER_POSITION)SETTINGS->DisplayMode;
+
+    // Composite wallpaper uses focus points when it is rendered, separate wallpapers need cropped copies.
+    bool smartCrop = SETTINGS->SmartCrop && position == DWPOS_FILL;
+    bool cropCopies = smartCrop && !composite;
+    wstring renderDir = getRenderDir();
+
+    vector<MonitorPlan> plan;
+    set<const wchar_t*> used;
+    const wchar_t* firstUsed = nullptr;
+
+    // Images allowed by the filter, rules based on image features
+    LONGLONG selectionStart = MetricTimer::now();
+    metricCatalogSize.set(file2dimensions.size());
+    const vector<bool>& allowed = catalogFilter.apply();
+    featureTable.update();
+    vector<bool> darkImages;
+    bool preferDark = findDarkImages(darkImages);
+
+    UINT nMonitors = target.getMonitorCount();
+    for (UINT monitor = 0; monitor < nMonitors; monitor++)
+    {
+        MonitorPlan mp;
+        if (!target.getMonitor(monitor, mp.id, mp.rect)) {
+            continue;
+        }
+        if (composite) {
+            auto content = compositeContent.find(mp.id);
+            if (content != compositeContent.end()) {
+                mp.current = content->second;
+            }
+        }
+        else {
+            target.getWallpaper(mp.id, mp.current);
+        }
+        mp.target = nullptr;
+        if (pinnedMonitors.find(mp.id) != pinnedMonitors.end()) {
+            plan.push_back(mp);
+            continue;
+        }
+        if (chosen != nullptr) {
+            auto image = chosen->find(mp.id);
+            if (image != chosen->end()) {
+                mp.target = image->second;
+            }
+            plan.push_back(mp);
+            continue;
+        }
+        bool changeThis = change && (onlyMonitor < 0 || onlyMonitor == (int)monitor);
+        bool currentIsCopy = cropCopies && mp.current.compare(0, renderDir.length(), renderDir) == 0;
+
+        RECT& rect = mp.rect;
+        set<const WCHAR*> properImages;
+        findProperImages(rect, allowUpscaling, allowedMismatch, allowed, preferDark ? &darkImages : nullptr, properImages);
+        metricCandidates.record(properImages.size());
+
+        if (properImages.size() == 1) {
+            // Only one good image found - just set it
+            mp.target = *properImages.begin();
+        }
+        else if (properImages.size() > 1) {
+            // More than one matching options, choose right image depending on 'change' parameter
+            bool currentFound = false;
+            for (auto it = properImages.begin(); it != properImages.end(); ++it) {
+                if (mp.current == *it || (currentIsCopy && mp.current == croppedImagePath(*it, rect))) {
+                    currentFound = true;
+                    if (!changeThis) {
+                        mp.target = *it;
+                    }
+                    properImages.erase(it);
+                    break;
+                }
+            }
+            if (!changeThis && currentFound) {
+                // The function was requested not to change Wallpaper and we found out, that
+                // curently set wallpaper is present in the images set - no action required
+            }
+            else {
+                // Multiple matching images available
+                if (multiMonMode == MultiMonImage::Different) {
+                    // If prefference is to use different images on each
+                    // screen remove from the pool already used ones
+                    for (const auto & img : used) {
+                        properImages.erase(img);
+                    }
+                    // ...but make sure something has left
+                    if (properImages.size() == 0) {
+                        properImages = used;
+                    }
+                }
+                else if (multiMonMode == MultiMonImage::Same) {
+                    // If prefference is to use the same image check if there is an intersection
+                    // in sets of proper images and already used ones
+                    set<const wchar_t*> usedAndProper;
+                    for (const auto & img : used) {
+                        if (properImages.find(img) != properImages.end()) {
+                            usedAndProper.insert(img);
+                        }
+                    }
+                    if (usedAndProper.size() > 0) {
+                        // Some of the used images are proper - so use them
+                        properImages = usedAndProper;
+                    }
+                }
+                else if (multiMonMode == MultiMonImage::Similar && firstUsed != nullptr) {
+                    // Keep the looks consistent - choose from images most similar to the one already used
+                    for (const auto & img : used) {
+                        properImages.erase(img);
+                    }
+                    if (properImages.size() == 0) {
+                        properImages = used;
+                    }
+                    keepMostSimilar(properImages, firstUsed);
+                }
+
+                // Choose random image from available pool - sources with higher weight more often
+                mp.target = sharpestDuplicate(properImages, pickWeighted(properImages));
+            }
+        }
+        else {
+            // No images at all (or none allowed by the filter) - log error
+            LOG << L"No suitable images for monitor " << mp.id.c_str();
+        }
+
+        if (mp.target != nullptr) {
+            used.insert(mp.target);
+            if (firstUsed == nullptr) {
+                firstUsed = mp.target;
+            }
+        }
+        plan.push_back(mp);
+    }
+    metricSelectionTime.record(MetricTimer::microsSince(selectionStart));
+
+    // Remember what is shown - so it can be brought back later (and kept in the feed's cache)
+    set<ULONGLONG> shown;
+    for (auto const& mp : plan) {
+        if (mp.target != nullptr) {
+            wallpaperHistory.record(mp.id, mp.target);
+        }
+        shown.insert(hashPath(mp.target != nullptr ? mp.target : mp.current.c_str()));
+    }
+    wallpaperHistory.getCurrent(shown);
+    protectFeedImages(shown);
+
+    if (composite) {
+        return setCompositeWallpaper(target, plan, position);
+    }
+    compositeContent.clear();
+
+    // Apply the differences
+    set<wstring> cropped;
+    for (auto const& mp : plan) {
+        if (mp.target == nullptr) {
+            wallpaperCallStats.wallpaperCallsAvoided++;
+            continue;
+        }
+        wstring file(mp.target);
+        if (cropCopies && needsCrop(mp.target, mp.rect)) {
+            wstring copy = croppedImagePath(mp.target, mp.rect);
+            if (GetFileAttributes(copy.c_str()) != INVALID_FILE_ATTRIBUTES || renderCroppedImage(mp.target, mp.rect, copy)) {
+                file = copy;
+                cropped.insert(copy);
+            }
+        }
+        if (mp.current == file) {
+            wallpaperCallStats.wallpaperCallsAvoided++;
+            continue;
+        }
+        target.setWallpaper(mp.id, file.c_str());
+        wallpaperCallStats.wallpaperCalls++;
+    }
+    if (cropCopies) {
+        trimRenderCache(cropped);
+    }
+
+    DESKTOP_WALLPAPER_POSITION currentPosition;
+    if (target.getPosition(currentPosition) && currentPosition == position) {
+        wallpaperCallStats.positionCallsAvoided++;
+    }
+    else {
+        target.setPosition(position);
+        wallpaperCallStats.positionCalls++;
+    }
+
+    return true;
+}
+
+
+// Record monitor layout (if it changed since the last time) and the request to set wallpapers
+void traceSetWallpapers(WallpaperTarget& target, bool change, int monitor)
+{
+    TraceRecord layout(TraceMonitors);
+    UINT nMonitors = target.getMonitorCount();
+    layout.put(nMonitors);
+    for (UINT i = 0; i < nMonitors; i++) {
+        wstring id;
+        RECT rect = { 0 };
+        target.getMonitor(i, id, rect);
+        layout.put(&rect, sizeof(rect));
+        layout.put(id);
+    }
+    traceRecorder.writeState(layout);
+
+    TraceRecord record(TraceSetWallpapers);
+    record.put((DWORD)change);
+    record.put((DWORD)monitor);
+    traceRecorder.write(record);
+}
+
+
+// Set wallpapers on Windows desktop
+bool setDesktopWallpapers(DesktopWallpaperTarget& desktop, bool change, int monitor)
+{
+    LOG << L"setWallpapers()";
+
+    if (!desktop.isValid()) {
+        return false;
+    }
+    if (traceRecorder.isOpen()) {
+        traceSetWallpapers(desktop, change, monitor);
+    }
+    bool res = setWallpapers(desktop, change, monitor);
+    saveHistory();
+
+    LOG << L"Desktop calls done / avoided:" << wallpaperCallStats.wallpaperCalls + wallpaperCallStats.positionCalls
+        << wallpaperCallStats.wallpaperCallsAvoided + wallpaperCallStats.positionCallsAvoided;
+
+    return res;
+}
+
+
+bool setWallpapers(bool change, int monitor)
+{
+    DesktopWallpaperTarget desktop;
+    return setDesktopWallpapers(desktop, change, monitor);
+}
+
+
+// Change wallpapers on user's request (on all monitors or on the given one)
+bool changeWallpapers(HWND window, DesktopWallpaperTarget& desktop, int monitor = -1)
+{
+    bool res = setDesktopWallpapers(desktop, true, monitor);
+    // If periodic change of wallpapers is configured schedule (postpone) the next update
+    scheduleWallpaperChange(window);
+    return res;
+}
+
+
+bool changeWallpapers(HWND window, int monitor = -1)
+{
+    DesktopWallpaperTarget desktop;
+    return changeWallpapers(window, desktop, monitor);
+}
+
+
+// Bring back the previous wallpaper from the history (or the next one, after going back) - on all
+// monitors or on the given one. Nothing is chosen, so it is fast. False if there is nowhere to go.
+bool showFromHistory(HWND window, DesktopWallpaperTarget& desktop, int monitor, bool back)
+{
+    restoreCatalog();
+    if (!desktop.isValid()) {
+        return false;
+    }
+    map<wstring, const wchar_t*> chosen;
+    UINT nMonitors = desktop.getMonitorCount();
+    for (UINT i = 0; i < nMonitors; i++) {
+        wstring id;
+        RECT rect;
+        if ((monitor < 0 || (UINT)monitor == i) && desktop.getMonitor(i, id, rect)
+                && pinnedMonitors.find(id) == pinnedMonitors.end()) {
+            const wchar_t* image = wallpaperHistory.move(id, back);
+            if (image != nullptr) {
+                chosen[id] = image;
+            }
+        }
+    }
+    if (chosen.empty()) {
+        return false;
+    }
+    bool res = setWallpapers(desktop, false, -1, &chosen);
+    saveHistory();
+    scheduleWallpaperChange(window);
+    return res;
+}
+
+
+bool showFromHistory(HWND window, int monitor, bool back)
+{
+    DesktopWallpaperTarget desktop;
+    return showFromHistory(window, desktop, monitor, back);
+}
+
+#pragma endregion
+
+
+
+#pragma region "SCHEDULE"
+
+// When wallpapers are changed automatically: at times of AutoChangeSchedule (see wallcore.h), if given.
+// Without it the change comes AutoChangeInterval minutes after the previous one (manual changes postpone it).
+// There is just one timer, for the next change - Windows may delay it a little to coalesce wake-ups.
+// Long waits are split, so a change of the clock is noticed; after sleep missed changes are done once.
+#define SCHEDULE_TOLERANCE              2000
+#define SCHEDULE_MAX_WAIT               (60 * ONE_MINUTE_MILLIS)
+#define FILETIME_MINUTE                 600000000ULL
+
+// Global (used by main thread only):
+// When wallpapers are to be changed next time (UTC), 0 - not at all
+ULONGLONG scheduledChange = 0;
+
+
+ULONGLONG getUtcTime()
+{
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    return ((ULONGLONG)now.dwHighDateTime << 32) | now.dwLowDateTime;
+}
+
+
+// Local time (with daylight saving as it is on that day) in minutes since 1601 - and back
+ULONGLONG utcToLocalMinutes(ULONGLONG utc)
+{
+    FILETIME ft = { (DWORD)utc, (DWORD)(utc >> 32) };
+    SYSTEMTIME st;
+    SYSTEMTIME local;
+    FileTimeToSystemTime(&ft, &st);
+    SystemTimeToTzSpecificLocalTime(NULL, &st, &local);
+    SystemTimeToFileTime(&local, &ft);
+    return (((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime) / FILETIME_MINUTE;
+}
+
+
+ULONGLONG localMinutesToUtc(ULONGLONG minutes)
+{
+    ULONGLONG time = minutes * FILETIME_MINUTE;
+    FILETIME ft = { (DWORD)time, (DWORD)(time >> 32) };
+    SYSTEMTIME local;
+    SYSTEMTIME st;
+    FileTimeToSystemTime(&ft, &local);
+    TzSpecificLocalTimeToSystemTime(NULL, &local, &st);
+    SystemTimeToFileTime(&st, &ft);
+    return ((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+}
+
+
+// The first time of the schedule later than the given one (in the next minute at the earliest)
+ULONGLONG getNextScheduledTime(const Schedule& schedule, ULONGLONG after)
+{
+    ULONGLONG next = getNextScheduledMinute(schedule, utcToLocalMinutes(after));
+    return (next != 0) ? localMinutesToUtc(next) : 0;
+}
+
+
+// Set the timer for the next change - not longer than SCHEDULE_MAX_WAIT
+void armScheduleTimer(HWND window)
+{
+    if (scheduledChange == 0) {
+        KillTimer(window, EVENT_SET_WALLPAPER_SCHEDULED);
+        return;
+    }
+    ULONGLONG now = getUtcTime();
+    ULONGLONG delay = (scheduledChange > now) ? (scheduledChange - now) / 10000 : 0;
+    if (delay > SCHEDULE_MAX_WAIT) {
+        delay = SCHEDULE_MAX_WAIT;
+    }
+    SetCoalescableTimer(window, EVENT_SET_WALLPAPER_SCHEDULED, (UINT)delay, NULL, SCHEDULE_TOLERANCE);
+}
+
+
+// Plan the next automatic change - after the given time (UTC), or after now
+void scheduleWallpaperChange(HWND window, ULONGLONG after)
+{
+    if (after == 0) {
+        after = getUtcTime();
+    }
+    Schedule schedule;
+    if (!SETTINGS->AutoChangeImage) {
+        scheduledChange = 0;
+    }
+    else if (parseSchedule(SETTINGS->AutoChangeSchedule, schedule)) {
+        scheduledChange = getNextScheduledTime(schedule, after);
+    }
+    else {
+        if (!SETTINGS->AutoChangeSchedule.empty()) {
+            LOG << L"Invalid AutoChangeSchedule - using AutoChangeInterval";
+        }
+        scheduledChange = after + (ULONGLONG)max(1, SETTINGS->AutoChangeInterval) * FILETIME_MINUTE;
+    }
+    armScheduleTimer(window);
+}
+
+
+// Timer went off, the computer resumed from sleep or the clock was changed: change wallpapers
+// if it's time (once, however many changes were missed) - otherwise just wait again
+void onScheduleTimer(HWND window)
+{
+    if (scheduledChange == 0) {
+        KillTimer(window, EVENT_SET_WALLPAPER_SCHEDULED);
+        return;
+    }
+    ULONGLONG now = getUtcTime();
+    if (now + SCHEDULE_TOLERANCE * 10000ULL < scheduledChange) {
+        armScheduleTimer(window);
+        return;
+    }
+    setWallpapers(true);
+    scheduleWallpaperChange(window, max(now, scheduledChange));
+}
+
+#pragma endregion
+
+
+
+#pragma region "CONTROL CHANNEL"
+
+// Other programs (hotkey tools, scripts, another instance of this one) control the running
+// instance through a named pipe, local to the user's session. The protocol is text: one command
+// per line, one reply line for each ("ok ..." or "error ..."), in order. A client may send many
+// commands without waiting for the replies, and stay connected. Commands:
+//   next [monitor]     change wallpapers (on all monitors or on the one with given index, from 0)
+//   rescan             read the folders with images again
+//   pin [monitor]      keep the current wallpaper (of all monitors or the given one)
+//   unpin [monitor]    allow changing it again
+//   back [monitor]     previous wallpaper from the history
+//   forward [monitor]  next one in the history (after going back)
+//   stats              metrics as JSON (on one line)
+//   candidates monitor images that can be displayed on the monitor: their number, then
+//                      for each of them "|slot path" (slot of its thumbnail, -1 if there is none yet)
+//   thumbs             path of the thumbnail atlas file
+// One client is served at a time, others wait in the pipe's queue. A new instance of the pipe is created
+// before a client is served, so the pipe never disappears between clients.
+#define CONTROL_INSTANCES               2
+#define CONTROL_BUFFER_SIZE             4096
+#define CONTROL_MAX_LINE                1024
+#define CONTROL_RETRY_DELAY             5000
+#define CONTROL_CONNECT_TIMEOUT         2000
+
+// Commands read in one go - executed by the main thread, all at once
+typedef struct {
+    vector<string>  commands;
+    string          replies;
+} ControlBatch;
+
+typedef struct {
+    HWND            window;
+    HANDLE          stopEvent;
+    HANDLE          thread;
+} ControlChannel;
+
+// Global (used by main thread only):
+ControlChannel controlChannel = { 0 };
+
+
+wstring getControlPipeName()
+{
+    DWORD session = 0;
+    ProcessIdToSessionId(GetCurrentProcessId(), &session);
+    wstring name(L"\\\\.\\pipe\\");
+    name += APP_NAME;
+    name += L"-";
+    name += to_wstring(session);
+    return name;
+}
+
+
+// Wait until the pending operation on the pipe completes - false if it failed, or the channel is stopped
+bool waitForPipe(HANDLE pipe, OVERLAPPED& overlapped, HANDLE stopEvent, DWORD& bytes)
+{
+    HANDLE waitHandles[2] = { stopEvent, overlapped.hEvent };
+    if (WaitForMultipleObjects(2, waitHandles, FALSE, INFINITE) != WAIT_OBJECT_0 + 1) {
+        CancelIoEx(pipe, &overlapped);
+        GetOverlappedResult(pipe, &overlapped, &bytes, TRUE);
+        return false;
+    }
+    return GetOverlappedResult(pipe, &overlapped, &bytes, FALSE) != FALSE;
+}
+
+
+// Read commands from the connected client and write the replies until it disconnects
+void serveControlClient(ControlChannel* channel, HANDLE pipe, OVERLAPPED& overlapped)
+{
+    char buffer[CONTROL_BUFFER_SIZE];
+    string pending;
+    for (;;) {
+        DWORD bytes = 0;
+        if (!ReadFile(pipe, buffer, sizeof(buffer), NULL, &overlapped) && GetLastError() != ERROR_IO_PENDING) {
+            return;
+        }
+        if (!waitForPipe(pipe, overlapped, channel->stopEvent, bytes) || bytes == 0) {
+            return;
+        }
+        pending.append(buffer, bytes);
+
+        ControlBatch batch;
+        size_t end;
+        while ((end = pending.find('\n')) != string::npos) {
+            size_t length = (end > 0 && pending[end - 1] == '\r') ? end - 1 : end;
+            batch.commands.push_back(pending.substr(0, length));
+            pending.erase(0, end + 1);
+        }
+        if (pending.length() > CONTROL_MAX_LINE) {
+            // Not a client that speaks the protocol
+            return;
+        }
+        if (batch.commands.empty()) {
+            continue;
+        }
+
+        // Main thread does the job - all the complete commands in one message, and one write for the replies
+        SendMessage(channel->window, MY_MSG_CONTROL_COMMANDS, 0, (LPARAM)&batch);
+        if (!WriteFile(pipe, batch.replies.data(), (DWORD)batch.replies.length(), NULL, &overlapped)
+                && GetLastError() != ERROR_IO_PENDING) {
+            return;
+        }
+        if (!waitForPipe(pipe, overlapped, channel->stopEvent, bytes) || bytes != batch.replies.length()) {
+            return;
+        }
+    }
+}
+
+
+// Instance of the pipe for the next client. The first one only if there is no other - nobody else
+// can pretend to be this program.
+HANDLE createControlPipe(const wstring& name, bool first)
+{
+    return CreateNamedPipe(name.c_str(), PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | (first ? FILE_FLAG_FIRST_PIPE_INSTANCE : 0),
+        PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS, CONTROL_INSTANCES,
+        CONTROL_BUFFER_SIZE, CONTROL_BUFFER_SIZE, 0, NULL);
+}
+
+
+unsigned long WINAPI controlThreadProc(void* data)
+{
+    ControlChannel* channel = (ControlChannel*)data;
+    wstring name = getControlPipeName();
+    OVERLAPPED overlapped = { 0 };
+    overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+    HANDLE pipe = INVALID_HANDLE_VALUE;
+    while (WaitForSingleObject(channel->stopEvent, 0) != WAIT_OBJECT_0) {
+        if (pipe == INVALID_HANDLE_VALUE) {
+            pipe = createControlPipe(name, true);
+            if (pipe == INVALID_HANDLE_VALUE) {
+                WaitForSingleObject(channel->stopEvent, CONTROL_RETRY_DELAY);
+                continue;
+            }
+        }
+
+        DWORD bytes;
+        bool connected = ConnectNamedPipe(pipe, &overlapped) != FALSE;
+        if (!connected) {
+            DWORD error = GetLastError();
+            connected = error == ERROR_PIPE_CONNECTED
+                || (error == ERROR_IO_PENDING && waitForPipe(pipe, overlapped, channel->stopEvent, bytes));
+        }
+        // Clients coming meanwhile connect to the next instance and wait there
+        HANDLE next = connected ? createControlPipe(name, false) : INVALID_HANDLE_VALUE;
+        if (connected) {
+            serveControlClient(channel, pipe, overlapped);
+        }
+        DisconnectNamedPipe(pipe);
+        CloseHandle(pipe);
+        pipe = next;
+    }
+    if (pipe != INVALID_HANDLE_VALUE) {
+        CloseHandle(pipe);
+    }
+
+    CloseHandle(overlapped.hEvent);
+    return 0;
+}
+
+
+string toUtf8(const wstring& text)
+{
+    int length = WideCharToMultiByte(CP_UTF8, 0, text.c_str(), (int)text.length(), NULL, 0, NULL, NULL);
+    string utf8(length, '\0');
+    WideCharToMultiByte(CP_UTF8, 0, text.c_str(), (int)text.length(), &utf8[0], length, NULL, NULL);
+    return utf8;
+}
+
+
+// Monitor given as command's argument: index, or -1 if there is none. False if it's not a valid one.
+bool parseMonitorArgument(DesktopWallpaperTarget& desktop, const string& argument, int& monitor)
+{
+    monitor = -1;
+    if (argument.empty()) {
+        return true;
+    }
+    if (argument.find_first_not_of("0123456789") != string::npos || argument.length() > 3) {
+        return false;
+    }
+    monitor = atoi(argument.c_str());
+    return desktop.isValid() && (UINT)monitor < desktop.getMonitorCount();
+}
+
+
+// Pin or unpin wallpapers of all the monitors, or the given one
+void pinMonitors(DesktopWallpaperTarget& desktop, int monitor, bool pin)
+{
+    if (!desktop.isValid()) {
+        return;
+    }
+    UINT nMonitors = desktop.getMonitorCount();
+    for (UINT i = 0; i < nMonitors; i++) {
+        wstring id;
+        RECT rect;
+        if ((monitor < 0 || (UINT)monitor == i) && desktop.getMonitor(i, id, rect)) {
+            if (pin) {
+                pinnedMonitors.insert(id);
+            }
+            else {
+                pinnedMonitors.erase(id);
+            }
+        }
+    }
+    if (traceRecorder.isOpen()) {
+        tracePins();
+    }
+}
+
+
+string executeControlCommand(HWND window, DesktopWallpaperTarget& desktop, const string& line)
+{
+    size_t space = line.find(' ');
+    string command = line.substr(0, space);
+    string argument = (space == string::npos) ? "" : line.substr(space + 1);
+    int monitor;
+
+    if (command == "next" || command == "pin" || command == "unpin" || command == "back" || command == "forward") {
+        if (!parseMonitorArgument(desktop, argument, monitor)) {
+            return "error no such monitor";
+        }
+        if (command == "next") {
+            return changeWallpapers(window, desktop, monitor) ? "ok" : "error desktop not available";
+        }
+        if (command == "back" || command == "forward") {
+            return showFromHistory(window, desktop, monitor, command == "back") ? "ok" : "error nothing in history";
+        }
+        pinMonitors(desktop, monitor, command == "pin");
+        return "ok";
+    }
+    if (command == "rescan" && argument.empty()) {
+        readWallpapers(window);
+        return "ok";
+    }
+    if (command == "candidates") {
+        if (!parseMonitorArgument(desktop, argument, monitor) || monitor < 0) {
+            return "error no such monitor";
+        }
+        wstring id;
+        RECT rect;
+        if (!desktop.getMonitor(monitor, id, rect)) {
+            return "error desktop not available";
+        }
+        set<const WCHAR*> images;
+        findCandidates(rect, images);
+
+        string reply = "ok " + to_string(images.size());
+        for (const WCHAR* image : images) {
+            reply += "|" + to_string(thumbnailAtlas.find(image)) + " " + toUtf8(image);
+        }
+        return reply;
+    }
+    if (command == "thumbs" && argument.empty()) {
+        return "ok " + toUtf8(thumbnailAtlas.getFile());
+    }
+    if (command == "stats" && argument.empty()) {
+        ostringstream json;
+        Metric::writeAll(json, false);
+        string reply = "ok " + json.str();
+        replace(reply.begin(), reply.end(), '\n', ' ');
+        return reply;
+    }
+    return "error unknown command";
+}
+
+
+void onControlCommands(HWND window, ControlBatch* batch)
+{
+    bool stopping = WaitForSingleObject(controlChannel.stopEvent, 0) == WAIT_OBJECT_0;
+    // One connection to the desktop for all the commands
+    DesktopWallpaperTarget desktop;
+    for (const string& command : batch->commands) {
+        batch->replies += stopping ? "error stopping" : executeControlCommand(window, desktop, command);
+        batch->replies += "\n";
+    }
+}
+
+
+void manageControlChannel(HWND window, bool start = true)
+{
+    if (controlChannel.thread != NULL) {
+        SetEvent(controlChannel.stopEvent);
+        // The thread may be waiting for the main thread to execute commands - keep handling them
+        while (MsgWaitForMultipleObjects(1, &controlChannel.thread, FALSE, INFINITE, QS_SENDMESSAGE) == WAIT_OBJECT_0 + 1) {
+            MSG msg;
+            PeekMessage(&msg, NULL, 0, 0, PM_NOREMOVE);
+        }
+        CloseHandle(controlChannel.thread);
+        CloseHandle(controlChannel.stopEvent);
+        controlChannel.thread = NULL;
+    }
+    if (!start) {
         return;
     }
+    controlChannel.window = window;
+    controlChannel.stopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    unsigned long threadId;
+    controlChannel.thread = CreateThread(NULL, 0, controlThreadProc, &controlChannel, 0, &threadId);
+    if (controlChannel.thread == NULL) {
+        LOG << L"Creating thread for control channel failed";
+        CloseHandle(controlChannel.stopEvent);
+    }
+}
+
+
+// Client side: send commands (each ending with new line) to the running instance and read all the replies
+bool sendControlCommands(const string& commands, string& replies)
+{
+    wstring name = getControlPipeName();
+    HANDLE pipe = CreateFile(name.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+    if (pipe == INVALID_HANDLE_VALUE && GetLastError() == ERROR_PIPE_BUSY && WaitNamedPipe(name.c_str(), CONTROL_CONNECT_TIMEOUT)) {
+        pipe = CreateFile(name.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+    }
+    if (pipe == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    DWORD bytes;
+    bool ok = WriteFile(pipe, commands.data(), (DWORD)commands.length(), &bytes, NULL) && bytes == commands.length();
+    size_t expected = count(commands.begin(), commands.end(), '\n');
+    size_t received = 0;
+    char buffer[CONTROL_BUFFER_SIZE];
+    replies.clear();
+    while (ok && received < expected) {
+        ok = ReadFile(pipe, buffer, sizeof(buffer), &bytes, NULL) && bytes > 0;
+        if (ok) {
+            replies.append(buffer, bytes);
+            received += count(buffer, buffer + bytes, '\n');
+        }
+    }
+    CloseHandle(pipe);
+    return ok;
+}
+
+#pragma endregion
+
+
+
+#pragma region "TRACE RECORDING AND REPLAY"
+
+// Start or stop recording as configured. The trace starts with what is known already,
+// so the replay starts from the same state. Settings are recorded whenever they change.
+void manageTrace()
+{
+    const wstring& file = SETTINGS->TraceFile;
+    if (traceRecorder.isOpen() && traceRecorder.getFile() != file) {
+        traceRecorder.close();
+    }
+    if (!traceRecorder.isOpen() && !file.empty()) {
+        restoreCatalog();
+        if (!traceRecorder.open(file)) {
+            LOG << L"Creating trace file failed";
+            return;
+        }
+        for (auto const& f2d : file2dimensions) {
+            traceImage(f2d.first, &f2d.second);
+        }
+        tracePins();
+    }
+    if (traceRecorder.isOpen()) {
+        TraceRecord record(TraceSettings);
+        record.put(SETTINGS.toText(*SETTINGS));
+        traceRecorder.writeState(record);
+    }
+}
+
+
+// Drive the program through the recorded events on a simulated desktop - as fast as possible,
+// or keeping the recorded times. Timings and the final state are written next to the trace
+// (*.report.txt). Nothing is changed on the real desktop, settings are not saved.
+int replayTrace(const wstring& file, bool realTime)
+{
+    TraceReader reader;
+    if (!reader.open(file)) {
+        LOG << L"Not a trace file";
+        return 1;
+    }
+    replayRendering = true;
+    file2dimensions.clear();
+    catalogGeneration++;
+    pinnedMonitors.clear();
+
+    SimulatedWallpaperTarget desktop;
+    vector<LONGLONG> times;
+    int records = 0;
+    int messages = 0;
+    int imageChanges = 0;
+    ULONGLONG start = GetTickCount64();
+
+    DWORD time;
+    TraceRecord record;
+    while (reader.next(time, record)) {
+        records++;
+        if (realTime) {
+            ULONGLONG elapsed = GetTickCount64() - start;
+            if (time > elapsed) {
+                Sleep((DWORD)(time - elapsed));
+            }
+        }
+
+        switch (record.type) {
+            case TraceMessage:
+                // What the messages caused is in the other records
+                messages++;
+                break;
+
+            case TraceMonitors:
+            {
+                desktop.removeMonitors();
+                DWORD nMonitors = 0;
+                record.get(nMonitors);
+                for (DWORD i = 0; i < nMonitors; i++) {
+                    RECT rect;
+                    wstring id;
+                    if (record.get(&rect, sizeof(rect)) && record.get(id)) {
+                        desktop.addMonitor(id.c_str(), rect.left, rect.top, rect.right - rect.left, rect.bottom - rect.top);
+                    }
+                }
+                break;
+            }
 
-    // List all the files in the directory with some info about them.
-    do
-    {
-        wstring filePath(imageDir);
-        filePath += L"\\";
-        filePath += ffd.cFileName;
-        Image* img = Image::FromFile(filePath.c_str());
-        if (img == nullptr) {
-            continue;
+            case TraceImageAdded:
+            case TraceImageRemoved:
+            {
+                wstring path;
+                ImageInfo info;
+                if (!record.get(path)) {
+                    break;
+                }
+                if (record.type == TraceImageRemoved) {
+                    file2dimensions.erase(path);
+                }
+                else if (record.get(&info, sizeof(info))) {
+                    file2dimensions[path] = info;
+                }
+                catalogGeneration++;
+                imageChanges++;
+                break;
+            }
+
+            case TraceSettings:
+            {
+                wstring text;
+                WallSettings values(*SETTINGS);
+                if (record.get(text) && SETTINGS.fromText(text, values) > 0) {
+                    SETTINGS.set(values, false);
+                }
+                break;
+            }
+
+            case TracePins:
+            {
+                pinnedMonitors.clear();
+                DWORD count = 0;
+                record.get(count);
+                for (DWORD i = 0; i < count; i++) {
+                    wstring id;
+                    if (record.get(id)) {
+                        pinnedMonitors.insert(id);
+                    }
+                }
+                break;
+            }
+
+            case TraceSetWallpapers:
+            {
+                DWORD change = 0;
+                DWORD monitor = (DWORD)-1;
+                record.get(change);
+                record.get(monitor);
+                LONGLONG callStart = MetricTimer::now();
+                setWallpapers(desktop, change != 0, (int)monitor);
+                times.push_back(MetricTimer::microsSince(callStart));
+                break;
+            }
         }
-        UINT dimensions = (img->GetWidth() << 16) + img->GetHeight();
-        file2dimensions.insert(std::make_pair(filePath, dimensions));
-        delete img;
-    } while (FindNextFile(hFind, &ffd) != 0);
+    }
 
-    // De-initialize GDI
-    GdiplusShutdown(gdiplusToken);
+    wofstream report(file + L".report.txt");
+    report << L"Records: " << records << L"\n";
+    report << L"Messages: " << messages << L"\n";
+    report << L"Image changes: " << imageChanges << L"\n";
+    report << L"Replay time [ms]: " << (GetTickCount64() - start) << L"\n";
+    report << L"Setting wallpapers: " << times.size() << L"\n";
+    if (!times.empty()) {
+        LONGLONG total = 0;
+        for (LONGLONG t : times) {
+            total += t;
+        }
+        sort(times.begin(), times.end());
+        report << L"  total [us]: " << total << L"\n";
+        report << L"  median [us]: " << times[times.size() / 2] << L"\n";
+        report << L"  99th percentile [us]: " << times[(times.size() * 99) / 100] << L"\n";
+        report << L"  max [us]: " << times.back() << L"\n";
+    }
+    report << L"Desktop calls: " << desktop.setWallpaperCalls + desktop.setPositionCalls << L"\n";
+    report << L"Images known: " << file2dimensions.size() << L"\n";
+    for (UINT i = 0; i < desktop.getMonitorCount(); i++) {
+        wstring id;
+        wstring wallpaper;
+        RECT rect;
+        desktop.getMonitor(i, id, rect);
+        desktop.getWallpaper(id, wallpaper);
+        report << L"Monitor " << id << L" (" << rect.left << L"," << rect.top << L" "
+            << rect.right - rect.left << L"x" << rect.bottom - rect.top << L"): " << wallpaper << L"\n";
+    }
+    return report.good() ? 0 : 1;
 }
 
+#pragma endregion
+
 
-// Set best wallpapers for currently attached monitors
-// If change parameter is true the function will try not to use currently set wallpapers
-bool setWallpapers(bool change)
+
+#pragma region "BATCH MODE"
+
+// Commands run from the command line (or a script) instead of the tray application - for building
+// catalogs and render caches in advance and for capacity tests. No window, the desktop is not touched.
+//   /scan folder [file]          read the folder (with all processors, no budget) into its catalog -
+//                                the cache used by the application, or the given file
+//   /query monitors              images that can be displayed on each of the monitors
+//   /simulate monitors ticks     choose wallpapers (initial ones, then 'ticks' changes) - no rendering
+//   /render monitors             choose wallpapers once, render cropped copies / composite as configured
+//                                (into the render cache of the application), list the rendered files
+//   /thumbs file                 make thumbnails of all images into the atlas file, then read them randomly
+//   /startup monitors images     start like the application does with a catalog of that many made up images:
+//                                read it from its cache, set the first wallpapers
+//   /trim monitors [images]      change wallpapers with a catalog of that many made up images (500000 if not
+//                                given), trim it as when idle, change them again - memory and tick times
+//   /watch folder rotations      change folders watched for changes (subfolders made in the folder) many
+//                                times, then check that a change is reported and no handle is left open
+// Monitors are given like "1920x1080,1080x1920+1920+0" - without position they are placed side by side.
+// Options (after the command, applied in their order): /defaults (default settings instead of the saved
+// ones - so the run does not depend on the user's), /set Name=Value (setting for this run only, not saved),
+// /seed n.
+// Images are taken from catalogs of the configured folders. The output (to the console, or wherever
+// it is redirected) is UTF-8, one record per line, fields separated by tabs, sorted - so outputs
+// of two versions can be compared. Lines starting with '#' are timings - they differ from run to run.
+// Exit code: 0 - done, 1 - error (the reason is on the "error" line).
+
+class BatchOutput
 {
-    LOG << L"setWallpapers()";
+public:
+    BatchOutput() : owned(false) {
+        // Redirected output is inherited, otherwise the console of the shell has to be attached
+        out = GetStdHandle(STD_OUTPUT_HANDLE);
+        if ((out == NULL || out == INVALID_HANDLE_VALUE) && AttachConsole(ATTACH_PARENT_PROCESS)) {
+            out = CreateFile(L"CONOUT$", GENERIC_WRITE, FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+            owned = out != INVALID_HANDLE_VALUE;
+        }
+    }
+
+    ~BatchOutput() {
+        if (owned) {
+            CloseHandle(out);
+        }
+    }
+
+    void line(const wstring& text) {
+        string utf8 = toUtf8(text) + "\n";
+        DWORD written;
+        if (out != NULL && out != INVALID_HANDLE_VALUE) {
+            WriteFile(out, utf8.c_str(), (DWORD)utf8.length(), &written, NULL);
+        }
+    }
+
+private:
+    HANDLE  out;
+    bool    owned;
+};
+
+
+bool isBatchCommand(const wchar_t* argument)
+{
+    return wcscmp(argument, L"/scan") == 0 || wcscmp(argument, L"/query") == 0
+        || wcscmp(argument, L"/simulate") == 0 || wcscmp(argument, L"/render") == 0
+        || wcscmp(argument, L"/thumbs") == 0 || wcscmp(argument, L"/watch") == 0
+        || wcscmp(argument, L"/startup") == 0 || wcscmp(argument, L"/trim") == 0;
+}
 
-    bool allowUpscaling = SETTINGS.get(WallSettings::AllowUpscaling);
-    int allowedMismatch = SETTINGS.get(WallSettings::AllowedAspectRatioMismatch);
-    MultiMonImage multiMonMode = (MultiMonImage)(int)SETTINGS.get(WallSettings::MultiMonPolicy);
 
-    HRESULT hr;
-    CoInitializeEx(nullptr, COINIT_MULTITHREADED);
-    IDesktopWallpaper* pWall = nullptr;
-    hr = CoCreateInstance(__uuidof(DesktopWallpaper), nullptr, CLSCTX_ALL, __uuidof(IDesktopWallpaper), reinterpret_cast<LPVOID *>(&pWall));
-    if (FAILED(hr) || pWall == nullptr) {
+// Add monitors given like "1920x1080,1080x1920+1920+0" to the desktop. False if the text is not valid.
+bool parseMonitors(const wstring& text, SimulatedWallpaperTarget& desktop)
+{
+    vector<MonitorLayout> monitors;
+    if (!parseMonitors(text, monitors)) {
         return false;
     }
+    for (auto const& m : monitors) {
+        wstring id = L"M" + to_wstring(desktop.getMonitorCount());
+        desktop.addMonitor(id.c_str(), m.left, m.top, m.width, m.height);
+    }
+    return true;
+}
 
-    set<const wchar_t*> used;
 
-    UINT nMonitors = 0;
-    pWall->GetMonitorDevicePathCount(&nMonitors);
-    for (UINT monitor = 0; monitor < nMonitors; monitor++)
-    {
-        LPWSTR pId;
-        hr = pWall->GetMonitorDevicePathAt(monitor, &pId);
-        if (!FAILED(hr)) {
+// Most memory the process had so far (working set) - for checking that huge images are decoded in strips
+wstring formatPeakMemory()
+{
+    PROCESS_MEMORY_COUNTERS counters = { sizeof(counters) };
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return L"# peak memory [MB]\t?";
+    }
+    return L"# peak memory [MB]\t" + to_wstring(counters.PeakWorkingSetSize / (1024 * 1024));
+}
+
+
+// Memory of the process now: working set (resident) and private (committed) - for the idle trim
+wstring formatMemory(const wchar_t* when)
+{
+    PROCESS_MEMORY_COUNTERS_EX counters = { sizeof(counters) };
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), (PROCESS_MEMORY_COUNTERS*)&counters, sizeof(counters))) {
+        return wstring(L"# memory ") + when + L" [MB]\t?";
+    }
+    return wstring(L"# memory ") + when + L" [MB]\t" + to_wstring(counters.WorkingSetSize / (1024 * 1024))
+        + L"\t" + to_wstring(counters.PrivateUsage / (1024 * 1024));
+}
+
+
+wstring formatMonitor(UINT index, const RECT& rect)
+{
+    return to_wstring(index) + L"\t" + to_wstring(rect.right - rect.left) + L"x" + to_wstring(rect.bottom - rect.top)
+        + L"+" + to_wstring(rect.left) + L"+" + to_wstring(rect.top);
+}
+
+
+// Read the folder on this thread (and workers for the other processors), write its catalog
+int batchScan(BatchOutput& out, const wstring& folder, const wstring& file)
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+
+    ScanJob* job = newScanJob(NULL, folder, false);
+    job->budget.setLimits(0, 0);
+    job->threads = min((int)info.dwNumberOfProcessors, SCAN_MAX_THREADS);
+    // Analysed images are good for any settings
+    job->analyse = true;
+    // Files that did not change since the last time are not read again
+    ImageCacheHeader header;
+    readImageCache(file, folder, header, job->known);
+
+    ULONGLONG listingStart = GetTickCount64();
+    scanThreadProc(job);
+
+    int res = 0;
+    if (!job->listed) {
+        out.line(L"error\tfolder not available\t" + folder);
+        res = 1;
+    }
+    else {
+        for (auto const& f2d : job->found) {
+            const ImageInfo& i = f2d.second;
+            out.line(L"image\t" + to_wstring(i.width) + L"\t" + to_wstring(i.height)
+                + L"\t" + to_wstring(i.focusX) + L"\t" + to_wstring(i.focusY) + L"\t" + f2d.first);
+        }
+        out.line(L"images\t" + to_wstring(job->found.size()));
+        out.line(L"# files read\t" + to_wstring(job->budget.getFiles()));
+        // Scan starts when the folder is listed
+        out.line(L"# listing time [ms]\t" + to_wstring(job->startTime - listingStart));
+        out.line(formatPeakMemory());
+        out.line(L"# scan time [ms]\t" + to_wstring(GetTickCount64() - job->startTime));
+        if (!writeImageCache(file, folder, 0, job->folderTime, job->found)) {
+            out.line(L"error\twriting catalog failed\t" + file);
+            res = 1;
+        }
+    }
+    delete job;
+    return res;
+}
+
+
+// Images from catalogs of all the configured folders - as the application would start with them
+void loadBatchCatalog(BatchOutput& out)
+{
+    getConfiguredSources(*SETTINGS, imageSources);
+    for (auto const& source : imageSources) {
+        if (!loadImageCache(source.first)) {
+            out.line(L"missing\t" + source.first);
+        }
+    }
+    out.line(L"catalog\t" + to_wstring(file2dimensions.size()));
+}
+
+
+int batchQuery(BatchOutput& out, SimulatedWallpaperTarget& desktop)
+{
+    LONGLONG start = MetricTimer::now();
+    for (UINT i = 0; i < desktop.getMonitorCount(); i++) {
+        wstring id;
+        RECT rect;
+        desktop.getMonitor(i, id, rect);
+        set<const WCHAR*> images;
+        findCandidates(rect, images);
+        vector<wstring> sorted(images.begin(), images.end());
+        sort(sorted.begin(), sorted.end());
+
+        out.line(L"monitor\t" + formatMonitor(i, rect) + L"\t" + to_wstring(sorted.size()));
+        for (const wstring& image : sorted) {
+            out.line(L"candidate\t" + to_wstring(i) + L"\t" + image);
+        }
+    }
+    out.line(L"# query time [us]\t" + to_wstring(MetricTimer::microsSince(start)));
+    return 0;
+}
+
+
+// Initial wallpapers (tick 0), then 'ticks' changes
+int batchSimulate(BatchOutput& out, SimulatedWallpaperTarget& desktop, int ticks)
+{
+    vector<LONGLONG> times;
+    for (int tick = 0; tick <= ticks; tick++) {
+        LONGLONG start = MetricTimer::now();
+        setWallpapers(desktop, tick > 0);
+        times.push_back(MetricTimer::microsSince(start));
+
+        for (UINT i = 0; i < desktop.getMonitorCount(); i++) {
+            wstring id;
+            wstring wallpaper;
             RECT rect;
-            hr = pWall->GetMonitorRECT(pId, &rect);
-            if (!FAILED(hr)) {
-                int ratio = 1000 * (rect.right - rect.left) / (rect.bottom - rect.top);
+            desktop.getMonitor(i, id, rect);
+            desktop.getWallpaper(id, wallpaper);
+            out.line(L"wallpaper\t" + to_wstring(tick) + L"\t" + to_wstring(i) + L"\t" + wallpaper);
+        }
+    }
+    out.line(L"desktop calls\t" + to_wstring(desktop.setWallpaperCalls + desktop.setPositionCalls));
+    out.line(L"desktop calls avoided\t" + to_wstring(wallpaperCallStats.wallpaperCallsAvoided + wallpaperCallStats.positionCallsAvoided));
 
-                bool allowUpscalling = SETTINGS.get(WallSettings::AllowUpscaling);
+    LONGLONG total = 0;
+    for (LONGLONG t : times) {
+        total += t;
+    }
+    sort(times.begin(), times.end());
+    out.line(L"# total [us]\t" + to_wstring(total));
+    out.line(L"# median [us]\t" + to_wstring(times[times.size() / 2]));
+    out.line(L"# 99th percentile [us]\t" + to_wstring(times[(times.size() * 99) / 100]));
+    out.line(L"# max [us]\t" + to_wstring(times.back()));
+    return 0;
+}
 
-                set<const WCHAR*> properImages;
-                for (auto const& f2d : file2dimensions)
-                {
-                    int w = f2d.second >> 16;
-                    int h = f2d.second & 0xFFFF;
 
-                    if (!allowUpscaling) {
-                        if ((w < rect.right - rect.left) || (h < rect.bottom - rect.top)) {
-                            continue;
-                        }
-                    }
+// Choose wallpapers once and render what they need - files shown instead of the original images
+int batchRender(BatchOutput& out, SimulatedWallpaperTarget& desktop)
+{
+    LONGLONG start = MetricTimer::now();
+    bool ok = setWallpapers(desktop, false);
+    LONGLONG time = MetricTimer::microsSince(start);
+    if (!ok) {
+        out.line(L"error\trendering failed");
+    }
 
-                    int fileRatio = 1000 * w / h;
-                    int mismatch = 1000 * (fileRatio - ratio) / ratio;
-                    if (mismatch < 0) {
-                        mismatch = -mismatch;
-                    }
-                    if (mismatch < allowedMismatch) {
-                        properImages.insert(f2d.first.c_str());
-                    }
-                }
+    set<wstring> rendered;
+    for (UINT i = 0; i < desktop.getMonitorCount(); i++) {
+        wstring id;
+        wstring wallpaper;
+        RECT rect;
+        desktop.getMonitor(i, id, rect);
+        desktop.getWallpaper(id, wallpaper);
+        out.line(L"wallpaper\t" + to_wstring(i) + L"\t" + wallpaper);
+        if (!wallpaper.empty() && file2dimensions.find(wallpaper) == file2dimensions.end()) {
+            rendered.insert(wallpaper);
+        }
+    }
+    for (const wstring& file : rendered) {
+        WIN32_FILE_ATTRIBUTE_DATA data;
+        if (GetFileAttributesEx(file.c_str(), GetFileExInfoStandard, &data)) {
+            ULONGLONG size = ((ULONGLONG)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+            out.line(L"rendered\t" + to_wstring(size) + L"\t" + file);
+        }
+        else {
+            out.line(L"error\trendered file missing\t" + file);
+            ok = false;
+        }
+    }
+    out.line(L"rendered files\t" + to_wstring(rendered.size()));
+    out.line(L"render folder\t" + getRenderDir());
+    out.line(L"# render time [us]\t" + to_wstring(time));
+    out.line(formatPeakMemory());
+    return ok ? 0 : 1;
+}
 
-                if (properImages.size() == 1) {
-                    // Only one good image found - just set it
-                    const wchar_t* image = *properImages.begin();
-                    hr = pWall->SetWallpaper(pId, image);
-                    used.insert(image);
-                }
-                else if (properImages.size() > 1) {
-                    // More than one matching options, choose right image depending on 'change' parameter
-                    LPWSTR current;
-                    pWall->GetWallpaper(pId, &current);
-                    bool currentFound = false;
-                    auto it = properImages.begin();
-                    do {
-                        if (wcscmp(current, *it) == 0) {
-                            currentFound = true;
-                            properImages.erase(it);
-                            break;
-                        }
-                    } while (++it != properImages.end());
-                    if (!change && currentFound) {
-                        // The function was requested not to change Wallpaper and we found out, that
-                        // curently set wallpaper is present in the images set - no action required
-                    }
-                    else {
-                        // Multiple matching images available
-                        if (multiMonMode == MultiMonImage::Different) {
-                            // If prefference is to use different images on each
-                            // screen remove from the pool already used ones
-                            for (const auto & img : used) {
-                                properImages.erase(img);
-                            }
-                            // ...but make sure something has left
-                            if (properImages.size() == 0) {
-                                properImages = used;
-                            }
-                        }
-                        else if (multiMonMode == MultiMonImage::Same) {
-                            // If prefference is to use the same image check if there is an intersection
-                            // in sets of proper images and already used ones
-                            set<const wchar_t*> usedAndProper;
-                            for (const auto & img : used) {
-                                if (properImages.find(img) != properImages.end()) {
-                                    usedAndProper.insert(img);
-                                }
-                            }
-                            if (usedAndProper.size() > 0) {
-                                // Some of the used images are proper - so use them
-                                properImages = usedAndProper;
-                            }
-                        }
 
-                        // Choose random  image from available pool
-                        int r = rand() % properImages.size();
-                        it = properImages.begin();
-                        advance(it, r);
+// Thumbnails of the catalog made into the atlas file (with ScanThreads threads), then looked up
+// the way previews do it - by image path, in random order
+int batchThumbs(BatchOutput& out, const wstring& file)
+{
+    ThumbnailAtlas atlas;
+    if (!atlas.open(NULL, file)) {
+        out.line(L"error\tatlas not opened\t" + file);
+        return 1;
+    }
+    LONGLONG start = MetricTimer::now();
+    atlas.update();
+    atlas.wait();
+    LONGLONG buildTime = MetricTimer::microsSince(start);
+
+    vector<const wstring*> images;
+    size_t made = 0;
+    for (auto const& f2d : file2dimensions) {
+        images.push_back(&f2d.first);
+        made += atlas.find(f2d.first) >= 0 ? 1 : 0;
+    }
+
+    const int reads = 100000;
+    volatile ULONGLONG sum = 0; // the pixels are read for real
+    start = MetricTimer::now();
+    for (int i = 0; i < reads && !images.empty(); i++) {
+        size_t index = (((size_t)rand() << 15) | rand()) % images.size();
+        int slot = atlas.find(*images[index]);
+        if (slot >= 0) {
+            sum += atlas.get(slot)->pixels[THUMB_SIZE * THUMB_SIZE / 2];
+        }
+    }
+    LONGLONG readTime = MetricTimer::microsSince(start);
+    atlas.close();
+
+    out.line(L"thumbnails\t" + to_wstring(made));
+    out.line(L"# build time [ms]\t" + to_wstring(buildTime / 1000));
+    out.line(L"# build [images/s]\t" + to_wstring(made * 1000000 / max(buildTime, 1LL)));
+    out.line(L"# random access [ns]\t" + to_wstring(readTime * 1000 / reads));
+    out.line(formatPeakMemory());
+    return 0;
+}
 
-                        hr = pWall->SetWallpaper(pId, *it);
-                        used.insert(*it);
-                    }
-                }
-                else {
-                    // No suitable images for this screen - log error
-                }
+
+// Catalog of made up images of common shapes in a folder that does not exist - for measuring what
+// depends only on the size of the catalog (files are never opened)
+wstring makeSyntheticCatalog(size_t count, map<wstring, ImageInfo>& images)
+{
+    static const UINT shapes[][2] = { { 1920, 1080 }, { 2560, 1440 }, { 3840, 2160 }, { 1080, 1920 },
+        { 1600, 1200 }, { 3440, 1440 }, { 1280, 1024 }, { 5120, 2880 }, { 1440, 2560 }, { 2048, 1536 } };
+    wchar_t temp[MAX_PATH + 1];
+    GetTempPath(_countof(temp), temp);
+    wstring folder = normalizeSource(temp) + L"\\" + APP_NAME + L" synthetic";
+
+    images.clear();
+    wchar_t name[32];
+    for (size_t i = 0; i < count; i++) {
+        ImageInfo info = { 0 };
+        // Sizes vary a bit, like photos cropped by hand
+        info.width = shapes[i % _countof(shapes)][0] - (UINT)(i / _countof(shapes) % 16);
+        info.height = shapes[i % _countof(shapes)][1];
+        info.size = 200000 + i % 5000000;
+        info.mtime = 130000000000000000ULL + i * 10000000ULL;
+        info.focusX = info.focusY = FOCUS_MAX / 2;
+        swprintf_s(name, L"\\img%08u.jpg", (unsigned)i);
+        images.insert(images.end(), std::make_pair(folder + name, info));
+    }
+    return folder;
+}
+
+
+// Time of the start of the application: the catalog read from its cache, then the first wallpapers
+// set (as WinMain does it, before anything is read from the folders)
+int batchStartup(BatchOutput& out, SimulatedWallpaperTarget& desktop, size_t count)
+{
+    map<wstring, ImageInfo> images;
+    wstring folder = makeSyntheticCatalog(count, images);
+    wstring file = getAppDataPath(L".startup.cache");
+    if (!writeImageCache(file, folder, 0, 0, images)) {
+        out.line(L"error\twriting catalog failed\t" + file);
+        return 1;
+    }
+    images.clear();
+    imageSources.clear();
+    imageSources[folder] = 1;
+
+    LONGLONG start = MetricTimer::now();
+    ImageCacheHeader header;
+    bool loaded = readImageCache(file, folder, header, images);
+    replaceShard(folder, images);
+    LONGLONG loadTime = MetricTimer::microsSince(start);
+    bool set = setWallpapers(desktop, false);
+    LONGLONG startupTime = MetricTimer::microsSince(start);
+    DeleteFile(file.c_str());
+
+    UINT withWallpaper = 0;
+    for (UINT i = 0; i < desktop.getMonitorCount(); i++) {
+        wstring id;
+        wstring wallpaper;
+        RECT rect;
+        desktop.getMonitor(i, id, rect);
+        withWallpaper += (desktop.getWallpaper(id, wallpaper) && !wallpaper.empty()) ? 1 : 0;
+    }
+    out.line(L"catalog\t" + to_wstring(file2dimensions.size()));
+    out.line(L"monitors with wallpaper\t" + to_wstring(withWallpaper));
+    out.line(L"# cache load [ms]\t" + to_wstring(loadTime / 1000));
+    out.line(L"# first wallpapers [ms]\t" + to_wstring((startupTime - loadTime) / 1000));
+    out.line(L"# startup [ms]\t" + to_wstring(startupTime / 1000));
+    out.line(formatPeakMemory());
+    return (loaded && set) ? 0 : 1;
+}
+
+
+// Idle trim of a big catalog: ticks before the trim, the trim, the first tick after it (the catalog is read
+// back from its cache) and the ticks after that. The catalog is cached where the application has it.
+int batchTrim(BatchOutput& out, SimulatedWallpaperTarget& desktop, size_t count)
+{
+    const int ticks = 5;
+    map<wstring, ImageInfo> images;
+    wstring folder = makeSyntheticCatalog(count, images);
+    wstring file = getImageCachePath(folder);
+    if (!writeImageCache(file, folder, 0, 0, images)) {
+        out.line(L"error\twriting catalog failed\t" + file);
+        return 1;
+    }
+    imageSources.clear();
+    imageSources[folder] = 1;
+    replaceShard(folder, images);
+    images.clear();
+
+    // The first wallpapers build the tables - ticks are timed after that
+    bool set = setWallpapers(desktop, false);
+    LONGLONG start = MetricTimer::now();
+    for (int i = 0; i < ticks; i++) {
+        set = setWallpapers(desktop, true) && set;
+    }
+    LONGLONG tickTime = MetricTimer::microsSince(start) / ticks;
+    size_t before = file2dimensions.size();
+    out.line(formatMemory(L"before trim"));
+
+    trimCatalog();
+    size_t trimmed = file2dimensions.size();
+    out.line(formatMemory(L"trimmed"));
+
+    start = MetricTimer::now();
+    restoreCatalog();
+    LONGLONG restoreTime = MetricTimer::microsSince(start);
+    set = setWallpapers(desktop, true) && set;
+    LONGLONG wakeUpTime = MetricTimer::microsSince(start);
+    start = MetricTimer::now();
+    for (int i = 0; i < ticks; i++) {
+        set = setWallpapers(desktop, true) && set;
+    }
+    LONGLONG tickAfterTime = MetricTimer::microsSince(start) / ticks;
+    out.line(formatMemory(L"after wake-up"));
+    DeleteFile(file.c_str());
+
+    out.line(L"catalog\t" + to_wstring(before));
+    out.line(L"catalog trimmed\t" + to_wstring(trimmed));
+    out.line(L"catalog restored\t" + to_wstring(file2dimensions.size()));
+    out.line(L"# tick before trim [ms]\t" + to_wstring(tickTime / 1000));
+    out.line(L"# restore [ms]\t" + to_wstring(restoreTime / 1000));
+    out.line(L"# first tick after trim [ms]\t" + to_wstring(wakeUpTime / 1000));
+    out.line(L"# tick after trim [ms]\t" + to_wstring(tickAfterTime / 1000));
+    out.line(wstring(L"# restore within limit\t") + (restoreTime <= IDLE_TRIM_MAX_RESTORE ? L"yes" : L"no"));
+    out.line(formatPeakMemory());
+    return (set && file2dimensions.size() == before) ? 0 : 1;
+}
+
+
+int getThreadCount()
+{
+    HANDLE snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+    if (snapshot == INVALID_HANDLE_VALUE) {
+        return -1;
+    }
+    THREADENTRY32 entry = { sizeof(entry) };
+    DWORD process = GetCurrentProcessId();
+    int count = 0;
+    for (BOOL found = Thread32First(snapshot, &entry); found; found = Thread32Next(snapshot, &entry)) {
+        if (entry.th32OwnerProcessID == process) {
+            count++;
+        }
+    }
+    CloseHandle(snapshot);
+    return count;
+}
+
+
+// Stress test of the folder watcher: watched folders are replaced 'rotations' times (1 to 4 of them),
+// then a file is written to the one watched at the end - it must be reported, handles must not leak.
+// Threads are only printed - Windows starts and stops its own worker threads whenever it likes.
+int batchWatch(BatchOutput& out, const wstring& folder, int rotations)
+{
+    const int folders = 8;
+    vector<wstring> paths;
+    for (int i = 0; i < folders; i++) {
+        paths.push_back(folder + L"\\watch" + to_wstring(i));
+        CreateDirectory(paths.back().c_str(), NULL);
+    }
+
+    LONGLONG start = MetricTimer::now();
+    FolderWatcher watcher;
+    int threads = getThreadCount();
+    DWORD handles = 0;
+    GetProcessHandleCount(GetCurrentProcess(), &handles);
+
+    watcher.start(NULL);
+    for (int r = 0; r < rotations; r++) {
+        vector<wstring> roots;
+        for (int i = 0; i <= r % 4; i++) {
+            roots.push_back(paths[(r + 3 * i) % folders]);
+        }
+        watcher.setRoots(roots);
+        // Give the thread time to open them now and then - otherwise it would see just the last list
+        if (r % 4 == 0) {
+            Sleep(1);
+        }
+    }
+    watcher.setRoots(vector<wstring>(1, paths[0]));
+    Sleep(100);
+
+    wstring file = paths[0] + L"\\changed.txt";
+    HANDLE f = CreateFile(file.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    DWORD written;
+    WriteFile(f, "x", 1, &written, NULL);
+    CloseHandle(f);
+    set<wstring> changed;
+    for (int waited = 0; changed.empty() && waited < 3 * WATCH_BATCH_DELAY; waited += 50) {
+        Sleep(50);
+        watcher.takeChanges(changed);
+    }
+    watcher.stop();
+
+    DWORD handlesAfter = 0;
+    GetProcessHandleCount(GetCurrentProcess(), &handlesAfter);
+    int threadsAfter = getThreadCount();
+    DeleteFile(file.c_str());
+    for (const wstring& path : paths) {
+        RemoveDirectory(path.c_str());
+    }
+
+    bool reported = changed.size() == 1 && *changed.begin() == paths[0];
+    out.line(L"rotations\t" + to_wstring(rotations));
+    out.line(L"change reported\t" + wstring(reported ? L"yes" : L"no"));
+    out.line(L"leaked handles\t" + to_wstring((int)handlesAfter - (int)handles));
+    out.line(L"# threads before / after\t" + to_wstring(threads) + L"\t" + to_wstring(threadsAfter));
+    out.line(L"# watch time [ms]\t" + to_wstring(MetricTimer::microsSince(start) / 1000));
+    return (reported && handlesAfter == handles) ? 0 : 1;
+}
+
+
+int runBatch(int argc, LPWSTR* argv)
+{
+    BatchOutput out;
+    wstring command = argv[1];
+    vector<wstring> arguments;
+    WallSettings values(*SETTINGS);
+    for (int a = 2; a < argc; a++) {
+        if (wcscmp(argv[a], L"/set") == 0 && a + 1 < argc) {
+            if (SETTINGS.fromText(argv[++a], values) != 1) {
+                out.line(wstring(L"error\tunknown setting\t") + argv[a]);
+                return 1;
             }
         }
+        else if (wcscmp(argv[a], L"/defaults") == 0) {
+            values = WallSettings();
+        }
+        else if (wcscmp(argv[a], L"/seed") == 0 && a + 1 < argc) {
+            srand((unsigned)_wtoi(argv[++a]));
+        }
+        else {
+            arguments.push_back(argv[a]);
+        }
+    }
+    // Rendered files of a simulation would be just thrown away (images of /startup and /trim don't exist)
+    if (command == L"/simulate" || command == L"/startup" || command == L"/trim") {
+        values.SpanComposite = false;
+        values.SmartCrop = false;
     }
-    pWall->SetPosition((DESKTOP_WALLPAPER_POSITION)(int)SETTINGS.get(WallSettings::DisplayMode));
+    SETTINGS.set(values, false);
 
-    pWall->Release();
-    CoUninitialize();
+    if (command == L"/scan") {
+        if (arguments.empty() || arguments.size() > 2) {
+            out.line(L"error\tusage: /scan folder [file]");
+            return 1;
+        }
+        wstring folder = arguments[0];
+        while (!folder.empty() && folder.back() == L'\\') {
+            folder.pop_back();
+        }
+        return batchScan(out, folder, arguments.size() > 1 ? arguments[1] : getImageCachePath(folder));
+    }
+    if (command == L"/thumbs") {
+        if (arguments.size() != 1) {
+            out.line(L"error\tusage: /thumbs file");
+            return 1;
+        }
+        loadBatchCatalog(out);
+        return batchThumbs(out, arguments[0]);
+    }
+    if (command == L"/watch") {
+        if (arguments.size() != 2 || _wtoi(arguments[1].c_str()) <= 0) {
+            out.line(L"error\tusage: /watch folder rotations");
+            return 1;
+        }
+        return batchWatch(out, normalizeSource(arguments[0]), _wtoi(arguments[1].c_str()));
+    }
 
-    return true;
+    SimulatedWallpaperTarget desktop;
+    if (command == L"/startup") {
+        if (arguments.size() != 2 || !parseMonitors(arguments[0], desktop) || _wtoi(arguments[1].c_str()) <= 0) {
+            out.line(L"error\tusage: /startup monitors images");
+            return 1;
+        }
+        return batchStartup(out, desktop, (size_t)_wtoi(arguments[1].c_str()));
+    }
+    if (command == L"/trim") {
+        if (arguments.empty() || arguments.size() > 2 || !parseMonitors(arguments[0], desktop)
+                || (arguments.size() == 2 && _wtoi(arguments[1].c_str()) <= 0)) {
+            out.line(L"error\tusage: /trim monitors [images]");
+            return 1;
+        }
+        return batchTrim(out, desktop, arguments.size() == 2 ? (size_t)_wtoi(arguments[1].c_str()) : 500000);
+    }
+    int ticks = 0;
+    size_t expected = (command == L"/simulate") ? 2 : 1;
+    if (arguments.size() != expected || !parseMonitors(arguments[0], desktop)
+            || (expected == 2 && (ticks = _wtoi(arguments[1].c_str())) < 0)) {
+        out.line(L"error\tusage: " + command + (expected == 2 ? L" monitors ticks" : L" monitors"));
+        return 1;
+    }
+    loadBatchCatalog(out);
+    if (command == L"/query") {
+        return batchQuery(out, desktop);
+    }
+    if (command == L"/render") {
+        return batchRender(out, desktop);
+    }
+    return batchSimulate(out, desktop, ticks);
 }
 
 #pragma endregion
@@ -982,6 +6122,20 @@ bool createNotificationIcon(HWND window, const WCHAR* tip)
 
 
 
+// Change the tooltip of the icon in tray
+bool updateNotificationIcon(HWND window, const WCHAR* tip)
+{
+    NOTIFYICONDATA nid = {};
+    nid.cbSize = sizeof(NOTIFYICONDATA);
+    nid.hWnd = window;
+    nid.uID = 0;
+    wcscpy_s(nid.szTip, tip);
+    nid.uFlags = NIF_TIP;
+    return Shell_NotifyIcon(NIM_MODIFY, &nid);
+}
+
+
+
 // Get rid of the icon in tray
 bool deleteNotificationIcon(HWND window)
 {
@@ -996,6 +6150,11 @@ bool deleteNotificationIcon(HWND window)
 
 
 
+// Global (used by main thread only):
+// When the display configuration changed, waiting for the wallpapers to be set (0 if not)
+LONGLONG displayChangeTime = 0;
+
+
 // Show context menu for the tray icon
 void showContextMenu(HWND window)
 {
@@ -1008,7 +6167,10 @@ void showContextMenu(HWND window)
 
     HMENU menu = CreatePopupMenu();
     AppendMenu(menu, MF_STRING, MENU_ID_SET_WALLPAPER, L"Set wallpaper");
+    AppendMenu(menu, MF_STRING, MENU_ID_HISTORY_BACK, L"Previous wallpaper");
+    AppendMenu(menu, MF_STRING, MENU_ID_HISTORY_FORWARD, L"Forward in history");
     AppendMenu(menu, MF_STRING, MENU_ID_SETTINGS, L"Settings...");
+    AppendMenu(menu, MF_STRING, MENU_ID_SAVE_STATS, L"Save statistics");
     AppendMenu(menu, MF_STRING, MENU_ID_EXIT, L"Exit");
     TrackPopupMenu(menu, TPM_CENTERALIGN | TPM_VCENTERALIGN | TPM_LEFTBUTTON, point.x, point.y, 0, window, NULL);
 
@@ -1022,6 +6184,15 @@ LRESULT __stdcall WndProc(HWND window, unsigned int msg, WPARAM wp, LPARAM lp)
     // Windows Explorer (not Windows OS!) message - needed to handle case Explorer is restarted
     const static UINT WM_TASKBARCREATED = ::RegisterWindowMessage(L"TaskbarCreated");
 
+    // Record what may lead to changing the wallpapers
+    if (traceRecorder.isOpen() && (msg == WM_DISPLAYCHANGE || msg == WM_DEVICECHANGE || msg == WM_SETTINGCHANGE
+            || msg == WM_TIMER || msg == WM_POWERBROADCAST || msg == WM_TIMECHANGE || msg == MY_MSG_FOLDER_CHANGED)) {
+        TraceRecord record(TraceMessage);
+        record.put((DWORD)msg);
+        record.put((DWORD)wp);
+        traceRecorder.write(record);
+    }
+
     switch (msg)
     {
         case WM_DESTROY:
@@ -1034,10 +6205,30 @@ LRESULT __stdcall WndProc(HWND window, unsigned int msg, WPARAM wp, LPARAM lp)
 
         case WM_TIMER:
             LOG << L"WM_TIMER";
-            if (wp == EVENT_SET_WALLPAPER_HW_CHANGE || wp == EVENT_SET_WALLPAPER_SCHEDULED) {
-                // If the timer was caused by HW change kill it - it is one time only event
+            if (wp == EVENT_SET_WALLPAPER_HW_CHANGE) {
+                // The timer caused by HW change is one time only event
                 KillTimer(window, EVENT_SET_WALLPAPER_HW_CHANGE);
-                setWallpapers(wp == EVENT_SET_WALLPAPER_SCHEDULED);
+                setWallpapers(false);
+                if (displayChangeTime != 0) {
+                    metricDisplayChangeTime.record(MetricTimer::microsSince(displayChangeTime));
+                    displayChangeTime = 0;
+                }
+            }
+            else if (wp == EVENT_SET_WALLPAPER_SCHEDULED) {
+                onScheduleTimer(window);
+            }
+            else if (wp == EVENT_IDLE_TRIM) {
+                onIdleTimer();
+            }
+            else if (wp == EVENT_SHARED_CATALOG_RETRY) {
+                KillTimer(window, EVENT_SHARED_CATALOG_RETRY);
+                map<wstring, bool> retries;
+                retries.swap(sharedCatalogRetries);
+                for (auto const& retry : retries) {
+                    if (imageSources.find(retry.first) != imageSources.end()) {
+                        readSource(window, retry.first, retry.second);
+                    }
+                }
             }
             return 0;
 
@@ -1051,13 +6242,18 @@ LRESULT __stdcall WndProc(HWND window, unsigned int msg, WPARAM wp, LPARAM lp)
                         //ShowWindow(window, SW_SHOW);
                         showConfig(window);
                         break;
-                    case MENU_ID_SET_WALLPAPER:
-                        setWallpapers(true);
-                        // If periodic change of wallpapers is configured schedule the next update
-                        if (SETTINGS.get(WallSettings::AutoChangeImage)) {
-                            SetTimer(window, EVENT_SET_WALLPAPER_SCHEDULED, ONE_MINUTE_MILLIS * (int)SETTINGS.get(WallSettings::AutoChangeInterval), NULL);
+                    case MENU_ID_SAVE_STATS:
+                        if (!saveMetrics()) {
+                            LOG << L"Saving statistics failed";
                         }
                         break;
+                    case MENU_ID_SET_WALLPAPER:
+                        changeWallpapers(window);
+                        break;
+                    case MENU_ID_HISTORY_BACK:
+                    case MENU_ID_HISTORY_FORWARD:
+                        showFromHistory(window, -1, LOWORD(wp) == MENU_ID_HISTORY_BACK);
+                        break;
                 }
             }
             return 0;
@@ -1066,11 +6262,7 @@ LRESULT __stdcall WndProc(HWND window, unsigned int msg, WPARAM wp, LPARAM lp)
             switch (lp)
             {
                 case WM_LBUTTONDBLCLK:
-                    setWallpapers(true);
-                    // If periodic change of wallpapers is configured schedule (postpone) the next update
-                    if (SETTINGS.get(WallSettings::AutoChangeImage)) {
-                        SetTimer(window, EVENT_SET_WALLPAPER_SCHEDULED, ONE_MINUTE_MILLIS * (int)SETTINGS.get(WallSettings::AutoChangeInterval), NULL);
-                    }
+                    changeWallpapers(window);
                     break;
                 case WM_RBUTTONDOWN:
                 case WM_CONTEXTMENU:
@@ -1080,17 +6272,57 @@ LRESULT __stdcall WndProc(HWND window, unsigned int msg, WPARAM wp, LPARAM lp)
             return 0;
 
         case MY_MSG_FOLDER_CHANGED:
-            readWallpapers();
-            setWallpapers();
+            onFolderChanged(window);
+            return 0;
+
+        case MY_MSG_SCAN_BATCH:
+            onScanBatch(window, (map<wstring, ImageInfo>*)lp);
+            return 0;
+
+        case MY_MSG_SCAN_DONE:
+            onScanDone(window, (ScanJob*)lp);
+            return 0;
+
+        case MY_MSG_FEED_UPDATE:
+            onFeedUpdate((FeedUpdate*)lp);
+            return 0;
+
+        case MY_MSG_SETTINGS_CHANGED:
+            onSettingsChanged(window, (WallSettings*)lp);
+            return 0;
+
+        case MY_MSG_CONTROL_COMMANDS:
+            onControlCommands(window, (ControlBatch*)lp);
+            return 0;
+
+        case MY_MSG_THUMBS_DONE:
+            thumbnailAtlas.onDone((ThumbJob*)lp);
             return 0;
 
         case WM_DISPLAYCHANGE:
         case WM_DEVICECHANGE:
             // Event that may require the wallpaper update happened - so let's do it!
             LOG << ((msg == WM_DEVICECHANGE) ?  L"WM_DEVICECHANGE" : L"WM_DISPLAYCHANGE");
+            // Measured from the first of the events that are handled together
+            if (msg == WM_DISPLAYCHANGE && displayChangeTime == 0) {
+                displayChangeTime = MetricTimer::now();
+            }
             SetTimer(window, EVENT_SET_WALLPAPER_HW_CHANGE, SET_WALLPAPER_TIMER_DELAY, NULL);
             return 0;
 
+        case WM_POWERBROADCAST:
+            // Timers don't run during sleep - changes missed in the meantime are done now (once)
+            if (wp == PBT_APMRESUMEAUTOMATIC) {
+                LOG << L"Resumed";
+                onScheduleTimer(window);
+            }
+            return TRUE;
+
+        case WM_TIMECHANGE:
+            LOG << L"WM_TIMECHANGE";
+            onScheduleTimer(window);
+            return 0;
+
         case WM_SETTINGCHANGE:
             if (wp == SPI_SETDESKWALLPAPER) {
                 // Event that may require the wallpaper update happened - so let's do it!
@@ -1141,20 +6373,37 @@ int __stdcall WinMain(_In_ HINSTANCE hInstance,
     _In_ LPSTR     lpCmdLine,
     _In_ int       nCmdShow)
 {
-    LOG.enable(SETTINGS.get(WallSettings::EnableDebugLog));
-    LOG << L"Begin";
+    LOG.enable(SETTINGS->EnableDebugLog);
+
+    // Replay of recorded events and batch commands - no window, the real desktop is not touched
+    int argc;
+    LPWSTR* argv = CommandLineToArgvW(GetCommandLineW(), &argc);
+    if (argv != NULL && argc >= 3 && wcscmp(argv[1], L"/replay") == 0) {
+        int res = replayTrace(argv[2], argc >= 4 && wcscmp(argv[3], L"/realtime") == 0);
+        LocalFree(argv);
+        return res;
+    }
+    if (argv != NULL && argc >= 2 && isBatchCommand(argv[1])) {
+        int res = runBatch(argc, argv);
+        LocalFree(argv);
+        return res;
+    }
+    LocalFree(argv);
 
-    // Allow only single instance of the application
+    // Allow only single instance of the application - another one just asks it to change the wallpapers
     HWND oldWindow = FindWindow(APP_NAME, APP_NAME);
     if (oldWindow != NULL) {
-        LOG << L"Activate previous instance and exit";
-        PostMessage(oldWindow, WM_COMMAND, MENU_ID_SET_WALLPAPER, 0);
+        string replies;
+        if (!sendControlCommands("next\n", replies)) {
+            // Instance without the control channel
+            PostMessage(oldWindow, WM_COMMAND, MENU_ID_SET_WALLPAPER, 0);
+        }
         return 0;
     }
 
-    // Read list of images and apply wallpapers
-    readWallpapers();
-    setWallpapers(false);
+    LOG << L"Begin";
+
+    DWORD startTime = GetTickCount();
 
     // Create main window for message handling and tray icon
     HWND window = createWindow(APP_NAME, WndProc);
@@ -1162,20 +6411,53 @@ int __stdcall WinMain(_In_ HINSTANCE hInstance,
     // Create tray icon - the only way to interact with the program
     createNotificationIcon(window, L"Double-click to set desktop wallpaper");
 
-    // Watch for changes in the directory with images
+    // Record events if configured - before anything is known, so the trace has it all
+    manageTrace();
+
+    // Previews of images - made whenever the list of images changes
+    if (!thumbnailAtlas.open(window)) {
+        LOG << L"Opening thumbnail atlas failed";
+    }
+
+    // Wallpapers shown before - so the previous ones can be brought back
+    loadHistory();
+
+    // Apply wallpapers using images known from the previous run - reading the folder
+    // may take a while, so it is done in the background (wallpapers are updated when it's done)
+    getConfiguredSources(*SETTINGS, imageSources);
+    bool cached = false;
+    for (auto const& source : imageSources) {
+        cached = loadImageCache(source.first) || cached;
+    }
+    if (cached) {
+        setWallpapers(false);
+    }
+    readWallpapers(window);
+    LOG << L"Startup time [ms]:" << (int)(GetTickCount() - startTime);
+
+    // Watch for changes in the directory with images, and for new images in the feed
     manageFolderWatcher(window);
+    manageFeed(window);
+    manageSettingsWatcher(window);
+    manageControlChannel(window);
 
     // If configured schedule periodic wallpaper updates
-    if (SETTINGS.get(WallSettings::AutoChangeImage)) {
-        SetTimer(window, EVENT_SET_WALLPAPER_SCHEDULED, ONE_MINUTE_MILLIS * (int)SETTINGS.get(WallSettings::AutoChangeInterval), NULL);
-    }
+    scheduleWallpaperChange(window);
+
+    // Drop the list of images from memory when it is not needed for a while (if configured)
+    manageIdleTrim(window);
 
     // Main program loop
     MSG msg;
     while (GetMessage(&msg, 0, 0, 0)) DispatchMessage(&msg);
 
-    // Terminate folder watcher thread
+    // Terminate control channel, settings and folder watchers, feed and image reading threads
+    manageControlChannel(window, false);
+    manageSettingsWatcher(window, false);
     manageFolderWatcher(window, false);
+    manageFeed(window, false);
+    stopReadingWallpapers();
+    thumbnailAtlas.close();
 
     // Remove icon from tray
     deleteNotificationIcon(window);
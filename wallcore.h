@@ -0,0 +1,1782 @@
+//////////////////////////////
+//   Wallpaper Changer - core
+//////////////////////////////
+
+// Parts of the program that don't need Windows: what is known about images and how it is
+// searched (catalog, analysis, shape index, filter), where images are placed on monitors, pace of scans, feed cache, wallpaper history, schedule,
+// monitor lists, metrics, event trace file, values shared by threads and settings.
+// Included by wall.cpp; builds on other systems too, so it can be tested there (see tests/).
+
+#pragma once
+
+
+
+// std stuff
+#include <istream>
+#include <ostream>
+#include <string>
+#include <map>
+#include <unordered_map>
+#include <set>
+#include <vector>
+#include <algorithm>
+#include <queue>
+#include <memory>
+#include <atomic>
+#include <sstream>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cwchar>
+#include <cwctype>
+using namespace std;
+
+// Needed for image analysis
+#include <math.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <shobjidl.h>
+#else
+// Types the code shares with Windows headers
+typedef unsigned char       BYTE;
+typedef unsigned short      USHORT;
+typedef unsigned int        UINT;
+typedef uint32_t            DWORD;
+typedef long long           LONGLONG;
+typedef unsigned long long  ULONGLONG;
+#define MAX_PATH            260
+#define _countof(a)         (sizeof(a) / sizeof((a)[0]))
+typedef enum {
+    DWPOS_CENTER = 0,
+    DWPOS_TILE = 1,
+    DWPOS_STRETCH = 2,
+    DWPOS_FIT = 3,
+    DWPOS_FILL = 4,
+    DWPOS_SPAN = 5
+} DESKTOP_WALLPAPER_POSITION;
+#endif
+
+
+
+#pragma region "IMAGE ANALYSIS"
+
+// Some decisions need to know what is in the picture. Full size images are way too big
+// to look at - everything here works on a small copy (longer edge ANALYSIS_SIZE pixels).
+#define ANALYSIS_SIZE                   128
+#define FOCUS_MAX                       65535
+
+// Compact description of the image, used by selection rules. All values 0..255:
+// mean luminance, sharpness, and histogram of colours - 4 bins for each of R, G and B
+#define FEATURE_LUMINANCE               0
+#define FEATURE_SHARPNESS               1
+#define FEATURE_COLORS                  2
+#define COLOR_BINS                      4
+#define FEATURE_COUNT                   (FEATURE_COLORS + 3 * COLOR_BINS)
+
+
+// Small grayscale copy of the image
+typedef struct {
+    int             width;
+    int             height;
+    vector<float>   luma;           // 0..255, row after row
+    int             colors[3 * COLOR_BINS];  // number of pixels in each bin: R, G, B
+} SmallImage;
+
+
+// Fill the small copy (its width and height are set already) from pixels: BGRA, rows 'stride' bytes apart
+inline void setSmallImagePixels(SmallImage& small, const BYTE* pixels, int stride)
+{
+    small.luma.resize(small.width * small.height);
+    memset(small.colors, 0, sizeof(small.colors));
+    for (int y = 0; y < small.height; y++) {
+        const BYTE* row = pixels + y * stride;
+        float* out = &small.luma[y * small.width];
+        for (int x = 0; x < small.width; x++) {
+            // BGRA, Rec. 601 weights
+            out[x] = 0.114f * row[4 * x] + 0.587f * row[4 * x + 1] + 0.299f * row[4 * x + 2];
+        }
+        for (int x = 0; x < small.width; x++) {
+            small.colors[row[4 * x + 2] * COLOR_BINS / 256]++;
+            small.colors[COLOR_BINS + row[4 * x + 1] * COLOR_BINS / 256]++;
+            small.colors[2 * COLOR_BINS + row[4 * x] * COLOR_BINS / 256]++;
+        }
+    }
+}
+
+
+// Find the point the picture is about - centre of mass of gradient energy (edges and details),
+// with flat areas (sky, wall, water) not counting. Simple loops over small arrays - the compiler
+// vectorizes them.
+inline bool findFocus(const SmallImage& small, USHORT& focusX, USHORT& focusY)
+{
+    double sum = 0;
+    double sumX = 0;
+    double sumY = 0;
+    vector<float> rowEnergy(small.width);
+    for (int y = 1; y < small.height - 1; y++) {
+        const float* up = &small.luma[(y - 1) * small.width];
+        const float* mid = &small.luma[y * small.width];
+        const float* down = &small.luma[(y + 1) * small.width];
+        for (int x = 1; x < small.width - 1; x++) {
+            float dx = mid[x + 1] - mid[x - 1];
+            float dy = down[x] - up[x];
+            rowEnergy[x] = dx * dx + dy * dy;
+        }
+        for (int x = 1; x < small.width - 1; x++) {
+            sum += rowEnergy[x];
+            sumX += rowEnergy[x] * x;
+            sumY += rowEnergy[x] * y;
+        }
+    }
+    if (sum <= 0) {
+        // Completely flat image - nothing better than the centre
+        focusX = focusY = FOCUS_MAX / 2;
+        return true;
+    }
+    focusX = (USHORT)(FOCUS_MAX * (sumX / sum + 0.5) / small.width);
+    focusY = (USHORT)(FOCUS_MAX * (sumY / sum + 0.5) / small.height);
+    return true;
+}
+
+
+// Mean luminance, sharpness (variance of Laplacian - blurry images have few strong edges)
+// and colour histogram
+inline void computeFeatures(const SmallImage& small, BYTE features[FEATURE_COUNT])
+{
+    int n = small.width * small.height;
+    double sum = 0;
+    for (int i = 0; i < n; i++) {
+        sum += small.luma[i];
+    }
+    features[FEATURE_LUMINANCE] = (BYTE)(sum / n);
+
+    double lapSum = 0;
+    double lapSum2 = 0;
+    int lapCount = 0;
+    for (int y = 1; y < small.height - 1; y++) {
+        const float* up = &small.luma[(y - 1) * small.width];
+        const float* mid = &small.luma[y * small.width];
+        const float* down = &small.luma[(y + 1) * small.width];
+        for (int x = 1; x < small.width - 1; x++) {
+            float lap = up[x] + down[x] + mid[x - 1] + mid[x + 1] - 4 * mid[x];
+            lapSum += lap;
+            lapSum2 += lap * lap;
+        }
+        lapCount += small.width - 2;
+    }
+    double variance = (lapCount > 0) ? lapSum2 / lapCount - (lapSum / lapCount) * (lapSum / lapCount) : 0;
+    // Variance spans several orders of magnitude - log scale fits it in a byte
+    double sharpness = 16 * log2(1 + variance);
+    features[FEATURE_SHARPNESS] = (BYTE)(sharpness > 255 ? 255 : sharpness);
+
+    for (int i = 0; i < 3 * COLOR_BINS; i++) {
+        features[FEATURE_COLORS + i] = (BYTE)(255 * small.colors[i] / n);
+    }
+}
+
+
+// How different two images look - luminance and colours (sharpness does not count)
+inline int featureDistance(const BYTE* a, const BYTE* b)
+{
+    int d = abs((int)a[FEATURE_LUMINANCE] - (int)b[FEATURE_LUMINANCE]);
+    for (int i = FEATURE_COLORS; i < FEATURE_COUNT; i++) {
+        d += abs((int)a[i] - (int)b[i]);
+    }
+    return d;
+}
+
+#pragma endregion
+
+
+
+#pragma region "IMAGE PLACEMENT"
+
+// Where the image goes in an area (monitor, its part of the composite, cropped copy) - scaled
+// the way Windows does it for the display mode. Bezel makes the area bigger than the bitmap
+// (the part behind monitor frame is not visible). In fill mode the image is cropped around
+// the focus point (0..1) instead of the centre.
+typedef struct {
+    float           x;
+    float           y;
+    float           width;
+    float           height;
+} ImagePlacement;
+
+
+inline ImagePlacement placeImage(float imageWidth, float imageHeight, int width, int height,
+    DESKTOP_WALLPAPER_POSITION mode, int bezel, float focusX = 0.5f, float focusY = 0.5f)
+{
+    float areaW = (float)(width + 2 * bezel);
+    float areaH = (float)(height + 2 * bezel);
+
+    float scaleX = 1;
+    float scaleY = 1;
+    switch (mode) {
+    case DWPOS_FILL:
+        scaleX = scaleY = (areaW / imageWidth > areaH / imageHeight) ? areaW / imageWidth : areaH / imageHeight;
+        break;
+    case DWPOS_FIT:
+        scaleX = scaleY = (areaW / imageWidth < areaH / imageHeight) ? areaW / imageWidth : areaH / imageHeight;
+        break;
+    case DWPOS_STRETCH:
+        scaleX = areaW / imageWidth;
+        scaleY = areaH / imageHeight;
+        break;
+    default:
+        // Center - no scaling
+        break;
+    }
+
+    ImagePlacement p;
+    p.width = imageWidth * scaleX;
+    p.height = imageHeight * scaleY;
+    p.x = (width - p.width) / 2;
+    p.y = (height - p.height) / 2;
+    if (mode == DWPOS_FILL) {
+        // Put the focus point as close to the centre as possible, but keep the area covered
+        p.x = width / 2.0f - focusX * p.width;
+        p.y = height / 2.0f - focusY * p.height;
+        if (p.x > -bezel) p.x = (float)-bezel;
+        if (p.y > -bezel) p.y = (float)-bezel;
+        if (p.x + p.width < width + bezel) p.x = width + bezel - p.width;
+        if (p.y + p.height < height + bezel) p.y = height + bezel - p.height;
+    }
+    return p;
+}
+
+#pragma endregion
+
+
+
+#pragma region "CATALOG"
+
+// What we know about a single image file
+typedef struct {
+    UINT        width;          // pixels - 0 if the file is not an image
+    UINT        height;
+    UINT        flags;          // IMAGE_HAS_... - which of the optional fields are valid
+    ULONGLONG   size;           // file size and modification time - to detect
+    ULONGLONG   mtime;          // ...if the file must be read again
+    USHORT      focusX;         // the most interesting point of the image, for cropping
+    USHORT      focusY;         // ...0 - left/top edge, FOCUS_MAX - right/bottom edge
+    BYTE        features[FEATURE_COUNT];
+} ImageInfo;
+
+#define IMAGE_HAS_FOCUS                 0x0001
+#define IMAGE_HAS_FEATURES              0x0002
+#define IMAGE_ANALYSED                  (IMAGE_HAS_FOCUS | IMAGE_HAS_FEATURES)
+// Analysis failed - it is not tried again until the file changes
+#define IMAGE_NOT_ANALYSABLE            0x0004
+
+// Is everything the options need (analysis or not) known about the image
+inline bool isImageInfoComplete(const ImageInfo& info, bool analyse)
+{
+    return !analyse || (info.flags & IMAGE_ANALYSED) == IMAGE_ANALYSED || (info.flags & IMAGE_NOT_ANALYSABLE) != 0;
+}
+
+
+// Hash of a path (FNV-1a, case insensitive)
+inline ULONGLONG hashPath(const wstring& path)
+{
+    ULONGLONG hash = 14695981039346656037ULL;
+    for (wchar_t c : path) {
+        hash = (hash ^ towlower(c)) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+
+// Folder as the key of the sources - without trailing backslashes (and spaces)
+inline wstring normalizeSource(wstring source)
+{
+    while (!source.empty() && (source.back() == L'\\' || source.back() == L' ')) {
+        source.pop_back();
+    }
+    return source;
+}
+
+
+// Folders with images and their weights: the main folder, and others given like
+// "D:\Wallpapers|3;E:\Photos" (weight 1 if not given)
+inline void parseSources(const wstring& folder, int weight, const wstring& extra, map<wstring, int>& sources)
+{
+    sources.clear();
+    wstring first = normalizeSource(folder);
+    if (!first.empty()) {
+        sources[first] = max(1, weight);
+    }
+
+    size_t start = 0;
+    while (start < extra.length()) {
+        size_t end = extra.find(L';', start);
+        if (end == wstring::npos) {
+            end = extra.length();
+        }
+        wstring source = extra.substr(start, end - start);
+        start = end + 1;
+
+        int sourceWeight = 1;
+        size_t bar = source.find(L'|');
+        if (bar != wstring::npos) {
+            sourceWeight = max(1, (int)wcstol(source.c_str() + bar + 1, nullptr, 10));
+            source.resize(bar);
+        }
+        source = normalizeSource(source);
+        if (!source.empty()) {
+            sources[source] = sourceWeight;
+        }
+    }
+}
+
+
+// Images come from several folders (sources), each of them is a shard of the catalog:
+// read, cached and replaced on its own. Paths of a shard's images make a continuous range
+// of the map, so a shard is attached or detached without touching the others.
+
+// Call the function for every image of the shard
+template<typename F> void forEachInShard(map<wstring, ImageInfo>& catalog, const wstring& folder, F f)
+{
+    wstring prefix = folder + L"\\";
+    auto it = catalog.lower_bound(prefix);
+    while (it != catalog.end() && it->first.compare(0, prefix.length(), prefix) == 0) {
+        auto current = it++;
+        // Images in subfolders belong to other shards (if any)
+        if (current->first.find(L'\\', prefix.length()) == wstring::npos) {
+            f(current);
+        }
+    }
+}
+
+
+
+// Features of all analysed images in columns - queries go through simple arrays instead of the map
+class FeatureTable
+{
+public:
+    void clear() {
+        paths.clear();
+        features.clear();
+        path2index.clear();
+    }
+
+    void add(const wchar_t* path, const BYTE* imageFeatures) {
+        path2index[path] = paths.size();
+        paths.push_back(path);
+        features.insert(features.end(), imageFeatures, imageFeatures + FEATURE_COUNT);
+    }
+
+    size_t size() const {
+        return paths.size();
+    }
+
+    // Index of the image, or -1 if it has no features
+    int indexOf(const wchar_t* path) const {
+        auto it = path2index.find(path);
+        return (it != path2index.end()) ? (int)it->second : -1;
+    }
+
+    const BYTE* get(int index) const {
+        return &features[index * FEATURE_COUNT];
+    }
+
+    // Distances of all images to the given one
+    void distances(const BYTE* query, vector<int>& out) const {
+        out.resize(paths.size());
+        const BYTE* f = features.data();
+        for (size_t i = 0; i < paths.size(); i++, f += FEATURE_COUNT) {
+            out[i] = featureDistance(query, f);
+        }
+    }
+
+    // Mark images with the feature in the given range
+    void filter(int feature, int minVal, int maxVal, vector<bool>& out) const {
+        out.resize(paths.size());
+        const BYTE* f = features.data() + feature;
+        for (size_t i = 0; i < paths.size(); i++, f += FEATURE_COUNT) {
+            out[i] = *f >= minVal && *f <= maxVal;
+        }
+    }
+
+private:
+    vector<const wchar_t*>          paths;      // keys of the catalog
+    vector<BYTE>                    features;   // FEATURE_COUNT values for every image
+    map<const wchar_t*, size_t>     path2index;
+};
+
+
+
+// When no image is within the allowed aspect ratio mismatch (like for an ultrawide or portrait monitor)
+// the images that fit best are used. Cost of an image: difference of aspect ratios (log2 of their ratio)
+// matters most, then missing resolution (octaves of pixels); larger images cost a bit too.
+#define NEAREST_FIT_COUNT               8
+#define NEAREST_FIT_ASPECT_WEIGHT       4.0f
+#define NEAREST_FIT_LARGER_WEIGHT       0.1f
+
+// Images sorted by the log of aspect ratio - a query walks from the monitor's aspect ratio
+// to both sides, and stops when aspect ratio alone costs more than the worst of the best found.
+class ShapeIndex
+{
+public:
+    void clear() {
+        shapes.clear();
+    }
+
+    // Image at the given position of the catalog - images without size are left out
+    void add(UINT width, UINT height, size_t index, const wchar_t* path) {
+        if (width > 0 && height > 0) {
+            Shape shape;
+            shape.aspect = log2f((float)width / height);
+            shape.resolution = log2f((float)width * height);
+            shape.index = index;
+            shape.path = path;
+            shapes.push_back(shape);
+        }
+    }
+
+    // Called when all the images are added
+    void prepare() {
+        sort(shapes.begin(), shapes.end(), [](const Shape& a, const Shape& b) { return a.aspect < b.aspect; });
+    }
+
+    // Up to 'count' best fitting images allowed by the filter (flags in the catalog order)
+    void nearest(int width, int height, const vector<bool>& allowed, size_t count, set<const wchar_t*>& out) const {
+        float aspect = log2f((float)width / height);
+        float resolution = log2f((float)width * height);
+
+        // The worst of the best found so far on top
+        priority_queue<pair<float, const wchar_t*>> best;
+        size_t right = lower_bound(shapes.begin(), shapes.end(), aspect,
+            [](const Shape& s, float a) { return s.aspect < a; }) - shapes.begin();
+        size_t left = right;
+        while (left > 0 || right < shapes.size()) {
+            // The nearer of the two sides goes first - so aspect ratio differences only grow
+            bool takeLeft = right == shapes.size()
+                || (left > 0 && aspect - shapes[left - 1].aspect <= shapes[right].aspect - aspect);
+            const Shape& s = takeLeft ? shapes[--left] : shapes[right++];
+            float cost = NEAREST_FIT_ASPECT_WEIGHT * fabsf(s.aspect - aspect);
+            if (best.size() == count && cost >= best.top().first) {
+                break;
+            }
+            if (!allowed[s.index]) {
+                continue;
+            }
+            float missing = resolution - s.resolution;
+            cost += (missing > 0) ? missing : -missing * NEAREST_FIT_LARGER_WEIGHT;
+            if (best.size() < count) {
+                best.push(std::make_pair(cost, s.path));
+            }
+            else if (cost < best.top().first) {
+                best.pop();
+                best.push(std::make_pair(cost, s.path));
+            }
+        }
+
+        for (; !best.empty(); best.pop()) {
+            out.insert(best.top().second);
+        }
+    }
+
+private:
+    typedef struct {
+        float           aspect;         // log2(width / height)
+        float           resolution;     // log2(width * height)
+        size_t          index;          // position in the catalog
+        const wchar_t*  path;           // key of the catalog
+    } Shape;
+
+    vector<Shape>       shapes;
+};
+
+#pragma endregion
+
+
+
+#pragma region "SCAN BUDGET"
+
+// Background scans must not compete with the user for the disk and CPU: files and bytes per second
+// are limited (0 - no limit). The time when a file may be read is counted from the start of the scan,
+// so short and long waits (and inaccurate sleeping) even out - a scan that was slowed down by something
+// else catches up until it reaches its budget again.
+
+// When (ms since the start of the scan) the file may be read - 'files' and 'bytes' include it
+inline ULONGLONG getScanDueTime(ULONGLONG files, ULONGLONG bytes, int maxFilesPerSec, ULONGLONG maxBytesPerSec)
+{
+    ULONGLONG due = 0;
+    if (maxFilesPerSec > 0) {
+        due = files * 1000 / maxFilesPerSec;
+    }
+    if (maxBytesPerSec > 0 && bytes * 1000 / maxBytesPerSec > due) {
+        due = bytes * 1000 / maxBytesPerSec;
+    }
+    return due;
+}
+
+
+// Budget of one scan, shared by all its threads: every file is counted before it is read
+class ScanBudget
+{
+public:
+    ScanBudget() : maxFilesPerSec(0), maxBytesPerSec(0), files(0), bytes(0), waited(0) {}
+
+    // Limits are set before the threads start
+    void setLimits(int filesPerSec, ULONGLONG bytesPerSec) {
+        maxFilesPerSec = filesPerSec;
+        maxBytesPerSec = bytesPerSec;
+    }
+
+    // Count the file - returns how long (ms) to wait before it is read. 'elapsed' is the time (ms)
+    // since the start of the scan.
+    ULONGLONG take(ULONGLONG fileSize, ULONGLONG elapsed) {
+        ULONGLONG due = getScanDueTime(++files, bytes += fileSize, maxFilesPerSec, maxBytesPerSec);
+        if (due <= elapsed) {
+            return 0;
+        }
+        waited += due - elapsed;
+        return due - elapsed;
+    }
+
+    ULONGLONG getFiles() const {
+        return files;
+    }
+
+    ULONGLONG getBytes() const {
+        return bytes;
+    }
+
+    // Time the threads waited, together
+    ULONGLONG getWaited() const {
+        return waited;
+    }
+
+private:
+    int                     maxFilesPerSec;     // 0 - no limit
+    ULONGLONG               maxBytesPerSec;     // 0 - no limit
+    atomic<ULONGLONG>       files;
+    atomic<ULONGLONG>       bytes;
+    atomic<ULONGLONG>       waited;
+};
+
+#pragma endregion
+
+
+
+#pragma region "IMAGE FEED"
+
+// Feed index: one URL of an image per line, absolute or relative to the feed's location,
+// empty lines and lines starting with '#' are skipped. The text is already decoded (UTF-8).
+inline void parseFeedIndex(const wstring& text, const wstring& feedUrl, vector<wstring>& urls)
+{
+    wstring base = feedUrl.substr(0, feedUrl.find_last_of(L'/') + 1);
+    size_t start = 0;
+    while (start < text.length()) {
+        size_t end = text.find(L'\n', start);
+        if (end == wstring::npos) {
+            end = text.length();
+        }
+        wstring line = text.substr(start, end - start);
+        start = end + 1;
+        while (!line.empty() && (line.back() == L'\r' || line.back() == L' ')) {
+            line.pop_back();
+        }
+        if (line.empty() || line[0] == L'#') {
+            continue;
+        }
+        urls.push_back(line.find(L"://") == wstring::npos ? base + line : line);
+    }
+}
+
+
+// File in the feed's cache: a downloaded image, or a part of one being downloaded
+typedef struct {
+    ULONGLONG   size;
+    ULONGLONG   mtime;
+    bool        part;
+    bool        shown;          // image on the screen (or in the history) - never deleted
+    bool        stale;          // part of an image no longer in the feed - it won't be continued
+} FeedCacheFile;
+
+// Which files to delete so the cache fits in maxBytes (parts count too): stale parts first,
+// then the oldest files. Returns their indexes.
+inline vector<size_t> selectFeedEvictions(const vector<FeedCacheFile>& files, ULONGLONG maxBytes)
+{
+    vector<size_t> order;
+    ULONGLONG total = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+        order.push_back(i);
+        total += files[i].size;
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        if (files[a].stale != files[b].stale) {
+            return files[a].stale;
+        }
+        return files[a].mtime < files[b].mtime;
+    });
+
+    vector<size_t> evicted;
+    for (size_t i : order) {
+        const FeedCacheFile& file = files[i];
+        if (file.shown || (!file.stale && total <= maxBytes)) {
+            continue;
+        }
+        evicted.push_back(i);
+        total -= file.size;
+    }
+    return evicted;
+}
+
+#pragma endregion
+
+
+
+#pragma region "CATALOG FILTER"
+
+// Images can be limited with a filter expression (Filter setting), like:
+//     width >= 3840 and age <= 90 and not blocked
+//     (path under "Nature" or path contains "sunset") and luminance < 100
+// Numbers: width, height (pixels), size (KB), age (days since modified), luminance, sharpness (0..255).
+// Comparisons: < <= > >= = !=. Paths: under "folder" (absolute or relative to any of the image folders)
+// and contains "text", both ignore case. Blocked images are listed in the blocklist file, one per line.
+// The expression is compiled once to a program in reverse polish notation, which is run over
+// columns of the whole catalog at once.
+typedef enum {
+    FieldWidth = 0,
+    FieldHeight,
+    FieldSizeKB,
+    FieldAgeDays,
+    FieldLuminance,
+    FieldSharpness
+} FilterField;
+
+typedef enum {
+    OpCompare = 0,
+    OpUnder,
+    OpContains,
+    OpBlocked,
+    OpAnd,
+    OpOr,
+    OpNot
+} FilterOp;
+
+typedef enum {
+    CmpLess = 0,
+    CmpLessEqual,
+    CmpGreater,
+    CmpGreaterEqual,
+    CmpEqual,
+    CmpNotEqual
+} FilterCmp;
+
+typedef struct {
+    FilterOp    op;
+    FilterField field;
+    FilterCmp   cmp;
+    LONGLONG    value;
+    wstring     text;           // lower case path or its part
+} FilterInstruction;
+
+// One day in FILETIME units
+#define FILETIME_DAY                    864000000000ULL
+
+
+class FilterCompiler
+{
+public:
+    // Compile expression into the program, empty expression gives empty program (everything passes)
+    bool compile(const wstring& expression, vector<FilterInstruction>& out, wstring& error) {
+        program.clear();
+        tokens.clear();
+        pos = 0;
+        if (!tokenize(expression, error)) {
+            return false;
+        }
+        if (!tokens.empty() && !parseOr(error)) {
+            return false;
+        }
+        if (pos < tokens.size()) {
+            error = L"Unexpected: " + tokens[pos];
+            return false;
+        }
+        out.swap(program);
+        return true;
+    }
+
+private:
+    vector<wstring>             tokens;     // words lower case, strings keep leading quote
+    size_t                      pos;
+    vector<FilterInstruction>   program;
+
+    bool tokenize(const wstring& text, wstring& error) {
+        size_t i = 0;
+        while (i < text.length()) {
+            wchar_t c = text[i];
+            size_t start = i;
+            if (iswspace(c)) {
+                i++;
+                continue;
+            }
+            if (c == L'"') {
+                size_t end = text.find(L'"', i + 1);
+                if (end == wstring::npos) {
+                    error = L"Missing closing quote";
+                    return false;
+                }
+                tokens.push_back(text.substr(i, end - i));
+                i = end + 1;
+                continue;
+            }
+            if (iswalnum(c)) {
+                while (i < text.length() && iswalnum(text[i])) i++;
+            }
+            else if ((c == L'<' || c == L'>' || c == L'!') && i + 1 < text.length() && text[i + 1] == L'=') {
+                i += 2;
+            }
+            else {
+                i++;
+            }
+            wstring token = text.substr(start, i - start);
+            transform(token.begin(), token.end(), token.begin(), towlower);
+            tokens.push_back(token);
+        }
+        return true;
+    }
+
+    bool accept(const wchar_t* token) {
+        if (pos < tokens.size() && tokens[pos] == token) {
+            pos++;
+            return true;
+        }
+        return false;
+    }
+
+    bool parseOr(wstring& error) {
+        if (!parseAnd(error)) {
+            return false;
+        }
+        while (accept(L"or")) {
+            if (!parseAnd(error)) {
+                return false;
+            }
+            emit(OpOr);
+        }
+        return true;
+    }
+
+    bool parseAnd(wstring& error) {
+        if (!parseUnary(error)) {
+            return false;
+        }
+        while (accept(L"and")) {
+            if (!parseUnary(error)) {
+                return false;
+            }
+            emit(OpAnd);
+        }
+        return true;
+    }
+
+    bool parseUnary(wstring& error) {
+        if (accept(L"not")) {
+            if (!parseUnary(error)) {
+                return false;
+            }
+            emit(OpNot);
+            return true;
+        }
+        return parsePrimary(error);
+    }
+
+    bool parsePrimary(wstring& error) {
+        if (pos >= tokens.size()) {
+            error = L"Unexpected end of filter";
+            return false;
+        }
+        if (accept(L"(")) {
+            if (!parseOr(error)) {
+                return false;
+            }
+            if (!accept(L")")) {
+                error = L"Missing )";
+                return false;
+            }
+            return true;
+        }
+        if (accept(L"blocked")) {
+            emit(OpBlocked);
+            return true;
+        }
+        if (accept(L"path")) {
+            FilterOp op;
+            if (accept(L"under")) {
+                op = OpUnder;
+            }
+            else if (accept(L"contains")) {
+                op = OpContains;
+            }
+            else {
+                error = L"Expected under or contains after path";
+                return false;
+            }
+            if (pos >= tokens.size() || tokens[pos][0] != L'"') {
+                error = L"Expected quoted text after path " + tokens[pos - 1];
+                return false;
+            }
+            FilterInstruction& instr = emit(op);
+            instr.text = tokens[pos++].substr(1);
+            transform(instr.text.begin(), instr.text.end(), instr.text.begin(), towlower);
+            return true;
+        }
+
+        static const wchar_t* fields[] = { L"width", L"height", L"size", L"age", L"luminance", L"sharpness" };
+        static const wchar_t* comparisons[] = { L"<", L"<=", L">", L">=", L"=", L"!=" };
+        int field = -1;
+        int cmp = -1;
+        for (int i = 0; i < (int)_countof(fields); i++) {
+            if (tokens[pos] == fields[i]) field = i;
+        }
+        if (field < 0) {
+            error = L"Unknown: " + tokens[pos];
+            return false;
+        }
+        pos++;
+        for (int i = 0; pos < tokens.size() && i < (int)_countof(comparisons); i++) {
+            if (tokens[pos] == comparisons[i]) cmp = i;
+        }
+        if (cmp < 0 || pos + 1 >= tokens.size() || !iswdigit(tokens[pos + 1][0])) {
+            error = L"Expected comparison with a number after " + tokens[pos - 1];
+            return false;
+        }
+        FilterInstruction& instr = emit(OpCompare);
+        instr.field = (FilterField)field;
+        instr.cmp = (FilterCmp)cmp;
+        instr.value = wcstoll(tokens[pos + 1].c_str(), nullptr, 10);
+        pos += 2;
+        return true;
+    }
+
+    FilterInstruction& emit(FilterOp op) {
+        FilterInstruction instr = { op, FieldWidth, CmpLess, 0 };
+        program.push_back(instr);
+        return program.back();
+    }
+};
+
+
+// Columns the filter runs over - one value for every image
+typedef struct {
+    vector<wstring>             paths;          // lower case
+    vector<int>                 numbers[FieldSharpness + 1];
+} FilterColumns;
+
+
+// Images passing the filter. Ages are counted to 'today' (days since 1601), relative paths are
+// under any of the folders (lower case, with trailing backslash). Blocklist has lower case paths.
+inline void runFilter(const vector<FilterInstruction>& program, const FilterColumns& columns,
+    const set<wstring>& blocklist, ULONGLONG today, const vector<wstring>& folders, vector<bool>& result)
+{
+    const vector<wstring>& paths = columns.paths;
+    size_t count = paths.size();
+    if (program.empty()) {
+        result.assign(count, true);
+        return;
+    }
+
+    vector<vector<bool>> stack;
+    for (const FilterInstruction& instr : program) {
+        if (instr.op == OpAnd || instr.op == OpOr || instr.op == OpNot) {
+            vector<bool> top;
+            top.swap(stack.back());
+            stack.pop_back();
+            vector<bool>& out = (instr.op == OpNot) ? top : stack.back();
+            for (size_t i = 0; i < count; i++) {
+                out[i] = (instr.op == OpNot) ? !top[i] : (instr.op == OpAnd) ? (out[i] && top[i]) : (out[i] || top[i]);
+            }
+            if (instr.op == OpNot) {
+                stack.push_back(top);
+            }
+            continue;
+        }
+
+        stack.push_back(vector<bool>(count));
+        vector<bool>& out = stack.back();
+        if (instr.op == OpCompare) {
+            const vector<int>& column = columns.numbers[instr.field];
+            LONGLONG value = instr.value;
+            for (size_t i = 0; i < count; i++) {
+                LONGLONG v = column[i];
+                if (instr.field == FieldAgeDays) {
+                    v = (LONGLONG)today - v;
+                }
+                // Negative means unknown (image not analysed) - such images never match
+                bool known = v >= 0;
+                switch (instr.cmp) {
+                case CmpLess:           out[i] = known && v < value;  break;
+                case CmpLessEqual:      out[i] = known && v <= value; break;
+                case CmpGreater:        out[i] = known && v > value;  break;
+                case CmpGreaterEqual:   out[i] = known && v >= value; break;
+                case CmpEqual:          out[i] = known && v == value; break;
+                case CmpNotEqual:       out[i] = known && v != value; break;
+                }
+            }
+        }
+        else if (instr.op == OpUnder) {
+            vector<wstring> dirs;
+            if (instr.text.find(L':') != wstring::npos || instr.text.compare(0, 2, L"\\\\") == 0) {
+                dirs.push_back(instr.text);
+            }
+            else {
+                for (const wstring& folder : folders) {
+                    dirs.push_back(folder + instr.text);
+                }
+            }
+            for (wstring& dir : dirs) {
+                if (dir.back() != L'\\') {
+                    dir += L"\\";
+                }
+                for (size_t i = 0; i < count; i++) {
+                    out[i] = out[i] || paths[i].compare(0, dir.length(), dir) == 0;
+                }
+            }
+        }
+        else if (instr.op == OpContains) {
+            for (size_t i = 0; i < count; i++) {
+                out[i] = paths[i].find(instr.text) != wstring::npos;
+            }
+        }
+        else if (instr.op == OpBlocked) {
+            for (size_t i = 0; i < count; i++) {
+                out[i] = blocklist.find(paths[i]) != blocklist.end();
+            }
+        }
+    }
+    result.swap(stack.back());
+}
+
+#pragma endregion
+
+
+
+#pragma region "WALLPAPER HISTORY"
+
+// Wallpapers shown on every monitor - so the previous ones can be brought back (and the newer ones
+// again) without choosing. For every monitor there is a ring of path hashes, the oldest entries are
+// overwritten. When a new wallpaper is shown after going back the entries after the current one are
+// dropped. Stream layout: magic, number of rings, then for each of them the lengths (of monitor id,
+// entries, current entry), monitor id (UTF-16) and the hashes, oldest first.
+#define HISTORY_MAGIC                   0x31494857      // "WHI1"
+#define HISTORY_MAX_SIZE                10000
+
+class HistoryRings
+{
+public:
+    HistoryRings() : changed(false), capacity(100) {}
+
+    void setCapacity(int size) {
+        capacity = (size_t)max(1, min(size, HISTORY_MAX_SIZE));
+        for (auto& ring : rings) {
+            resize(ring.second);
+        }
+    }
+
+    // The image shown on the monitor - nothing happens if it is the current entry already
+    void record(const wstring& monitorId, ULONGLONG hash) {
+        Ring& ring = getRing(monitorId);
+        if (ring.count > 0 && at(ring, ring.current) == hash) {
+            return;
+        }
+        if (ring.count > 0) {
+            ring.count = ring.current + 1;
+        }
+        if (ring.count == capacity) {
+            ring.first = (ring.first + 1) % capacity;
+            ring.count--;
+        }
+        ring.entries[(ring.first + ring.count) % capacity] = hash;
+        ring.current = ring.count++;
+        changed = true;
+    }
+
+    // Go one entry back or forward, skipping images 'known' doesn't know any more. False if there is none.
+    template<typename Known> bool move(const wstring& monitorId, bool back, Known known, ULONGLONG& hash) {
+        auto it = rings.find(monitorId);
+        if (it == rings.end()) {
+            return false;
+        }
+        Ring& ring = it->second;
+        size_t pos = ring.current;
+        while (back ? pos > 0 : pos + 1 < ring.count) {
+            pos = back ? pos - 1 : pos + 1;
+            if (known(at(ring, pos))) {
+                ring.current = pos;
+                changed = true;
+                hash = at(ring, pos);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Hashes of the images shown now - the current entries of all monitors
+    void getCurrent(set<ULONGLONG>& hashes) const {
+        for (auto const& ring : rings) {
+            if (ring.second.count > 0) {
+                hashes.insert(at(ring.second, ring.second.current));
+            }
+        }
+    }
+
+    void write(ostream& out) const {
+        DWORD header[2] = { HISTORY_MAGIC, (DWORD)rings.size() };
+        out.write((const char*)header, sizeof(header));
+        for (auto const& ring : rings) {
+            DWORD sizes[3] = { (DWORD)ring.first.length(), (DWORD)ring.second.count, (DWORD)ring.second.current };
+            out.write((const char*)sizes, sizeof(sizes));
+            for (wchar_t c : ring.first) {
+                uint16_t unit = (uint16_t)c;
+                out.write((const char*)&unit, sizeof(unit));
+            }
+            for (size_t i = 0; i < ring.second.count; i++) {
+                ULONGLONG hash = at(ring.second, i);
+                out.write((const char*)&hash, sizeof(hash));
+            }
+        }
+    }
+
+    bool read(istream& in) {
+        DWORD header[2] = { 0 };
+        if (!in.read((char*)header, sizeof(header)) || header[0] != HISTORY_MAGIC) {
+            return false;
+        }
+        rings.clear();
+        for (DWORD r = 0; r < header[1]; r++) {
+            DWORD sizes[3];
+            if (!in.read((char*)sizes, sizeof(sizes)) || sizes[0] > MAX_PATH || sizes[1] > HISTORY_MAX_SIZE || sizes[2] >= max(sizes[1], (DWORD)1)) {
+                rings.clear();
+                return false;
+            }
+            wstring id(sizes[0], L'\0');
+            Ring ring = { vector<ULONGLONG>(sizes[1]), 0, sizes[1], sizes[2] };
+            for (DWORD i = 0; i < sizes[0]; i++) {
+                uint16_t unit = 0;
+                in.read((char*)&unit, sizeof(unit));
+                id[i] = (wchar_t)unit;
+            }
+            in.read((char*)ring.entries.data(), sizes[1] * sizeof(ULONGLONG));
+            if (!in) {
+                rings.clear();
+                return false;
+            }
+            resize(ring);
+            rings[id] = ring;
+        }
+        changed = false;
+        return true;
+    }
+
+protected:
+    bool                changed;        // since it was saved
+
+private:
+    typedef struct {
+        vector<ULONGLONG>   entries;    // hashes of image paths
+        size_t              first;      // the oldest entry
+        size_t              count;
+        size_t              current;    // shown now (counted from the oldest)
+    } Ring;
+
+    size_t                  capacity;
+    map<wstring, Ring>      rings;      // by monitor
+
+    ULONGLONG at(const Ring& ring, size_t i) const {
+        return ring.entries[(ring.first + i) % ring.entries.size()];
+    }
+
+    Ring& getRing(const wstring& monitorId) {
+        auto it = rings.find(monitorId);
+        if (it == rings.end()) {
+            Ring ring = { vector<ULONGLONG>(capacity), 0, 0, 0 };
+            it = rings.insert(std::make_pair(monitorId, ring)).first;
+        }
+        if (it->second.entries.size() != capacity) {
+            resize(it->second);
+        }
+        return it->second;
+    }
+
+    // Make the ring of the current capacity - the newest entries are kept
+    void resize(Ring& ring) {
+        size_t keep = min(ring.count, capacity);
+        size_t drop = ring.count - keep;
+        vector<ULONGLONG> entries(capacity);
+        for (size_t i = 0; i < keep; i++) {
+            entries[i] = at(ring, drop + i);
+        }
+        ring.entries.swap(entries);
+        ring.first = 0;
+        ring.count = keep;
+        ring.current = (ring.current >= drop) ? ring.current - drop : 0;
+    }
+};
+
+#pragma endregion
+
+
+
+#pragma region "SCHEDULE"
+
+// When wallpapers are changed automatically. AutoChangeSchedule (optional) is wall-clock aligned:
+// days (all if not given), then a period in minutes counted from midnight, or times of the day:
+//   "every 15"              at :00, :15, :30 and :45
+//   "mon-fri every 60"      every full hour on weekdays
+//   "sat,sun at 10:00,18:30"
+// Times here are local, in minutes since 1601 - the program converts them from and to UTC.
+#define MINUTES_PER_DAY                 1440
+
+typedef struct {
+    int             days;           // bit 0 - Sunday ... bit 6 - Saturday
+    int             period;         // minutes - or 0 if times are given
+    vector<int>     times;          // minutes after midnight, sorted
+} Schedule;
+
+
+inline int parseDayName(const wstring& name)
+{
+    static const wchar_t* names[] = { L"sun", L"mon", L"tue", L"wed", L"thu", L"fri", L"sat" };
+    for (int d = 0; d < 7; d++) {
+        if (name == names[d]) {
+            return d;
+        }
+    }
+    return -1;
+}
+
+
+// False if the text is empty or not a valid schedule
+inline bool parseSchedule(const wstring& text, Schedule& schedule)
+{
+    wstring lower(text);
+    transform(lower.begin(), lower.end(), lower.begin(), towlower);
+    wistringstream in(lower);
+    wstring word;
+    schedule.days = 0x7F;
+    schedule.period = 0;
+    schedule.times.clear();
+    if (!(in >> word)) {
+        return false;
+    }
+
+    if (word != L"every" && word != L"at") {
+        // Days and ranges of days, separated by commas
+        schedule.days = 0;
+        size_t start = 0;
+        while (start < word.length()) {
+            size_t end = word.find(L',', start);
+            if (end == wstring::npos) {
+                end = word.length();
+            }
+            wstring part = word.substr(start, end - start);
+            start = end + 1;
+            size_t dash = part.find(L'-');
+            int first = parseDayName(part.substr(0, dash));
+            int last = (dash == wstring::npos) ? first : parseDayName(part.substr(dash + 1));
+            if (first < 0 || last < 0) {
+                return false;
+            }
+            for (int d = first; ; d = (d + 1) % 7) {
+                schedule.days |= 1 << d;
+                if (d == last) {
+                    break;
+                }
+            }
+        }
+        if (!(in >> word)) {
+            return false;
+        }
+    }
+
+    wstring rest;
+    if (word == L"every") {
+        in >> schedule.period;
+        return !in.fail() && !(in >> rest) && schedule.period > 0 && schedule.period <= MINUTES_PER_DAY;
+    }
+    if (word == L"at" && (in >> word) && !(in >> rest)) {
+        size_t start = 0;
+        while (start < word.length()) {
+            size_t end = word.find(L',', start);
+            if (end == wstring::npos) {
+                end = word.length();
+            }
+            wistringstream time(word.substr(start, end - start));
+            int hour = -1;
+            int minute = -1;
+            wchar_t colon = 0;
+            time >> hour >> colon >> minute;
+            if (time.fail() || colon != L':' || hour < 0 || hour > 23 || minute < 0 || minute > 59) {
+                return false;
+            }
+            schedule.times.push_back(hour * 60 + minute);
+            start = end + 1;
+        }
+        sort(schedule.times.begin(), schedule.times.end());
+        return !schedule.times.empty();
+    }
+    return false;
+}
+
+
+// The first minute of the schedule later than the given one (local time) - 0 if there is none
+inline ULONGLONG getNextScheduledMinute(const Schedule& schedule, ULONGLONG now)
+{
+    ULONGLONG today = now / MINUTES_PER_DAY;
+    for (ULONGLONG day = today; day <= today + 7; day++) {
+        // 1 January 1601 was Monday
+        if ((schedule.days & (1 << ((day + 1) % 7))) == 0) {
+            continue;
+        }
+        int from = (day == today) ? (int)(now % MINUTES_PER_DAY) + 1 : 0;
+        int due = -1;
+        if (schedule.period > 0) {
+            due = (from + schedule.period - 1) / schedule.period * schedule.period;
+        }
+        else {
+            auto time = lower_bound(schedule.times.begin(), schedule.times.end(), from);
+            due = (time != schedule.times.end()) ? *time : -1;
+        }
+        if (due >= 0 && due < MINUTES_PER_DAY) {
+            return day * MINUTES_PER_DAY + due;
+        }
+    }
+    return 0;
+}
+
+#pragma endregion
+
+
+
+#pragma region "MONITOR LIST"
+
+// Monitors given as text (for batch mode), like "1920x1080,1080x1920+1920+0" - without
+// position they are placed side by side, left to right
+typedef struct {
+    int             left;
+    int             top;
+    int             width;
+    int             height;
+} MonitorLayout;
+
+
+// False if the text is not valid (or has no monitor)
+inline bool parseMonitors(const wstring& text, vector<MonitorLayout>& monitors)
+{
+    monitors.clear();
+    int nextLeft = 0;
+    size_t start = 0;
+    while (start < text.length()) {
+        size_t end = text.find(L',', start);
+        if (end == wstring::npos) {
+            end = text.length();
+        }
+        wistringstream in(text.substr(start, end - start));
+        start = end + 1;
+
+        MonitorLayout monitor = { nextLeft, 0, 0, 0 };
+        wchar_t x = 0;
+        in >> monitor.width >> x >> monitor.height;
+        if (in.fail() || x != L'x' || monitor.width <= 0 || monitor.height <= 0) {
+            return false;
+        }
+        wchar_t sign;
+        if (in >> sign) {
+            wchar_t sign2 = 0;
+            in >> monitor.left >> sign2 >> monitor.top;
+            if (in.fail() || (sign != L'+' && sign != L'-') || (sign2 != L'+' && sign2 != L'-')) {
+                return false;
+            }
+            monitor.left = (sign == L'-') ? -monitor.left : monitor.left;
+            monitor.top = (sign2 == L'-') ? -monitor.top : monitor.top;
+        }
+        monitors.push_back(monitor);
+        nextLeft = max(nextLeft, monitor.left + monitor.width);
+    }
+    return !monitors.empty();
+}
+
+#pragma endregion
+
+
+
+#pragma region "METRICS"
+
+// Histogram buckets: values below 8 exactly, above that 8 buckets for every power of two
+// (error up to 12.5%), up to 2^40 (~12 days in microseconds)
+#define METRIC_SUB_BITS         3
+#define METRIC_SUB_BUCKETS      (1 << METRIC_SUB_BITS)
+#define METRIC_MAX_BITS         40
+#define METRIC_BUCKETS          (METRIC_SUB_BUCKETS * (METRIC_MAX_BITS - METRIC_SUB_BITS + 1))
+
+// Distribution of values (usually times in microseconds) in logarithmic buckets. Any thread can
+// record values - only atomic operations are used, no locks, so the cost is a few instructions.
+class Histogram
+{
+public:
+    Histogram() : sum(0), highest(0) {
+        for (int i = 0; i < METRIC_BUCKETS; i++) {
+            buckets[i] = 0;
+        }
+    }
+
+    void record(LONGLONG v) {
+        if (v < 0) {
+            v = 0;
+        }
+        buckets[bucketOf(v)]++;
+        sum += v;
+        LONGLONG known = highest;
+        while (v > known && !highest.compare_exchange_weak(known, v)) {
+        }
+    }
+
+    // Counts of the buckets (other threads may be adding at the same time), returns their total
+    LONGLONG snapshot(LONGLONG* counts) const {
+        LONGLONG count = 0;
+        for (int i = 0; i < METRIC_BUCKETS; i++) {
+            counts[i] = buckets[i];
+            count += counts[i];
+        }
+        return count;
+    }
+
+    LONGLONG getSum() const {
+        return sum;
+    }
+
+    LONGLONG getMax() const {
+        return highest;
+    }
+
+    // Value that 'percent' % of the values don't exceed - the highest value of its bucket
+    LONGLONG percentile(const LONGLONG* counts, LONGLONG count, int percent) const {
+        LONGLONG rank = (count * percent + 99) / 100;
+        LONGLONG cumulative = 0;
+        for (int i = 0; i < METRIC_BUCKETS; i++) {
+            cumulative += counts[i];
+            if (cumulative >= rank && cumulative > 0) {
+                return min(upperBound(i), getMax());
+            }
+        }
+        return 0;
+    }
+
+    static int bucketOf(LONGLONG v) {
+        if (v < METRIC_SUB_BUCKETS) {
+            return (int)v;
+        }
+        if (v >= (1LL << METRIC_MAX_BITS)) {
+            return METRIC_BUCKETS - 1;
+        }
+        // Position of the highest bit, then the next bits select the sub-bucket
+        int e = 0;
+        for (int shift = 32; shift > 0; shift >>= 1) {
+            if ((v >> (e + shift)) != 0) {
+                e += shift;
+            }
+        }
+        return METRIC_SUB_BUCKETS * (e - METRIC_SUB_BITS + 1) + (int)((v >> (e - METRIC_SUB_BITS)) & (METRIC_SUB_BUCKETS - 1));
+    }
+
+    // The highest value counted in the bucket
+    static LONGLONG upperBound(int bucket) {
+        if (bucket < METRIC_SUB_BUCKETS) {
+            return bucket;
+        }
+        int e = bucket / METRIC_SUB_BUCKETS + METRIC_SUB_BITS - 1;
+        LONGLONG lower = (LONGLONG)(METRIC_SUB_BUCKETS + bucket % METRIC_SUB_BUCKETS) << (e - METRIC_SUB_BITS);
+        return lower + (1LL << (e - METRIC_SUB_BITS)) - 1;
+    }
+
+private:
+    atomic<LONGLONG>    buckets[METRIC_BUCKETS];
+    atomic<LONGLONG>    sum;
+    atomic<LONGLONG>    highest;
+};
+
+#pragma endregion
+
+
+
+#pragma region "EVENT TRACE"
+
+// Events recorded for replay (see wall.cpp) are kept in a binary file: header, then records one
+// after another - time [ms since start], type, length, payload.
+#define TRACE_MAGIC                     0x33525457      // "WTR3"
+// Longer records can't be real - the file is broken
+#define TRACE_MAX_RECORD                (64 * 1024 * 1024)
+
+typedef enum {
+    TraceMessage = 1,       // window message and its wParam
+    TraceMonitors,          // number of monitors, then for each of them: rectangle, ID
+    TraceImageAdded,        // path, image info (new or changed image)
+    TraceImageRemoved,      // path
+    TraceSettings,          // all the settings as in the ini file
+    TracePins,              // number of pinned monitors, then their IDs
+    TraceSetWallpapers,     // change, monitor (-1 for all)
+} TraceRecordType;
+
+typedef struct {
+    DWORD       magic;
+    DWORD       reserved;
+    ULONGLONG   started;        // FILETIME
+} TraceHeader;
+
+typedef struct {
+    DWORD       time;
+    USHORT      type;
+    USHORT      reserved;
+    DWORD       length;
+} TraceRecordHeader;
+
+
+// Payload of a record - written or read field by field
+class TraceRecord
+{
+public:
+    TraceRecord(TraceRecordType type = TraceMessage) : type(type), pos(0) {}
+
+    void put(const void* value, size_t size) {
+        data.insert(data.end(), (const BYTE*)value, (const BYTE*)value + size);
+    }
+
+    void put(DWORD value) {
+        put(&value, sizeof(value));
+    }
+
+    void put(const wstring& value) {
+        put((DWORD)value.length());
+        put(value.c_str(), value.length() * sizeof(wchar_t));
+    }
+
+    bool get(void* value, size_t size) {
+        if (pos + size > data.size()) {
+            return false;
+        }
+        memcpy(value, data.data() + pos, size);
+        pos += size;
+        return true;
+    }
+
+    bool get(DWORD& value) {
+        return get(&value, sizeof(value));
+    }
+
+    bool get(wstring& value) {
+        DWORD length;
+        if (!get(length) || pos + (size_t)length * sizeof(wchar_t) > data.size()) {
+            return false;
+        }
+        value.assign((const wchar_t*)(data.data() + pos), length);
+        pos += length * sizeof(wchar_t);
+        return true;
+    }
+
+    TraceRecordType     type;
+    vector<BYTE>        data;
+    size_t              pos;
+};
+
+
+inline void writeTraceHeader(ostream& out, ULONGLONG started)
+{
+    TraceHeader header = { TRACE_MAGIC, 0, started };
+    out.write((const char*)&header, sizeof(header));
+}
+
+
+inline bool readTraceHeader(istream& in, ULONGLONG& started)
+{
+    TraceHeader header;
+    if (!in.read((char*)&header, sizeof(header)) || header.magic != TRACE_MAGIC) {
+        return false;
+    }
+    started = header.started;
+    return true;
+}
+
+
+// False if the record is too long - nothing is written then
+inline bool writeTraceRecord(ostream& out, DWORD time, const TraceRecord& record)
+{
+    if (record.data.size() > TRACE_MAX_RECORD) {
+        return false;
+    }
+    TraceRecordHeader header = { time, (USHORT)record.type, 0, (DWORD)record.data.size() };
+    out.write((const char*)&header, sizeof(header));
+    out.write((const char*)record.data.data(), record.data.size());
+    return true;
+}
+
+
+// The next record and its time - false at the end of the file (or where it is broken)
+inline bool readTraceRecord(istream& in, DWORD& time, TraceRecord& record)
+{
+    TraceRecordHeader header;
+    if (!in.read((char*)&header, sizeof(header)) || header.length > TRACE_MAX_RECORD) {
+        return false;
+    }
+    time = header.time;
+    record.type = (TraceRecordType)header.type;
+    record.data.resize(header.length);
+    record.pos = 0;
+    return header.length == 0 || (bool)in.read((char*)record.data.data(), header.length);
+}
+
+#pragma endregion
+
+
+
+#pragma region "PUBLISHED VALUES"
+
+// Values changed by one thread and read by many (like settings): they are never changed in place,
+// a new copy is published atomically. Readers that took a snapshot keep using their copy as long
+// as they need it - no locks, and nothing changes under their hands.
+template<typename T>
+class PublishedValues
+{
+public:
+    PublishedValues() : current(new T()) {}
+
+    // Current values - for the thread that publishes them
+    const T* get() const {
+        return current.get();
+    }
+
+    // Values that stay valid however long they are used - for other threads
+    shared_ptr<const T> snapshot() const {
+        return std::atomic_load(&current);
+    }
+
+    void publish(const T& values) {
+        std::atomic_store(&current, shared_ptr<const T>(new T(values)));
+    }
+
+private:
+    shared_ptr<const T>     current;
+};
+
+#pragma endregion
+
+
+
+#pragma region "SETTINGS"
+
+// Conversions of setting values to and from the text in the ini file
+inline void settingToString(bool val, wstring& out) { out = val ? L"true" : L"false"; }
+inline void settingToString(int val, wstring& out) { out = std::to_wstring(val); }
+inline void settingToString(const wstring& val, wstring& out) { out = val; }
+inline void settingFromString(const wstring& str, bool& val) { val = (str == L"true"); }
+inline void settingFromString(const wstring& str, int& val) { val = std::stoi(str); }
+inline void settingFromString(const wstring& str, wstring& val) { val = str; }
+
+
+// Settings as "name=value" lines (T has forEach, see Settings in wall.cpp), unknown ones are skipped,
+// settings not found keep values they have. Returns number of settings read.
+template<typename T>
+int parseSettings(wistream& in, T& values)
+{
+    wstring line;
+    wstring name;
+    wstring value;
+    int found = 0;
+
+    while (std::getline(in, line))
+    {
+        // Split the ini file line
+        size_t pos = line.find(L"=");
+        if (pos == wstring::npos) {
+            // Exactly two tokens should be there
+            continue;
+        }
+        name = line.substr(0, pos);
+        value = line.substr(pos + 1);
+
+        values.forEach([&](const wchar_t* settingName, auto& setting) {
+            if (name == settingName) {
+                try {
+                    settingFromString(value, setting);
+                    found++;
+                }
+                catch (...) {
+                    // Ignore value that can't be parsed
+                }
+            }
+        });
+    }
+    return found;
+}
+
+
+template<typename T>
+wstring settingsToText(const T& values)
+{
+    wstring text;
+    wstring val;
+    values.forEach([&](const wchar_t* name, const auto& setting) {
+        settingToString(setting, val);
+        text += name;
+        text += L"=";
+        text += val;
+        text += L"\n";
+    });
+    return text;
+}
+
+
+
+typedef enum {
+    Different = 0,
+    Same,
+    Whatever,
+    Similar
+} MultiMonImage;
+
+
+// Where images are if the settings don't say - wall.cpp makes it the Pictures folder of the user
+#ifndef DEFAULT_IMAGE_DIRECTORY
+#define DEFAULT_IMAGE_DIRECTORY             wstring()
+#endif
+
+// Some settings that are needed for this application: name (the same in the ini file), type, default value
+#define WALL_SETTINGS(SETTING) \
+    SETTING(ImageDirectory,             wstring, DEFAULT_IMAGE_DIRECTORY) \
+    SETTING(ImageDirectoryWeight,       int,     1) \
+    SETTING(ExtraImageDirectories,      wstring, L"") \
+    SETTING(AllowUpscaling,             bool,    false) \
+    SETTING(AutoChangeImage,            bool,    false) \
+    SETTING(AutoChangeInterval,         int,     10) \
+    SETTING(AutoChangeSchedule,         wstring, L"") \
+    SETTING(AllowedAspectRatioMismatch, int,     1) \
+    SETTING(DisplayMode,                int,     DWPOS_FILL) \
+    SETTING(MultiMonPolicy,             int,     0) \
+    SETTING(EnableDebugLog,             bool,    false) \
+    SETTING(ScanMaxFilesPerSec,         int,     0) \
+    SETTING(ScanMaxMBPerSec,            int,     0) \
+    SETTING(ScanThreads,                int,     1) \
+    SETTING(SpanComposite,              bool,    false) \
+    SETTING(BezelCompensation,          int,     0) \
+    SETTING(SmartCrop,                  bool,    false) \
+    SETTING(SmartCropMismatch,          int,     200) \
+    SETTING(DarkFromHour,               int,     -1) \
+    SETTING(DarkToHour,                 int,     6) \
+    SETTING(DarkMaxLuminance,           int,     80) \
+    SETTING(NearDuplicateDistance,      int,     0) \
+    SETTING(SharedCatalogDirectory,     wstring, L"") \
+    SETTING(FeedUrl,                    wstring, L"") \
+    SETTING(FeedPollMinutes,            int,     60) \
+    SETTING(FeedConnections,            int,     4) \
+    SETTING(FeedCacheMB,                int,     1024) \
+    SETTING(TraceFile,                  wstring, L"") \
+    SETTING(IdleTrimMinutes,            int,     0) \
+    SETTING(HistorySize,                int,     100) \
+    SETTING(Filter,                     wstring, L"")
+
+#define WIDE_TEXT(text)                     L ## text
+#define SETTING_NAME(text)                  WIDE_TEXT(text)
+#define DECLARE_SETTING(name, type, def)    type name;
+#define DEFAULT_SETTING(name, type, def)    name = def;
+#define VISIT_SETTING(name, type, def)      f(SETTING_NAME(#name), name);
+
+typedef struct WallSettings {
+    WALL_SETTINGS(DECLARE_SETTING)
+
+    WallSettings() {
+        WALL_SETTINGS(DEFAULT_SETTING)
+    }
+
+    template<typename F> void forEach(F f) {
+        WALL_SETTINGS(VISIT_SETTING)
+    }
+
+    template<typename F> void forEach(F f) const {
+        WALL_SETTINGS(VISIT_SETTING)
+    }
+} WallSettings;
+
+
+// Folders with images and their weights: ImageDirectory and ExtraImageDirectories
+// (like "D:\\Wallpapers|3;E:\\Photos" - weight 1 if not given)
+inline void getConfiguredSources(const WallSettings& settings, map<wstring, int>& sources)
+{
+    parseSources(settings.ImageDirectory, settings.ImageDirectoryWeight, settings.ExtraImageDirectories, sources);
+}
+
+
+// Focus points and features of images are needed by smart crop and by the selection rules
+inline bool imageAnalysisNeeded(const WallSettings& settings)
+{
+    return settings.SmartCrop
+        || settings.DarkFromHour >= 0
+        || settings.NearDuplicateDistance > 0
+        || settings.MultiMonPolicy == MultiMonImage::Similar;
+}
+
+
+// What must be done when settings change (from the dialog, the file or a command)
+#define SETTINGS_READ_SOURCES           0x0001  // folders with images must be read again
+#define SETTINGS_NEW_WALLPAPER          0x0002  // ...and wallpapers changed when they are (main folder is another one)
+#define SETTINGS_WATCH_SOURCES          0x0004  // other folders to watch
+#define SETTINGS_CHOOSE_AGAIN           0x0008  // images chosen before may not be the right ones any more
+#define SETTINGS_RESCHEDULE             0x0010
+#define SETTINGS_RESTART_FEED           0x0020
+#define SETTINGS_IDLE_TRIM              0x0040
+#define SETTINGS_HISTORY_SIZE           0x0080
+
+// Folders are read again only when there are other ones, or when images must be analysed and were not -
+// the same folders written another way (trailing backslash, other order) are not read again.
+inline int getSettingsChanges(const WallSettings& old, const WallSettings& now)
+{
+    int changes = 0;
+    map<wstring, int> oldSources, nowSources;
+    getConfiguredSources(old, oldSources);
+    getConfiguredSources(now, nowSources);
+    bool sameFolders = oldSources.size() == nowSources.size()
+        && std::equal(oldSources.begin(), oldSources.end(), nowSources.begin(),
+            [](const pair<const wstring, int>& a, const pair<const wstring, int>& b) { return a.first == b.first; });
+
+    if (normalizeSource(old.ImageDirectory) != normalizeSource(now.ImageDirectory)) {
+        // Force changing the image when new images are read
+        changes |= SETTINGS_READ_SOURCES | SETTINGS_NEW_WALLPAPER | SETTINGS_WATCH_SOURCES;
+    }
+    else if (!sameFolders) {
+        // Sources added or removed - the others are read again too, it's cheap for unchanged folders
+        changes |= SETTINGS_READ_SOURCES | SETTINGS_WATCH_SOURCES;
+    }
+    else if (!imageAnalysisNeeded(old) && imageAnalysisNeeded(now)) {
+        changes |= SETTINGS_READ_SOURCES;
+    }
+    else if (old.AllowUpscaling != now.AllowUpscaling || old.AllowedAspectRatioMismatch != now.AllowedAspectRatioMismatch
+            || old.DisplayMode != now.DisplayMode || old.MultiMonPolicy != now.MultiMonPolicy
+            || old.SpanComposite != now.SpanComposite || old.BezelCompensation != now.BezelCompensation
+            || old.SmartCrop != now.SmartCrop || old.SmartCropMismatch != now.SmartCropMismatch
+            || old.DarkFromHour != now.DarkFromHour || old.DarkToHour != now.DarkToHour
+            || old.DarkMaxLuminance != now.DarkMaxLuminance || old.NearDuplicateDistance != now.NearDuplicateDistance
+            || old.Filter != now.Filter || oldSources != nowSources) {
+        changes |= SETTINGS_CHOOSE_AGAIN;
+    }
+
+    if (old.AutoChangeImage != now.AutoChangeImage || old.AutoChangeInterval != now.AutoChangeInterval
+            || old.AutoChangeSchedule != now.AutoChangeSchedule) {
+        changes |= SETTINGS_RESCHEDULE;
+    }
+    if (old.FeedUrl != now.FeedUrl || old.FeedPollMinutes != now.FeedPollMinutes
+            || old.FeedConnections != now.FeedConnections || old.FeedCacheMB != now.FeedCacheMB) {
+        changes |= SETTINGS_RESTART_FEED;
+    }
+    if (old.IdleTrimMinutes != now.IdleTrimMinutes) {
+        changes |= SETTINGS_IDLE_TRIM;
+    }
+    if (old.HistorySize != now.HistorySize) {
+        changes |= SETTINGS_HISTORY_SIZE;
+    }
+    return changes;
+}
+
+#pragma endregion